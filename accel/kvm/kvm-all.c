@@ -82,6 +82,8 @@
 #define  KVM_MEMSLOTS_NR_ALLOC_DEFAULT                      16
 /* Default max allowed memslots if kernel reported nothing */
 #define  KVM_MEMSLOTS_NR_MAX_DEFAULT                        32
+/* Max threads reaping the dirty rings */
+#define  KVM_DIRTY_RING_REAPERS_MAX                         64
 
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
@@ -544,6 +546,7 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
         cpu->kvm_dirty_gfns = NULL;
     }
 
+    kvm_exit_profile_free(cpu);
     kvm_park_vcpu(cpu);
 err:
     return ret;
@@ -687,6 +690,7 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
     return kvm_set_user_memory_region(kml, mem, false);
 }
 
+/* Called with KVMMemoryListener.slots_lock held */
 static int kvm_section_update_flags(KVMMemoryListener *kml,
                                     MemoryRegionSection *section)
 {
@@ -695,18 +699,13 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
     int ret = 0;
 
     size = kvm_align_section(section, &start_addr);
-    if (!size) {
-        return 0;
-    }
-
-    kvm_slots_lock();
 
     while (size && !ret) {
         slot_size = MIN(kvm_max_slot_size, size);
         mem = kvm_lookup_matching_slot(kml, start_addr, slot_size);
         if (!mem) {
             /* We don't have a slot if we want to trap every access. */
-            goto out;
+            break;
         }
 
         ret = kvm_slot_update_flags(kml, mem, section->mr);
@@ -714,26 +713,38 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
         size -= slot_size;
     }
 
-out:
-    kvm_slots_unlock();
     return ret;
 }
 
+/*
+ * Dirty logging changes are queued like region additions and removals and
+ * applied by kvm_region_commit(), so that toggling dirty logging for all
+ * of guest memory takes the slots lock once per transaction rather than
+ * once per section.
+ */
+static void kvm_region_update_flags(KVMMemoryListener *kml,
+                                    MemoryRegionSection *section)
+{
+    KVMMemoryUpdate *update;
+
+    update = g_new0(KVMMemoryUpdate, 1);
+    update->section = *section;
+    memory_region_ref(section->mr);
+
+    QSIMPLEQ_INSERT_TAIL(&kml->transaction_flags, update, next);
+}
+
 static void kvm_log_start(MemoryListener *listener,
                           MemoryRegionSection *section,
                           int old, int new)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
-    int r;
 
     if (old != 0) {
         return;
     }
 
-    r = kvm_section_update_flags(kml, section);
-    if (r < 0) {
-        abort();
-    }
+    kvm_region_update_flags(kml, section);
 }
 
 static void kvm_log_stop(MemoryListener *listener,
@@ -741,16 +752,12 @@ static void kvm_log_stop(MemoryListener *listener,
                           int old, int new)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
-    int r;
 
     if (new != 0) {
         return;
     }
 
-    r = kvm_section_update_flags(kml, section);
-    if (r < 0) {
-        abort();
-    }
+    kvm_region_update_flags(kml, section);
 }
 
 /* get kvm's dirty pages bitmap and update qemu's */
@@ -823,9 +830,13 @@ static bool kvm_slot_get_dirty_log(KVMState *s, KVMSlot *slot)
     return ret == 0;
 }
 
-/* Should be with all slots_lock held for the address spaces. */
+/*
+ * Should be with all slots_lock held for the address spaces.  @atomic must
+ * be set if other threads may mark pages at the same time.
+ */
 static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
-                                     uint32_t slot_id, uint64_t offset)
+                                     uint32_t slot_id, uint64_t offset,
+                                     bool atomic)
 {
     KVMMemoryListener *kml;
     KVMSlot *mem;
@@ -842,7 +853,11 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
         return;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    if (atomic) {
+        set_bit_atomic(offset, mem->dirty_bmap);
+    } else {
+        set_bit(offset, mem->dirty_bmap);
+    }
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -879,7 +894,8 @@ static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
  * Should be with all slots_lock held for the address spaces.  It returns the
  * dirty page we've collected on this dirty ring.
  */
-static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu,
+                                        bool atomic)
 {
     struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
     uint32_t ring_size = s->kvm_dirty_ring_size;
@@ -903,7 +919,7 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
             break;
         }
         kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
-                                 cur->offset);
+                                 cur->offset, atomic);
         dirty_gfn_set_collected(cur);
         trace_kvm_dirty_ring_page(cpu->cpu_index, fetch, cur->offset);
         fetch++;
@@ -915,9 +931,29 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
+/*
+ * Should be with all slots_lock held for the address spaces.  Reap the
+ * rings of the vCPUs whose index is @share modulo @nr_shares.
+ */
+static uint64_t kvm_dirty_ring_reap_share(KVMState *s, unsigned int share,
+                                          unsigned int nr_shares)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index % nr_shares == share) {
+            total += kvm_dirty_ring_reap_one(s, cpu, nr_shares > 1);
+        }
+    }
+
+    return total;
+}
+
 /* Must be with slots_lock held */
 static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 {
+    struct KVMDirtyRingReaper *r = &s->reaper;
     int ret;
     uint64_t total = 0;
     int64_t stamp;
@@ -925,10 +961,24 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     stamp = get_clock();
 
     if (cpu) {
-        total = kvm_dirty_ring_reap_one(s, cpu);
+        total = kvm_dirty_ring_reap_one(s, cpu, false);
+    } else if (!r->nr_workers) {
+        total = kvm_dirty_ring_reap_share(s, 0, 1);
     } else {
-        CPU_FOREACH(cpu) {
-            total += kvm_dirty_ring_reap_one(s, cpu);
+        /*
+         * Each vCPU ring is reaped by exactly one thread, so only the slot
+         * dirty bitmaps are shared.  The single KVM_RESET_DIRTY_RINGS below
+         * still comes after all of them, once the workers are done.
+         */
+        for (unsigned int i = 0; i < r->nr_workers; i++) {
+            qemu_sem_post(&r->workers[i].sem);
+        }
+        total = kvm_dirty_ring_reap_share(s, 0, r->nr_workers + 1);
+        for (unsigned int i = 0; i < r->nr_workers; i++) {
+            qemu_sem_wait(&r->workers_done);
+        }
+        for (unsigned int i = 0; i < r->nr_workers; i++) {
+            total += r->workers[i].total;
         }
     }
 
@@ -1661,9 +1711,45 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
     g_assert_not_reached();
 }
 
+static void *kvm_dirty_ring_reap_worker_thread(void *data)
+{
+    struct KVMDirtyRingReapWorker *w = data;
+    struct KVMDirtyRingReaper *r = &kvm_state->reaper;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&w->sem);
+
+        /* The caller holds the slots lock and the BQL until we are done */
+        WITH_RCU_READ_LOCK_GUARD() {
+            w->total = kvm_dirty_ring_reap_share(kvm_state, w->share,
+                                                 r->nr_workers + 1);
+        }
+
+        qemu_sem_post(&r->workers_done);
+    }
+
+    g_assert_not_reached();
+}
+
 static void kvm_dirty_ring_reaper_init(KVMState *s)
 {
     struct KVMDirtyRingReaper *r = &s->reaper;
+    unsigned int nr_workers = s->kvm_dirty_ring_reapers - 1;
+
+    qemu_sem_init(&r->workers_done, 0);
+    r->workers = g_new0(struct KVMDirtyRingReapWorker, nr_workers);
+    for (unsigned int i = 0; i < nr_workers; i++) {
+        struct KVMDirtyRingReapWorker *w = &r->workers[i];
+        g_autofree char *name = g_strdup_printf("kvm-reaper-%u", i + 1);
+
+        qemu_sem_init(&w->sem, 0);
+        w->share = i + 1;
+        qemu_thread_create(&w->thread, name, kvm_dirty_ring_reap_worker_thread,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+    r->nr_workers = nr_workers;
 
     qemu_thread_create(&r->reaper_thr, "kvm-reaper",
                        kvm_dirty_ring_reaper_thread,
@@ -1765,7 +1851,8 @@ static void kvm_region_commit(MemoryListener *listener)
     bool need_inhibit = false;
 
     if (QSIMPLEQ_EMPTY(&kml->transaction_add) &&
-        QSIMPLEQ_EMPTY(&kml->transaction_del)) {
+        QSIMPLEQ_EMPTY(&kml->transaction_del) &&
+        QSIMPLEQ_EMPTY(&kml->transaction_flags)) {
         return;
     }
 
@@ -1822,6 +1909,23 @@ static void kvm_region_commit(MemoryListener *listener)
         g_free(u1);
     }
 
+    /*
+     * Slots added above already got their flags from kvm_mem_flags(), and
+     * removed ones are no longer found, so only the slots that stayed are
+     * touched here.
+     */
+    while (!QSIMPLEQ_EMPTY(&kml->transaction_flags)) {
+        u1 = QSIMPLEQ_FIRST(&kml->transaction_flags);
+        QSIMPLEQ_REMOVE_HEAD(&kml->transaction_flags, next);
+
+        if (kvm_section_update_flags(kml, &u1->section) < 0) {
+            abort();
+        }
+        memory_region_unref(u1->section.mr);
+
+        g_free(u1);
+    }
+
     if (need_inhibit) {
         accel_ioctl_inhibit_end();
     }
@@ -1970,6 +2074,7 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     QSIMPLEQ_INIT(&kml->transaction_add);
     QSIMPLEQ_INIT(&kml->transaction_del);
+    QSIMPLEQ_INIT(&kml->transaction_flags);
 
     kml->listener.region_add = kvm_region_add;
     kml->listener.region_del = kvm_region_del;
@@ -3235,6 +3340,10 @@ int kvm_cpu_exec(CPUState *cpu)
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
+            if (unlikely(qatomic_read(&kvm_state->exit_profile))) {
+                kvm_exit_profile_record(cpu, run->io.port, true,
+                                        run->io.direction == KVM_EXIT_IO_OUT);
+            }
             /* Called outside BQL */
             kvm_handle_io(run->io.port, attrs,
                           (uint8_t *)run + run->io.data_offset,
@@ -3244,6 +3353,10 @@ int kvm_cpu_exec(CPUState *cpu)
             ret = 0;
             break;
         case KVM_EXIT_MMIO:
+            if (unlikely(qatomic_read(&kvm_state->exit_profile))) {
+                kvm_exit_profile_record(cpu, run->mmio.phys_addr, false,
+                                        run->mmio.is_write);
+            }
             /* Called outside BQL */
             address_space_rw(&address_space_memory,
                              run->mmio.phys_addr, attrs,
@@ -3943,6 +4056,40 @@ static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
     s->kvm_dirty_ring_size = value;
 }
 
+static void kvm_get_dirty_ring_reapers(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_reapers;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_reapers(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (s->fd != -1) {
+        error_setg(errp, "Cannot set properties after the accelerator has been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value || value > KVM_DIRTY_RING_REAPERS_MAX) {
+        error_setg(errp, "dirty-ring-reapers must be between 1 and %d",
+                   KVM_DIRTY_RING_REAPERS_MAX);
+        return;
+    }
+
+    s->kvm_dirty_ring_reapers = value;
+}
+
 static char *kvm_get_device(Object *obj,
                             Error **errp G_GNUC_UNUSED)
 {
@@ -3961,6 +4108,20 @@ static void kvm_set_device(Object *obj,
     s->device = g_strdup(value);
 }
 
+static bool kvm_get_exit_profile(Object *obj, Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+
+    return qatomic_read(&s->exit_profile);
+}
+
+static void kvm_set_exit_profile(Object *obj, bool value, Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+
+    qatomic_set(&s->exit_profile, value);
+}
+
 static void kvm_set_kvm_rapl(Object *obj, bool value, Error **errp)
 {
     KVMState *s = KVM_STATE(obj);
@@ -3987,6 +4148,7 @@ static void kvm_accel_instance_init(Object *obj)
     s->kernel_irqchip_split = ON_OFF_AUTO_AUTO;
     /* KVM dirty ring is by default off */
     s->kvm_dirty_ring_size = 0;
+    s->kvm_dirty_ring_reapers = 1;
     s->kvm_dirty_ring_with_bitmap = false;
     s->kvm_eager_split_size = 0;
     s->notify_vmexit = NOTIFY_VMEXIT_OPTION_RUN;
@@ -4017,6 +4179,7 @@ static void kvm_accel_class_init(ObjectClass *oc, const void *data)
     ac->has_memory = kvm_accel_has_memory;
     ac->allowed = &kvm_allowed;
     ac->gdbstub_supported_sstep_flags = kvm_gdbstub_sstep_flags;
+    ac->get_stats = kvm_get_stats;
 
     object_class_property_add(oc, "kernel-irqchip", "on|off|split",
         NULL, kvm_set_kernel_irqchip,
@@ -4036,6 +4199,18 @@ static void kvm_accel_class_init(ObjectClass *oc, const void *data)
     object_class_property_set_description(oc, "dirty-ring-size",
         "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 
+    object_class_property_add(oc, "dirty-ring-reapers", "uint32",
+        kvm_get_dirty_ring_reapers, kvm_set_dirty_ring_reapers,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-reapers",
+        "Number of threads collecting the KVM dirty rings (default: 1)");
+
+    object_class_property_add_bool(oc, "x-exit-profile",
+                                   kvm_get_exit_profile,
+                                   kvm_set_exit_profile);
+    object_class_property_set_description(oc, "x-exit-profile",
+        "Count userspace MMIO/PIO exits per guest address (default: off)");
+
     object_class_property_add_str(oc, "device", kvm_get_device, kvm_set_device);
     object_class_property_set_description(oc, "device",
         "Path to the device node to use (default: /dev/kvm)");
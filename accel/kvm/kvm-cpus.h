@@ -20,4 +20,8 @@ bool kvm_supports_guest_debug(void);
 int kvm_insert_breakpoint(CPUState *cpu, int type, vaddr addr, vaddr len);
 int kvm_remove_breakpoint(CPUState *cpu, int type, vaddr addr, vaddr len);
 void kvm_remove_all_breakpoints(CPUState *cpu);
+void kvm_exit_profile_record(CPUState *cpu, uint64_t addr, bool pio,
+                             bool is_write);
+void kvm_exit_profile_free(CPUState *cpu);
+void kvm_get_stats(AccelState *as, GString *buf);
 #endif /* KVM_CPUS_H */
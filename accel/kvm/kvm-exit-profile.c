@@ -0,0 +1,184 @@
+/*
+ * KVM MMIO/PIO exit profiler
+ *
+ * Counts the userspace MMIO and port I/O exits of every vCPU by guest
+ * address, so that the registers responsible for exit storms can be
+ * found with "info accel" / x-accel-stats.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "hw/core/cpu.h"
+#include "system/kvm_int.h"
+#include "system/memory.h"
+#include "system/address-spaces.h"
+#include "kvm-cpus.h"
+
+/*
+ * Each vCPU owns an open-addressed table that only it writes to, so
+ * recording an exit needs no lock and no atomic read-modify-write.
+ * Readers sum the tables with plain atomic loads and may see counts that
+ * are slightly out of date.
+ */
+#define KVM_EXIT_PROFILE_BITS   8
+#define KVM_EXIT_PROFILE_SIZE   (1 << KVM_EXIT_PROFILE_BITS)
+#define KVM_EXIT_PROFILE_PROBES 8
+
+/* Number of entries printed */
+#define KVM_EXIT_PROFILE_TOP    32
+/* Minimum number of writes before a write-only register is reported */
+#define KVM_EXIT_PROFILE_HOT    1000
+
+typedef struct KVMExitProfileEntry {
+    /* Guest address << 2 | 1 for MMIO, 2 for PIO; 0 if the entry is free */
+    uint64_t key;
+    uint64_t reads;
+    uint64_t writes;
+} KVMExitProfileEntry;
+
+typedef struct KVMExitProfile {
+    KVMExitProfileEntry entries[KVM_EXIT_PROFILE_SIZE];
+    /* Exits that did not fit in the table */
+    uint64_t dropped;
+} KVMExitProfile;
+
+static inline uint64_t kvm_exit_profile_key(uint64_t addr, bool pio)
+{
+    return addr << 2 | (pio ? 2 : 1);
+}
+
+/* Called from the vCPU thread */
+void kvm_exit_profile_record(CPUState *cpu, uint64_t addr, bool pio,
+                             bool is_write)
+{
+    KVMExitProfile *profile = cpu->kvm_exit_profile;
+    uint64_t key = kvm_exit_profile_key(addr, pio);
+    unsigned int hash, i;
+
+    if (!profile) {
+        profile = g_new0(KVMExitProfile, 1);
+        qatomic_store_release(&cpu->kvm_exit_profile, profile);
+    }
+
+    hash = (key * 0x9e3779b97f4a7c15ULL) >> (64 - KVM_EXIT_PROFILE_BITS);
+    for (i = 0; i < KVM_EXIT_PROFILE_PROBES; i++) {
+        KVMExitProfileEntry *e =
+            &profile->entries[(hash + i) & (KVM_EXIT_PROFILE_SIZE - 1)];
+
+        if (!e->key) {
+            qatomic_set(&e->key, key);
+        }
+        if (e->key == key) {
+            if (is_write) {
+                qatomic_set(&e->writes, e->writes + 1);
+            } else {
+                qatomic_set(&e->reads, e->reads + 1);
+            }
+            return;
+        }
+    }
+    qatomic_set(&profile->dropped, profile->dropped + 1);
+}
+
+/* Called with the BQL held, when the vCPU no longer runs */
+void kvm_exit_profile_free(CPUState *cpu)
+{
+    g_free(cpu->kvm_exit_profile);
+    cpu->kvm_exit_profile = NULL;
+}
+
+static gint kvm_exit_profile_compare(gconstpointer a, gconstpointer b)
+{
+    const KVMExitProfileEntry *ea = a, *eb = b;
+    uint64_t ta = ea->reads + ea->writes;
+    uint64_t tb = eb->reads + eb->writes;
+
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+void kvm_get_stats(AccelState *as, GString *buf)
+{
+    KVMState *s = KVM_STATE(as);
+    g_autoptr(GHashTable) totals =
+        g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    g_autoptr(GList) list = NULL;
+    uint64_t dropped = 0;
+    unsigned int n = 0;
+    CPUState *cpu;
+    GList *l;
+
+    CPU_FOREACH(cpu) {
+        KVMExitProfile *profile = qatomic_load_acquire(&cpu->kvm_exit_profile);
+        int i;
+
+        if (!profile) {
+            continue;
+        }
+        dropped += qatomic_read(&profile->dropped);
+        for (i = 0; i < KVM_EXIT_PROFILE_SIZE; i++) {
+            KVMExitProfileEntry *e = &profile->entries[i];
+            uint64_t key = qatomic_read(&e->key);
+            KVMExitProfileEntry *t;
+
+            if (!key) {
+                continue;
+            }
+            t = g_hash_table_lookup(totals, &key);
+            if (!t) {
+                t = g_new0(KVMExitProfileEntry, 1);
+                t->key = key;
+                g_hash_table_insert(totals, &t->key, t);
+            }
+            t->reads += qatomic_read(&e->reads);
+            t->writes += qatomic_read(&e->writes);
+        }
+    }
+
+    if (!qatomic_read(&s->exit_profile) && !g_hash_table_size(totals)) {
+        g_string_append_printf(buf, "KVM exit profile: disabled "
+                               "(enable with x-exit-profile=on)\n");
+        return;
+    }
+
+    g_string_append_printf(buf, "KVM userspace MMIO/PIO exits:\n");
+    g_string_append_printf(buf, "  %-4s %-18s %14s %14s  %s\n",
+                           "type", "address", "reads", "writes", "region");
+
+    list = g_list_sort(g_hash_table_get_values(totals),
+                       kvm_exit_profile_compare);
+    for (l = list; l && n < KVM_EXIT_PROFILE_TOP; l = l->next, n++) {
+        KVMExitProfileEntry *t = l->data;
+        bool pio = t->key & 2;
+        uint64_t addr = t->key >> 2;
+        MemoryRegionSection section =
+            memory_region_find(pio ? get_system_io() : get_system_memory(),
+                               addr, 1);
+        const char *name = section.mr ? memory_region_name(section.mr) : "";
+
+        g_string_append_printf(buf, "  %-4s 0x%016" PRIx64 " %14" PRIu64
+                               " %14" PRIu64 "  %s",
+                               pio ? "pio" : "mmio", addr, t->reads,
+                               t->writes, *name ? name : "(unnamed)");
+        /*
+         * Only a hint: coalescing delays the side effects of a write until
+         * the next exit, which is only safe for registers whose writes the
+         * device model does not need to observe immediately.
+         */
+        if (!t->reads && t->writes >= KVM_EXIT_PROFILE_HOT) {
+            g_string_append_printf(buf, " [write-only, coalescing "
+                                   "candidate]");
+        }
+        g_string_append_c(buf, '\n');
+
+        if (section.mr) {
+            memory_region_unref(section.mr);
+        }
+    }
+
+    if (dropped) {
+        g_string_append_printf(buf, "  %" PRIu64 " exits not recorded "
+                               "(per-vCPU table full)\n", dropped);
+    }
+}
@@ -17,6 +17,7 @@
 #include "qapi/error.h"
 #include "qapi/qapi-builtin-visit.h"
 #include "qapi/visitor.h"
+#include "qemu/error-report.h"
 #include "qemu/config-file.h"
 #include "qom/object_interfaces.h"
 #include "qemu/mmap-alloc.h"
@@ -257,6 +258,61 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 }
 
+static bool host_memory_backend_get_prealloc_background(Object *obj,
+                                                        Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->prealloc_background;
+}
+
+static void host_memory_backend_set_prealloc_background(Object *obj,
+                                                        bool value,
+                                                        Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_mr_inited(backend)) {
+        error_setg(errp, "cannot change property value");
+        return;
+    }
+    backend->prealloc_background = value;
+}
+
+static void host_memory_backend_prealloc_done(void *opaque, int ret)
+{
+    HostMemoryBackend *backend = opaque;
+    g_autofree char *name = host_memory_backend_get_name(backend);
+
+    backend->prealloc_running = false;
+    ram_block_discard_disable(false);
+    if (ret) {
+        /*
+         * The guest is already running, so there is nothing to fail;
+         * untouched pages are simply faulted in on demand.
+         */
+        warn_report("memory backend '%s': background preallocation "
+                    "failed: %s", name, strerror(-ret));
+        backend->prealloc_status = MEMDEV_PREALLOC_STATUS_FAILED;
+    } else {
+        backend->prealloc_status = MEMDEV_PREALLOC_STATUS_COMPLETED;
+    }
+    object_unref(OBJECT(backend));
+}
+
+bool host_memory_backend_prealloc_status(HostMemoryBackend *backend,
+                                         MemdevPreallocStatus *status,
+                                         uint64_t *done)
+{
+    if (!backend->prealloc || !backend->prealloc_background ||
+        !host_memory_backend_mr_inited(backend)) {
+        return false;
+    }
+    *status = backend->prealloc_status;
+    *done = qatomic_read(&backend->prealloc_done);
+    return true;
+}
+
 static void host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
     const char *name, void *opaque, Error **errp)
 {
@@ -423,6 +479,33 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
      * This is necessary to guarantee memory is allocated with
      * specified NUMA policy in place.
      */
+    if (backend->prealloc && backend->prealloc_background) {
+        /*
+         * Discarding memory while it is being populated would silently
+         * repopulate it, so keep discards (virtio-mem, virtio-balloon)
+         * disabled until the threads are done.
+         */
+        if (ram_block_discard_disable(true)) {
+            error_setg(errp, "background preallocation is not possible "
+                       "while RAM discards are required");
+            return;
+        }
+        /* Keep the backend alive until the threads are done with it */
+        object_ref(OBJECT(backend));
+        backend->prealloc_running = true;
+        backend->prealloc_status = MEMDEV_PREALLOC_STATUS_RUNNING;
+        if (!qemu_prealloc_mem_background(memory_region_get_fd(&backend->mr),
+                                          ptr, sz, backend->prealloc_threads,
+                                          backend->prealloc_context,
+                                          &backend->prealloc_done,
+                                          host_memory_backend_prealloc_done,
+                                          backend, errp)) {
+            backend->prealloc_running = false;
+            object_unref(OBJECT(backend));
+            ram_block_discard_disable(false);
+        }
+        return;
+    }
     if (backend->prealloc && !qemu_prealloc_mem(memory_region_get_fd(&backend->mr),
                                                 ptr, sz,
                                                 backend->prealloc_threads,
@@ -435,7 +518,10 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
 static bool
 host_memory_backend_can_be_deleted(UserCreatable *uc)
 {
-    if (host_memory_backend_is_mapped(MEMORY_BACKEND(uc))) {
+    HostMemoryBackend *backend = MEMORY_BACKEND(uc);
+
+    if (host_memory_backend_is_mapped(backend) ||
+        backend->prealloc_running) {
         return false;
     } else {
         return true;
@@ -535,6 +621,11 @@ host_memory_backend_class_init(ObjectClass *oc, const void *data)
         object_property_allow_set_link, OBJ_PROP_LINK_STRONG);
     object_class_property_set_description(oc, "prealloc-context",
         "Context to use for creating CPU threads for preallocation");
+    object_class_property_add_bool(oc, "prealloc-background",
+        host_memory_backend_get_prealloc_background,
+        host_memory_backend_set_prealloc_background);
+    object_class_property_set_description(oc, "prealloc-background",
+        "Preallocate memory while the guest is already running");
     object_class_property_add(oc, "size", "int",
         host_memory_backend_get_size,
         host_memory_backend_set_size,
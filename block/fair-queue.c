@@ -0,0 +1,834 @@
+/*
+ * Hierarchical fair-queueing filter driver
+ *
+ * Copyright (c) 2026 The QEMU Project Developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Unlike the throttle driver, which enforces fixed caps per group, this
+ * driver shares bandwidth between a tree of fair-queue-group objects:
+ *
+ * - every group has a guaranteed rate (bps-min) and a ceiling (bps-max);
+ * - a request may always use the guaranteed rate of its own group;
+ * - beyond that it may borrow unused bandwidth from any ancestor, as long
+ *   as no ceiling on its path to the root is exceeded;
+ * - contending borrowers are served in order of their weighted virtual
+ *   time, so spare capacity is split in proportion to the group weights.
+ *
+ * A root group without bps-max has unlimited capacity and lends freely,
+ * which makes the scheduler work-conserving: bandwidth that a tenant does
+ * not use is available to everybody else.
+ *
+ * Token buckets are refilled lazily.  All state of a hierarchy is
+ * protected by the lock of its root group, so members of the same tree
+ * may live in different AioContexts.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+#include "qom/object.h"
+#include "qom/object_interfaces.h"
+#include "trace.h"
+
+#define TYPE_FAIR_QUEUE_GROUP "fair-queue-group"
+OBJECT_DECLARE_SIMPLE_TYPE(FairQueueGroup, FAIR_QUEUE_GROUP)
+
+#define FAIR_QUEUE_OPT_GROUP "fair-queue-group"
+
+/* How much unused bandwidth a bucket may accumulate */
+#define FQ_BURST_NS         (100 * SCALE_MS)
+
+/* Small requests are charged as if they were this large */
+#define FQ_MIN_COST         4096
+
+/* Bounds for the time a waiting request sleeps before re-checking */
+#define FQ_MIN_WAIT_NS      (10 * SCALE_US)
+#define FQ_MAX_WAIT_NS      (100 * SCALE_MS)
+
+#define FQ_DEFAULT_WEIGHT   100
+#define FQ_MAX_WEIGHT       10000
+
+typedef struct FairQueueWaiter FairQueueWaiter;
+
+typedef struct FairQueueBucket {
+    uint64_t rate;          /* bytes per second, 0 if unset */
+    int64_t level;          /* may go negative when a request overdraws */
+    int64_t last_ns;
+} FairQueueBucket;
+
+struct FairQueueGroup {
+    Object parent_obj;
+
+    /* Properties, constant once the object is complete */
+    char *parent_id;
+    uint32_t weight;
+    uint64_t bps_min;
+    uint64_t bps_max;
+    bool is_initialized;
+
+    FairQueueGroup *parent;
+    FairQueueGroup *root;
+
+    /* Only used in the root group; protects everything below */
+    QemuMutex lock;
+    QLIST_HEAD(, FairQueueGroup) all_groups;
+
+    QLIST_ENTRY(FairQueueGroup) all_next;
+    unsigned nr_children;
+    unsigned nr_members;
+
+    FairQueueBucket tokens;     /* guaranteed rate (ceiling for the root) */
+    FairQueueBucket ctokens;    /* ceiling */
+    uint64_t vtime;
+    QTAILQ_HEAD(, FairQueueWaiter) waiters;
+};
+
+typedef struct BDRVFairQueueState {
+    FairQueueGroup *group;
+    unsigned io_limits_disabled;    /* protected by the root lock */
+} BDRVFairQueueState;
+
+struct FairQueueWaiter {
+    BDRVFairQueueState *member;
+    int64_t cost;
+    Coroutine *co;
+    AioContext *ctx;
+    QEMUTimer timer;
+    bool sleeping;
+    QTAILQ_ENTRY(FairQueueWaiter) next;
+};
+
+static void fq_bucket_init(FairQueueBucket *b, uint64_t rate, int64_t now)
+{
+    b->rate = rate;
+    b->level = muldiv64(rate, FQ_BURST_NS, NANOSECONDS_PER_SECOND);
+    b->last_ns = now;
+}
+
+static void fq_bucket_refill(FairQueueBucket *b, int64_t now)
+{
+    int64_t burst, delta;
+
+    if (!b->rate || now <= b->last_ns) {
+        return;
+    }
+    /* Anything beyond one burst would be capped anyway */
+    delta = MIN(now - b->last_ns, FQ_BURST_NS);
+    burst = muldiv64(b->rate, FQ_BURST_NS, NANOSECONDS_PER_SECOND);
+    b->level += muldiv64(b->rate, delta, NANOSECONDS_PER_SECOND);
+    b->level = MIN(b->level, burst);
+    b->last_ns = now;
+}
+
+/* Nanoseconds until the bucket is no longer in debt */
+static int64_t fq_bucket_wait_ns(FairQueueBucket *b)
+{
+    if (b->level >= 0) {
+        return 0;
+    }
+    if (!b->rate) {
+        return INT64_MAX;
+    }
+    return (double)-b->level * NANOSECONDS_PER_SECOND / b->rate;
+}
+
+static bool fq_group_has_tokens(FairQueueGroup *g)
+{
+    /* An unlimited root always has bandwidth to lend */
+    if (!g->tokens.rate) {
+        return !g->parent && !g->bps_max;
+    }
+    return g->tokens.level >= 0;
+}
+
+static bool fq_group_under_ceiling(FairQueueGroup *g)
+{
+    return !g->ctokens.rate || g->ctokens.level >= 0;
+}
+
+static void fq_refill_path(FairQueueGroup *g, int64_t now)
+{
+    for (; g; g = g->parent) {
+        fq_bucket_refill(&g->tokens, now);
+        fq_bucket_refill(&g->ctokens, now);
+    }
+}
+
+static bool fq_path_under_ceiling(FairQueueGroup *g)
+{
+    for (; g; g = g->parent) {
+        if (!fq_group_under_ceiling(g)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Lowest virtual time of all groups, other than @self, that have requests
+ * queued which are only held back by the lack of tokens.  Groups that are
+ * stuck at a ceiling do not compete for spare bandwidth.
+ */
+static uint64_t fq_min_backlogged_vtime(FairQueueGroup *self)
+{
+    FairQueueGroup *g;
+    uint64_t min = UINT64_MAX;
+
+    QLIST_FOREACH(g, &self->root->all_groups, all_next) {
+        if (g == self || QTAILQ_EMPTY(&g->waiters) ||
+            !fq_path_under_ceiling(g)) {
+            continue;
+        }
+        min = MIN(min, g->vtime);
+    }
+    return min;
+}
+
+static void fq_charge(FairQueueGroup *self, int64_t cost, bool borrowed)
+{
+    FairQueueGroup *g;
+
+    if (borrowed) {
+        self->vtime += cost * FQ_MAX_WEIGHT / self->weight;
+    }
+    for (g = self; g; g = g->parent) {
+        if (g->tokens.rate) {
+            g->tokens.level -= cost;
+        }
+        if (g->ctokens.rate) {
+            g->ctokens.level -= cost;
+        }
+    }
+}
+
+/*
+ * Decide whether @w may be submitted now.  On success the cost is charged
+ * to every group on the path to the root.  Otherwise *wait_ns is set to an
+ * estimate of how long it takes until the request might become eligible.
+ *
+ * Called with the root lock held.
+ */
+static bool fq_try_dispatch(FairQueueGroup *self, FairQueueWaiter *w,
+                            int64_t *wait_ns)
+{
+    FairQueueGroup *g;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t ceil_wait = 0;
+    int64_t token_wait = INT64_MAX;
+    bool borrowed;
+
+    if (w->member->io_limits_disabled) {
+        return true;
+    }
+
+    /* Requests of one group are submitted in order */
+    if (QTAILQ_FIRST(&self->waiters) != w) {
+        *wait_ns = FQ_MAX_WAIT_NS;
+        return false;
+    }
+
+    fq_refill_path(self, now);
+
+    for (g = self; g; g = g->parent) {
+        ceil_wait = MAX(ceil_wait, fq_bucket_wait_ns(&g->ctokens));
+    }
+    if (ceil_wait) {
+        *wait_ns = ceil_wait;
+        return false;
+    }
+
+    if (fq_group_has_tokens(self)) {
+        fq_charge(self, w->cost, false);
+        return true;
+    }
+
+    for (g = self->parent; g; g = g->parent) {
+        if (fq_group_has_tokens(g)) {
+            break;
+        }
+    }
+    borrowed = g != NULL;
+
+    if (borrowed && self->vtime <= fq_min_backlogged_vtime(self)) {
+        fq_charge(self, w->cost, true);
+        return true;
+    }
+
+    for (g = self; g; g = g->parent) {
+        token_wait = MIN(token_wait, fq_bucket_wait_ns(&g->tokens));
+    }
+    *wait_ns = borrowed ? FQ_MIN_WAIT_NS : token_wait;
+    return false;
+}
+
+/*
+ * Called with the root lock held.  The coroutine takes the lock again when
+ * it resumes, so it must not be entered from here.
+ */
+static void fq_waiter_kick(FairQueueWaiter *w)
+{
+    if (w->sleeping) {
+        w->sleeping = false;
+        aio_co_schedule(w->ctx, w->co);
+    }
+}
+
+static void fq_waiter_timer_cb(void *opaque)
+{
+    FairQueueWaiter *w = opaque;
+    FairQueueGroup *root = w->member->group->root;
+
+    qemu_mutex_lock(&root->lock);
+    fq_waiter_kick(w);
+    qemu_mutex_unlock(&root->lock);
+}
+
+static void coroutine_fn fq_co_intercept(BDRVFairQueueState *s, int64_t bytes)
+{
+    FairQueueGroup *group = s->group;
+    FairQueueGroup *root = group->root;
+    FairQueueWaiter w = {
+        .member = s,
+        .cost = MAX(bytes, FQ_MIN_COST),
+        .co = qemu_coroutine_self(),
+        .ctx = qemu_get_current_aio_context(),
+    };
+    int64_t wait_ns;
+
+    aio_timer_init(w.ctx, &w.timer, QEMU_CLOCK_REALTIME, SCALE_NS,
+                   fq_waiter_timer_cb, &w);
+
+    qemu_mutex_lock(&root->lock);
+
+    if (QTAILQ_EMPTY(&group->waiters)) {
+        /* Do not let a group that was idle catch up on the others */
+        uint64_t min = fq_min_backlogged_vtime(group);
+        if (min != UINT64_MAX) {
+            group->vtime = MAX(group->vtime, min);
+        }
+    }
+    QTAILQ_INSERT_TAIL(&group->waiters, &w, next);
+
+    while (!fq_try_dispatch(group, &w, &wait_ns)) {
+        wait_ns = MIN(MAX(wait_ns, FQ_MIN_WAIT_NS), FQ_MAX_WAIT_NS);
+        trace_fair_queue_wait(s, group, w.cost, wait_ns);
+
+        w.sleeping = true;
+        timer_mod(&w.timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + wait_ns);
+        qemu_mutex_unlock(&root->lock);
+
+        qemu_coroutine_yield();
+
+        qemu_mutex_lock(&root->lock);
+        timer_del(&w.timer);
+    }
+
+    QTAILQ_REMOVE(&group->waiters, &w, next);
+    if (!QTAILQ_EMPTY(&group->waiters)) {
+        fq_waiter_kick(QTAILQ_FIRST(&group->waiters));
+    }
+    qemu_mutex_unlock(&root->lock);
+}
+
+/*
+ * QOM fair-queue-group object
+ */
+
+static bool fq_group_check_mutable(FairQueueGroup *g, Error **errp)
+{
+    if (g->is_initialized) {
+        error_setg(errp, "Property cannot be set after initialization");
+        return false;
+    }
+    return true;
+}
+
+static char *fq_group_get_parent(Object *obj, Error **errp)
+{
+    return g_strdup(FAIR_QUEUE_GROUP(obj)->parent_id);
+}
+
+static void fq_group_set_parent(Object *obj, const char *value, Error **errp)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(obj);
+
+    if (!fq_group_check_mutable(g, errp)) {
+        return;
+    }
+    g_free(g->parent_id);
+    g->parent_id = g_strdup(value);
+}
+
+static void fq_group_get_weight(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(obj);
+
+    visit_type_uint32(v, name, &g->weight, errp);
+}
+
+static void fq_group_set_weight(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(obj);
+    uint32_t value;
+
+    if (!fq_group_check_mutable(g, errp) ||
+        !visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value < 1 || value > FQ_MAX_WEIGHT) {
+        error_setg(errp, "Property '%s' must be between 1 and %d",
+                   name, FQ_MAX_WEIGHT);
+        return;
+    }
+    g->weight = value;
+}
+
+static void fq_group_get_bps(Object *obj, Visitor *v, const char *name,
+                             void *opaque, Error **errp)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(obj);
+    uint64_t *field = (void *)g + (uintptr_t)opaque;
+
+    visit_type_uint64(v, name, field, errp);
+}
+
+static void fq_group_set_bps(Object *obj, Visitor *v, const char *name,
+                             void *opaque, Error **errp)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(obj);
+    uint64_t *field = (void *)g + (uintptr_t)opaque;
+    uint64_t value;
+
+    if (!fq_group_check_mutable(g, errp) ||
+        !visit_type_uint64(v, name, &value, errp)) {
+        return;
+    }
+    if (value > INT64_MAX) {
+        error_setg(errp, "Property '%s' is too large", name);
+        return;
+    }
+    *field = value;
+}
+
+static FairQueueGroup *fq_group_find(const char *id, Error **errp)
+{
+    Object *obj;
+
+    obj = object_resolve_path_component(object_get_objects_root(), id);
+    if (!obj || !object_dynamic_cast(obj, TYPE_FAIR_QUEUE_GROUP)) {
+        error_setg(errp, "Fair queue group '%s' does not exist", id);
+        return NULL;
+    }
+    if (!FAIR_QUEUE_GROUP(obj)->is_initialized) {
+        error_setg(errp, "Fair queue group '%s' is not initialized", id);
+        return NULL;
+    }
+    return FAIR_QUEUE_GROUP(obj);
+}
+
+static void fq_group_complete(UserCreatable *uc, Error **errp)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(uc);
+    FairQueueGroup *p;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (g->bps_max && g->bps_min > g->bps_max) {
+        error_setg(errp, "bps-min must not be larger than bps-max");
+        return;
+    }
+
+    if (g->parent_id) {
+        g->parent = fq_group_find(g->parent_id, errp);
+        if (!g->parent) {
+            return;
+        }
+        if (g->parent->bps_max && g->bps_min > g->parent->bps_max) {
+            error_setg(errp, "bps-min exceeds bps-max of parent '%s'",
+                       g->parent_id);
+            g->parent = NULL;
+            return;
+        }
+        object_ref(OBJECT(g->parent));
+        g->root = g->parent->root;
+    } else {
+        g->root = g;
+        qemu_mutex_init(&g->lock);
+        QLIST_INIT(&g->all_groups);
+    }
+
+    /* The root has nobody to borrow from, its ceiling is what it lends */
+    fq_bucket_init(&g->tokens, g->parent ? g->bps_min : g->bps_max, now);
+    fq_bucket_init(&g->ctokens, g->bps_max, now);
+
+    qemu_mutex_lock(&g->root->lock);
+    if (g->parent) {
+        p = g->parent;
+        p->nr_children++;
+        g->vtime = p->vtime;
+    }
+    QLIST_INSERT_HEAD(&g->root->all_groups, g, all_next);
+    qemu_mutex_unlock(&g->root->lock);
+
+    g->is_initialized = true;
+}
+
+static bool fq_group_can_be_deleted(UserCreatable *uc)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(uc);
+
+    return !g->nr_children && !g->nr_members;
+}
+
+static void fq_group_init(Object *obj)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(obj);
+
+    g->weight = FQ_DEFAULT_WEIGHT;
+    QTAILQ_INIT(&g->waiters);
+}
+
+static void fq_group_finalize(Object *obj)
+{
+    FairQueueGroup *g = FAIR_QUEUE_GROUP(obj);
+
+    if (g->is_initialized) {
+        assert(!g->nr_children && !g->nr_members);
+        assert(QTAILQ_EMPTY(&g->waiters));
+
+        qemu_mutex_lock(&g->root->lock);
+        QLIST_REMOVE(g, all_next);
+        if (g->parent) {
+            g->parent->nr_children--;
+        }
+        qemu_mutex_unlock(&g->root->lock);
+
+        if (g->parent) {
+            object_unref(OBJECT(g->parent));
+        } else {
+            qemu_mutex_destroy(&g->lock);
+        }
+    }
+    g_free(g->parent_id);
+}
+
+static void fq_group_class_init(ObjectClass *klass, const void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = fq_group_complete;
+    ucc->can_be_deleted = fq_group_can_be_deleted;
+
+    object_class_property_add_str(klass, "parent", fq_group_get_parent,
+                                  fq_group_set_parent);
+    object_class_property_add(klass, "weight", "uint32",
+                              fq_group_get_weight, fq_group_set_weight,
+                              NULL, NULL);
+    object_class_property_add(klass, "bps-min", "uint64",
+                              fq_group_get_bps, fq_group_set_bps, NULL,
+                              (void *)offsetof(FairQueueGroup, bps_min));
+    object_class_property_add(klass, "bps-max", "uint64",
+                              fq_group_get_bps, fq_group_set_bps, NULL,
+                              (void *)offsetof(FairQueueGroup, bps_max));
+}
+
+static const TypeInfo fq_group_info = {
+    .name = TYPE_FAIR_QUEUE_GROUP,
+    .parent = TYPE_OBJECT,
+    .class_init = fq_group_class_init,
+    .instance_size = sizeof(FairQueueGroup),
+    .instance_init = fq_group_init,
+    .instance_finalize = fq_group_finalize,
+    .interfaces = (const InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+/*
+ * Block driver
+ */
+
+static QemuOptsList fair_queue_opts = {
+    .name = "fair-queue",
+    .head = QTAILQ_HEAD_INITIALIZER(fair_queue_opts.head),
+    .desc = {
+        {
+            .name = FAIR_QUEUE_OPT_GROUP,
+            .type = QEMU_OPT_STRING,
+            .help = "ID of the fair-queue-group object",
+        },
+        { /* end of list */ }
+    },
+};
+
+static FairQueueGroup *fair_queue_parse_options(QDict *options,
+                                                Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&fair_queue_opts, NULL, 0,
+                                      &error_abort);
+    FairQueueGroup *group = NULL;
+    const char *id;
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        goto fin;
+    }
+
+    id = qemu_opt_get(opts, FAIR_QUEUE_OPT_GROUP);
+    if (!id) {
+        error_setg(errp, "Please specify a fair-queue-group");
+        goto fin;
+    }
+    group = fq_group_find(id, errp);
+fin:
+    qemu_opts_del(opts);
+    return group;
+}
+
+static void fair_queue_attach_group(BDRVFairQueueState *s,
+                                    FairQueueGroup *group)
+{
+    object_ref(OBJECT(group));
+    qemu_mutex_lock(&group->root->lock);
+    group->nr_members++;
+    qemu_mutex_unlock(&group->root->lock);
+    s->group = group;
+}
+
+static void fair_queue_detach_group(BDRVFairQueueState *s)
+{
+    FairQueueGroup *group = s->group;
+
+    qemu_mutex_lock(&group->root->lock);
+    group->nr_members--;
+    qemu_mutex_unlock(&group->root->lock);
+    s->group = NULL;
+    object_unref(OBJECT(group));
+}
+
+static int fair_queue_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVFairQueueState *s = bs->opaque;
+    FairQueueGroup *group;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = bs->file->bs->supported_write_flags |
+                                BDRV_REQ_WRITE_UNCHANGED;
+    bs->supported_zero_flags = bs->file->bs->supported_zero_flags |
+                               BDRV_REQ_WRITE_UNCHANGED;
+
+    group = fair_queue_parse_options(options, errp);
+    if (!group) {
+        return -EINVAL;
+    }
+    fair_queue_attach_group(s, group);
+    return 0;
+}
+
+static void fair_queue_close(BlockDriverState *bs)
+{
+    BDRVFairQueueState *s = bs->opaque;
+
+    fair_queue_detach_group(s);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+fair_queue_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    fq_co_intercept(bs->opaque, bytes);
+
+    return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                      QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    fq_co_intercept(bs->opaque, bytes);
+
+    return bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    /* Zeroing does not transfer any data, charge it like a small write */
+    fq_co_intercept(bs->opaque, FQ_MIN_COST);
+
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    fq_co_intercept(bs->opaque, FQ_MIN_COST);
+
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_pwritev_compressed(BlockDriverState *bs, int64_t offset,
+                                 int64_t bytes, QEMUIOVector *qiov)
+{
+    return fair_queue_co_pwritev(bs, offset, bytes, qiov,
+                                 BDRV_REQ_WRITE_COMPRESSED);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+fair_queue_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int fair_queue_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    FairQueueGroup *group;
+
+    group = fair_queue_parse_options(reopen_state->options, errp);
+    if (!group) {
+        return -EINVAL;
+    }
+    object_ref(OBJECT(group));
+    reopen_state->opaque = group;
+    return 0;
+}
+
+static void fair_queue_reopen_commit(BDRVReopenState *reopen_state)
+{
+    BDRVFairQueueState *s = reopen_state->bs->opaque;
+    FairQueueGroup *group = reopen_state->opaque;
+
+    if (group != s->group) {
+        fair_queue_detach_group(s);
+        fair_queue_attach_group(s, group);
+    }
+    object_unref(OBJECT(group));
+    reopen_state->opaque = NULL;
+}
+
+static void fair_queue_reopen_abort(BDRVReopenState *reopen_state)
+{
+    object_unref(reopen_state->opaque);
+    reopen_state->opaque = NULL;
+}
+
+static void fair_queue_drain_begin(BlockDriverState *bs)
+{
+    BDRVFairQueueState *s = bs->opaque;
+    FairQueueGroup *root = s->group->root;
+    FairQueueGroup *g;
+    FairQueueWaiter *w;
+
+    /* Let queued requests through so that the drain can complete */
+    qemu_mutex_lock(&root->lock);
+    if (s->io_limits_disabled++ == 0) {
+        QLIST_FOREACH(g, &root->all_groups, all_next) {
+            QTAILQ_FOREACH(w, &g->waiters, next) {
+                if (w->member == s) {
+                    fq_waiter_kick(w);
+                }
+            }
+        }
+    }
+    qemu_mutex_unlock(&root->lock);
+}
+
+static void fair_queue_drain_end(BlockDriverState *bs)
+{
+    BDRVFairQueueState *s = bs->opaque;
+    FairQueueGroup *root = s->group->root;
+
+    qemu_mutex_lock(&root->lock);
+    assert(s->io_limits_disabled);
+    s->io_limits_disabled--;
+    qemu_mutex_unlock(&root->lock);
+}
+
+static const char *const fair_queue_strong_runtime_opts[] = {
+    FAIR_QUEUE_OPT_GROUP,
+
+    NULL
+};
+
+static BlockDriver bdrv_fair_queue = {
+    .format_name                        =   "fair-queue",
+    .instance_size                      =   sizeof(BDRVFairQueueState),
+
+    .bdrv_open                          =   fair_queue_open,
+    .bdrv_close                         =   fair_queue_close,
+    .bdrv_co_flush                      =   fair_queue_co_flush,
+
+    .bdrv_child_perm                    =   bdrv_default_perms,
+
+    .bdrv_co_getlength                  =   fair_queue_co_getlength,
+
+    .bdrv_co_preadv                     =   fair_queue_co_preadv,
+    .bdrv_co_pwritev                    =   fair_queue_co_pwritev,
+
+    .bdrv_co_pwrite_zeroes              =   fair_queue_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   =   fair_queue_co_pdiscard,
+    .bdrv_co_pwritev_compressed         =   fair_queue_co_pwritev_compressed,
+
+    .bdrv_reopen_prepare                =   fair_queue_reopen_prepare,
+    .bdrv_reopen_commit                 =   fair_queue_reopen_commit,
+    .bdrv_reopen_abort                  =   fair_queue_reopen_abort,
+
+    .bdrv_drain_begin                   =   fair_queue_drain_begin,
+    .bdrv_drain_end                     =   fair_queue_drain_end,
+
+    .is_filter                          =   true,
+    .strong_runtime_opts                =   fair_queue_strong_runtime_opts,
+};
+
+static void fq_group_register_types(void)
+{
+    type_register_static(&fq_group_info);
+}
+
+type_init(fq_group_register_types);
+
+static void bdrv_fair_queue_init(void)
+{
+    bdrv_register(&bdrv_fair_queue);
+}
+
+block_init(bdrv_fair_queue_init);
@@ -0,0 +1,1189 @@
+/*
+ * Persistent local cache block driver
+ *
+ * The driver is inserted above a slow (typically remote) node and keeps
+ * copies of recently used blocks in a local image, for example on NVMe
+ * flash.  The cache survives restarts, so repeated boots from the same
+ * network-backed base image are served locally.
+ *
+ * Copyright (c) 2026 The QEMU Project Developers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Layout of the cache image (all fields big endian):
+ *
+ *   0                   header
+ *   LOCAL_CACHE_INDEX   one 64-bit entry per slot
+ *   data_offset         nr_slots blocks of block_size bytes each
+ *
+ * An index entry is 0 if the slot is unused, and otherwise
+ * ((source block number + 1) << 1) | dirty.
+ *
+ * Updates are ordered so that the index never points to a slot whose
+ * data does not belong to the block: an entry is cleared before its slot
+ * is reused, and only written after the new data has been stored.
+ *
+ * Dirty slots only exist in writeback mode.  They hold data that has not
+ * yet been written to the source node and are written back on eviction
+ * and when the node is closed.  After an unclean shutdown, clean entries
+ * may be stale (a write-through update might not have reached the cache)
+ * and are dropped; dirty entries are always kept.
+ *
+ * The header records a SHA-256 digest of the source identity (the
+ * source-id option, or the filename of the source node otherwise).  A
+ * cache that was created for a different source is discarded.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "crypto/hash.h"
+#include "qapi/error.h"
+#include "qapi/qapi-types-block-core.h"
+#include "qapi/util.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define LOCAL_CACHE_MAGIC           0x514c434143484531ULL /* "QLCACHE1" */
+#define LOCAL_CACHE_VERSION         1
+#define LOCAL_CACHE_FLAG_CLEAN      (1U << 0)
+
+#define LOCAL_CACHE_INDEX           4096
+#define LOCAL_CACHE_MIN_BLOCK_SIZE  (4 * KiB)
+#define LOCAL_CACHE_MAX_BLOCK_SIZE  (2 * MiB)
+#define LOCAL_CACHE_MAX_SLOTS       (INT_MAX / sizeof(uint64_t))
+#define LOCAL_CACHE_ID_LEN          32
+
+#define LOCAL_CACHE_OPT_BLOCK_SIZE  "block-size"
+#define LOCAL_CACHE_OPT_MODE        "mode"
+#define LOCAL_CACHE_OPT_SOURCE_ID   "source-id"
+
+typedef struct QEMU_PACKED LocalCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t block_size;
+    uint64_t nr_slots;
+    uint64_t source_size;
+    uint8_t source_id[LOCAL_CACHE_ID_LEN];
+} LocalCacheHeader;
+
+typedef enum LocalCacheSlotState {
+    SLOT_EMPTY,
+    SLOT_FILLING,   /* data is being fetched from the source */
+    SLOT_VALID,
+} LocalCacheSlotState;
+
+typedef struct LocalCacheSlot {
+    uint64_t block;                 /* hash key, valid unless SLOT_EMPTY */
+    LocalCacheSlotState state;
+    bool dirty;
+    bool writeback;                 /* dirty data is being written back */
+    bool stale;                     /* source was written while filling */
+    unsigned users;
+    QTAILQ_ENTRY(LocalCacheSlot) next; /* in either free or lru */
+} LocalCacheSlot;
+
+typedef struct BDRVLocalCacheState {
+    BdrvChild *cache;
+    LocalCacheMode mode;
+
+    uint64_t block_size;
+    uint64_t nr_slots;
+    uint64_t data_offset;
+    int64_t source_size;
+    uint8_t source_id[LOCAL_CACHE_ID_LEN];
+
+    /* Everything below is protected by lock */
+    CoMutex lock;
+    CoQueue queue;          /* waiting for a slot to change state */
+    LocalCacheSlot *slots;
+    GHashTable *map;        /* source block number -> slot */
+    QTAILQ_HEAD(, LocalCacheSlot) free;
+    QTAILQ_HEAD(, LocalCacheSlot) lru;  /* least recently used first */
+    uint64_t nr_dirty;
+} BDRVLocalCacheState;
+
+static QemuOptsList local_cache_opts = {
+    .name = "local-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(local_cache_opts.head),
+    .desc = {
+        {
+            .name = LOCAL_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached blocks (default: 64k)",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_MODE,
+            .type = QEMU_OPT_STRING,
+            .help = "Write policy (writethrough, writeback)",
+        },
+        {
+            .name = LOCAL_CACHE_OPT_SOURCE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "Identifies the cached data (default: source filename)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static inline uint64_t slot_index(BDRVLocalCacheState *s,
+                                  LocalCacheSlot *slot)
+{
+    return slot - s->slots;
+}
+
+static inline uint64_t slot_data_offset(BDRVLocalCacheState *s,
+                                        LocalCacheSlot *slot)
+{
+    return s->data_offset + slot_index(s, slot) * s->block_size;
+}
+
+/* Number of valid bytes in @block, which is shorter at the end of the image */
+static inline int64_t block_length(BDRVLocalCacheState *s, uint64_t block)
+{
+    return MIN(s->block_size, s->source_size - block * s->block_size);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_write_entry(BDRVLocalCacheState *s, LocalCacheSlot *slot,
+                           bool present)
+{
+    uint64_t entry = 0;
+
+    if (present) {
+        entry = cpu_to_be64(((slot->block + 1) << 1) | slot->dirty);
+    }
+    return bdrv_co_pwrite(s->cache,
+                          LOCAL_CACHE_INDEX + slot_index(s, slot) * 8,
+                          sizeof(entry), &entry, 0);
+}
+
+/* Called with s->lock held */
+static void coroutine_fn
+local_cache_slot_put(BDRVLocalCacheState *s, LocalCacheSlot *slot)
+{
+    assert(slot->users);
+    if (--slot->users == 0) {
+        if (slot->state == SLOT_EMPTY) {
+            QTAILQ_INSERT_TAIL(&s->free, slot, next);
+        }
+        qemu_co_queue_restart_all(&s->queue);
+    }
+}
+
+/*
+ * Forget the contents of a slot.  The slot must not be mapped any more
+ * when this returns; it is freed once the last user drops it.
+ *
+ * Called with s->lock held.
+ */
+static void local_cache_slot_drop(BDRVLocalCacheState *s, LocalCacheSlot *slot)
+{
+    if (slot->state == SLOT_VALID) {
+        QTAILQ_REMOVE(&s->lru, slot, next);
+    }
+    if (slot->dirty) {
+        s->nr_dirty--;
+        slot->dirty = false;
+    }
+    g_hash_table_remove(s->map, &slot->block);
+    slot->state = SLOT_EMPTY;
+    slot->stale = false;
+    if (!slot->users) {
+        QTAILQ_INSERT_TAIL(&s->free, slot, next);
+    }
+}
+
+/*
+ * Write the dirty data of @slot back to the source node.
+ *
+ * Called with s->lock held, which is temporarily dropped.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_writeback(BlockDriverState *bs, LocalCacheSlot *slot)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t len = block_length(s, slot->block);
+    void *buf;
+    int ret;
+
+    assert(slot->state == SLOT_VALID && slot->dirty && !slot->writeback);
+
+    slot->writeback = true;
+    slot->users++;
+    qemu_co_mutex_unlock(&s->lock);
+
+    trace_local_cache_writeback(bs, slot->block);
+
+    buf = qemu_try_blockalign(bs, len);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    ret = bdrv_co_pread(s->cache, slot_data_offset(s, slot), len, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_co_pwrite(bs->file, slot->block * s->block_size, len, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Writers wait for the writeback, so the slot cannot be dirtied again */
+    slot->dirty = false;
+    ret = local_cache_co_write_entry(s, slot, true);
+    if (ret < 0) {
+        /* Entry still says dirty, which is safe */
+        ret = 0;
+    }
+
+out:
+    qemu_vfree(buf);
+    qemu_co_mutex_lock(&s->lock);
+    if (!slot->dirty) {
+        s->nr_dirty--;
+    }
+    slot->writeback = false;
+    local_cache_slot_put(s, slot);
+    qemu_co_queue_restart_all(&s->queue);
+    return ret;
+}
+
+/*
+ * Find a slot that can be reused for a new block.  Clean slots are
+ * evicted in LRU order; if there are none, the least recently used dirty
+ * slot is written back first.  Returns NULL if every slot is busy.
+ *
+ * Called with s->lock held, which may be temporarily dropped.
+ */
+static LocalCacheSlot * coroutine_fn GRAPH_RDLOCK
+local_cache_co_get_victim(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheSlot *slot;
+
+retry:
+    slot = QTAILQ_FIRST(&s->free);
+    if (slot) {
+        QTAILQ_REMOVE(&s->free, slot, next);
+        return slot;
+    }
+
+    QTAILQ_FOREACH(slot, &s->lru, next) {
+        if (!slot->users && !slot->dirty) {
+            trace_local_cache_evict(bs, slot->block);
+            local_cache_slot_drop(s, slot);
+            QTAILQ_REMOVE(&s->free, slot, next);
+            return slot;
+        }
+    }
+
+    QTAILQ_FOREACH(slot, &s->lru, next) {
+        if (!slot->users && !slot->writeback) {
+            if (local_cache_co_writeback(bs, slot) < 0) {
+                return NULL;
+            }
+            goto retry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read [@offset, @offset + @bytes) from the source and add the block that
+ * contains it to the cache.  The range must be within a single block.
+ * Returns 1 if the block was added by somebody else in the meantime and
+ * the lookup must be repeated.
+ *
+ * Called with s->lock held, which is temporarily dropped.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_fill(BlockDriverState *bs, uint64_t block, int64_t offset,
+                    int64_t bytes, QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int64_t block_offset = block * s->block_size;
+    int64_t len = block_length(s, block);
+    LocalCacheSlot *slot;
+    void *buf;
+    int ret;
+
+    slot = local_cache_co_get_victim(bs);
+    if (!slot) {
+        /* Cache is thrashing, bypass it */
+        qemu_co_mutex_unlock(&s->lock);
+        ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                  0);
+        qemu_co_mutex_lock(&s->lock);
+        return ret;
+    }
+    if (g_hash_table_contains(s->map, &block)) {
+        QTAILQ_INSERT_TAIL(&s->free, slot, next);
+        return 1;
+    }
+
+    slot->block = block;
+    slot->state = SLOT_FILLING;
+    slot->users = 1;
+    g_hash_table_insert(s->map, &slot->block, slot);
+    qemu_co_mutex_unlock(&s->lock);
+
+    trace_local_cache_fill(bs, block, slot_index(s, slot));
+
+    buf = qemu_try_blockalign(bs, len);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    /* The entry may still point to the old contents of the slot */
+    ret = local_cache_co_write_entry(s, slot, false);
+    if (ret < 0) {
+        goto read_uncached;
+    }
+
+    ret = bdrv_co_pread(bs->file, block_offset, len, buf, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - block_offset),
+                        bytes);
+
+    ret = bdrv_co_pwrite(s->cache, slot_data_offset(s, slot), len, buf, 0);
+    if (ret == 0 && !slot->stale) {
+        ret = local_cache_co_write_entry(s, slot, true);
+    }
+    qemu_vfree(buf);
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0 || slot->stale) {
+        /* Data is already in @qiov, only the cache is not updated */
+        local_cache_slot_drop(s, slot);
+    } else {
+        slot->state = SLOT_VALID;
+        QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+    }
+    local_cache_slot_put(s, slot);
+    return 0;
+
+read_uncached:
+    ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset, 0);
+fail:
+    qemu_vfree(buf);
+    qemu_co_mutex_lock(&s->lock);
+    local_cache_slot_drop(s, slot);
+    local_cache_slot_put(s, slot);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset,
+                           BdrvRequestFlags flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (bytes) {
+        uint64_t block = offset / s->block_size;
+        int64_t n = MIN(bytes, (block + 1) * s->block_size - offset);
+        LocalCacheSlot *slot;
+
+        if (offset >= s->source_size) {
+            /* Node was resized behind our back, do not cache the tail */
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_preadv_part(bs->file, offset, bytes, qiov,
+                                      qiov_offset, 0);
+            return ret;
+        }
+        n = MIN(n, s->source_size - offset);
+
+        slot = g_hash_table_lookup(s->map, &block);
+        if (slot && slot->state == SLOT_FILLING) {
+            qemu_co_queue_wait(&s->queue, &s->lock);
+            continue;
+        }
+
+        if (slot) {
+            QTAILQ_REMOVE(&s->lru, slot, next);
+            QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+            slot->users++;
+            qemu_co_mutex_unlock(&s->lock);
+
+            ret = bdrv_co_preadv_part(s->cache,
+                                      slot_data_offset(s, slot) +
+                                      offset % s->block_size,
+                                      n, qiov, qiov_offset, 0);
+
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0 && !slot->dirty && slot->state == SLOT_VALID) {
+                /* Fall back to the source, it has the same data */
+                local_cache_slot_drop(s, slot);
+                local_cache_slot_put(s, slot);
+                continue;
+            }
+            local_cache_slot_put(s, slot);
+        } else {
+            ret = local_cache_co_fill(bs, block, offset, n, qiov, qiov_offset);
+            if (ret > 0) {
+                continue;
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+/*
+ * Write @n bytes within one block to the cached copy in @slot.
+ *
+ * Called with s->lock held, which is temporarily dropped.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_update_slot(BlockDriverState *bs, LocalCacheSlot *slot,
+                           int64_t offset, int64_t n, QEMUIOVector *qiov,
+                           size_t qiov_offset, BdrvRequestFlags flags,
+                           bool make_dirty)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    bool was_dirty = slot->dirty;
+    int ret;
+
+    slot->users++;
+    if (make_dirty && !was_dirty) {
+        slot->dirty = true;
+        s->nr_dirty++;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    ret = bdrv_co_pwritev_part(s->cache,
+                               slot_data_offset(s, slot) +
+                               offset % s->block_size,
+                               n, qiov, qiov_offset, flags);
+    if (ret == 0 && make_dirty && !was_dirty) {
+        ret = local_cache_co_write_entry(s, slot, true);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0 && !make_dirty && !slot->dirty) {
+        /* The source has the new data, just stop caching the block */
+        if (slot->state == SLOT_VALID) {
+            local_cache_slot_drop(s, slot);
+        }
+        ret = 0;
+    }
+    local_cache_slot_put(s, slot);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    bool writeback = s->mode == LOCAL_CACHE_MODE_WRITEBACK;
+    int ret;
+
+    if (!writeback) {
+        ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    while (bytes) {
+        uint64_t block = offset / s->block_size;
+        int64_t n = MIN(bytes, (block + 1) * s->block_size - offset);
+        LocalCacheSlot *slot;
+
+        if (offset >= s->source_size) {
+            break;
+        }
+        n = MIN(n, s->source_size - offset);
+
+        slot = g_hash_table_lookup(s->map, &block);
+        if (slot && slot->writeback) {
+            qemu_co_queue_wait(&s->queue, &s->lock);
+            continue;
+        }
+
+        ret = 0;
+        if (slot && slot->state == SLOT_FILLING) {
+            /* The data being filled in is outdated */
+            slot->stale = true;
+            slot = NULL;
+        }
+
+        if (slot) {
+            ret = local_cache_co_update_slot(bs, slot, offset, n, qiov,
+                                             qiov_offset, flags, writeback);
+        } else if (writeback) {
+            /* Uncached blocks are written around the cache */
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_pwritev_part(bs->file, offset, n, qiov, qiov_offset,
+                                       flags);
+            qemu_co_mutex_lock(&s->lock);
+        }
+        if (ret < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            return ret;
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (writeback && bytes) {
+        /* Beyond the size the cache was set up for */
+        return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov,
+                                    qiov_offset, flags);
+    }
+    return 0;
+}
+
+/*
+ * Stop caching all blocks that intersect [@offset, @offset + @bytes).
+ * Dirty data is written back first, the request may only cover part of
+ * the block.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_invalidate(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t block = offset / s->block_size;
+    uint64_t end = DIV_ROUND_UP(offset + bytes, s->block_size);
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (block < end) {
+        LocalCacheSlot *slot = g_hash_table_lookup(s->map, &block);
+
+        if (!slot) {
+            block++;
+            continue;
+        }
+        if (slot->state == SLOT_FILLING) {
+            slot->stale = true;
+            block++;
+            continue;
+        }
+        if (slot->writeback || (slot->dirty && slot->users)) {
+            /* Wait until no request can dirty the slot any more */
+            qemu_co_queue_wait(&s->queue, &s->lock);
+            continue;
+        }
+        if (slot->dirty) {
+            ret = local_cache_co_writeback(bs, slot);
+            if (ret < 0) {
+                break;
+            }
+            continue;
+        }
+
+        slot->users++;
+        local_cache_slot_drop(s, slot);
+        qemu_co_mutex_unlock(&s->lock);
+        ret = local_cache_co_write_entry(s, slot, false);
+        qemu_co_mutex_lock(&s->lock);
+        local_cache_slot_put(s, slot);
+        if (ret < 0) {
+            break;
+        }
+        block++;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes, BdrvRequestFlags flags)
+{
+    int ret = local_cache_co_invalidate(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret = local_cache_co_invalidate(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_flush(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    /* Dirty blocks are durable once the cache image is flushed */
+    ret = bdrv_co_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+local_cache_co_block_status(BlockDriverState *bs, unsigned int mode,
+                            int64_t offset, int64_t bytes, int64_t *pnum,
+                            int64_t *map, BlockDriverState **file)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t nr_dirty;
+
+    qemu_co_mutex_lock(&s->lock);
+    nr_dirty = s->nr_dirty;
+    qemu_co_mutex_unlock(&s->lock);
+
+    *pnum = bytes;
+    if (nr_dirty) {
+        /* The cached node does not contain everything yet */
+        return BDRV_BLOCK_DATA;
+    }
+
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+local_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void GRAPH_RDLOCK
+local_cache_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
+                       BlockReopenQueue *reopen_queue,
+                       uint64_t perm, uint64_t shared,
+                       uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    if (role & BDRV_CHILD_PRIMARY) {
+        bdrv_default_perms(bs, c, role, reopen_queue,
+                           perm, shared, nperm, nshared);
+        if (s->mode == LOCAL_CACHE_MODE_WRITEBACK &&
+            !(bs->open_flags & BDRV_O_INACTIVE)) {
+            /* Dirty blocks are written back even if the guest only reads */
+            *nperm |= BLK_PERM_WRITE;
+        }
+        return;
+    }
+
+    /* Nobody else may touch the cache image */
+    *nperm = BLK_PERM_CONSISTENT_READ;
+    *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        *nperm |= BLK_PERM_WRITE;
+    }
+}
+
+static int coroutine_mixed_fn GRAPH_RDLOCK
+local_cache_write_header(BDRVLocalCacheState *s, bool clean)
+{
+    LocalCacheHeader header = {
+        .magic          = cpu_to_be64(LOCAL_CACHE_MAGIC),
+        .version        = cpu_to_be32(LOCAL_CACHE_VERSION),
+        .flags          = cpu_to_be32(clean ? LOCAL_CACHE_FLAG_CLEAN : 0),
+        .block_size     = cpu_to_be64(s->block_size),
+        .nr_slots       = cpu_to_be64(s->nr_slots),
+        .source_size    = cpu_to_be64(s->source_size),
+    };
+
+    memcpy(header.source_id, s->source_id, LOCAL_CACHE_ID_LEN);
+
+    return bdrv_pwrite_sync(s->cache, 0, sizeof(header), &header, 0);
+}
+
+/* Set up an empty cache that fills the whole cache image */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+local_cache_format(BDRVLocalCacheState *s, Error **errp)
+{
+    int64_t len = bdrv_getlength(s->cache->bs);
+    int ret;
+
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get cache image size");
+        return len;
+    }
+
+    s->nr_slots = MAX(len - LOCAL_CACHE_INDEX, 0) / (s->block_size + 8);
+    s->nr_slots = MIN(s->nr_slots, LOCAL_CACHE_MAX_SLOTS);
+    for (;;) {
+        s->data_offset = ROUND_UP(LOCAL_CACHE_INDEX + s->nr_slots * 8,
+                                  s->block_size);
+        if (!s->nr_slots ||
+            s->data_offset + s->nr_slots * s->block_size <= len) {
+            break;
+        }
+        s->nr_slots--;
+    }
+    if (!s->nr_slots) {
+        error_setg(errp, "Cache image is too small");
+        return -EINVAL;
+    }
+
+    ret = bdrv_pwrite_zeroes(s->cache, LOCAL_CACHE_INDEX, s->nr_slots * 8, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not initialize cache index");
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * Load the index of an existing cache.  Returns 1 if the cache image does
+ * not contain a usable cache and must be formatted.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+local_cache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    LocalCacheHeader header;
+    g_autofree uint64_t *index = NULL;
+    const char *mismatch = NULL;
+    bool clean, rewrite = false;
+    uint64_t nr_blocks, i;
+    int ret;
+
+    ret = bdrv_pread(s->cache, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache header");
+        return ret;
+    }
+    if (be64_to_cpu(header.magic) != LOCAL_CACHE_MAGIC) {
+        return 1;
+    }
+    if (be32_to_cpu(header.version) != LOCAL_CACHE_VERSION) {
+        error_setg(errp, "Unsupported cache version %" PRIu32,
+                   be32_to_cpu(header.version));
+        return -ENOTSUP;
+    }
+    if (be64_to_cpu(header.block_size) != s->block_size) {
+        error_setg(errp, "Cache was created with block-size %" PRIu64,
+                   be64_to_cpu(header.block_size));
+        return -EINVAL;
+    }
+
+    s->nr_slots = be64_to_cpu(header.nr_slots);
+    if (!s->nr_slots || s->nr_slots > LOCAL_CACHE_MAX_SLOTS) {
+        error_setg(errp, "Invalid number of cache slots");
+        return -EINVAL;
+    }
+    s->data_offset = ROUND_UP(LOCAL_CACHE_INDEX + s->nr_slots * 8,
+                              s->block_size);
+    if (s->data_offset + s->nr_slots * s->block_size >
+        bdrv_getlength(s->cache->bs)) {
+        error_setg(errp, "Cache image is smaller than the cache it contains");
+        return -EINVAL;
+    }
+    clean = be32_to_cpu(header.flags) & LOCAL_CACHE_FLAG_CLEAN;
+
+    index = g_try_new(uint64_t, s->nr_slots);
+    if (!index) {
+        error_setg(errp, "Could not allocate cache index");
+        return -ENOMEM;
+    }
+    ret = bdrv_pread(s->cache, LOCAL_CACHE_INDEX, s->nr_slots * 8, index, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache index");
+        return ret;
+    }
+
+    if (memcmp(header.source_id, s->source_id, LOCAL_CACHE_ID_LEN)) {
+        mismatch = "Cache was created for a different node";
+    } else if (be64_to_cpu(header.source_size) != s->source_size) {
+        mismatch = "Size of the cached node has changed";
+    }
+    if (mismatch) {
+        for (i = 0; i < s->nr_slots; i++) {
+            if (be64_to_cpu(index[i]) & 1) {
+                error_setg(errp, "%s, but the cache contains data not "
+                           "written back yet", mismatch);
+                return -EINVAL;
+            }
+        }
+        return 1;
+    }
+
+    s->slots = g_new0(LocalCacheSlot, s->nr_slots);
+    nr_blocks = DIV_ROUND_UP(s->source_size, s->block_size);
+    for (i = 0; i < s->nr_slots; i++) {
+        LocalCacheSlot *slot = &s->slots[i];
+        uint64_t entry = be64_to_cpu(index[i]);
+        uint64_t block = (entry >> 1) - 1;
+        bool dirty = entry & 1;
+
+        if (entry && block < nr_blocks && (dirty || clean) &&
+            !g_hash_table_contains(s->map, &block)) {
+            slot->block = block;
+            slot->state = SLOT_VALID;
+            slot->dirty = dirty;
+            s->nr_dirty += dirty;
+            g_hash_table_insert(s->map, &slot->block, slot);
+            QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+        } else {
+            if (entry) {
+                index[i] = 0;
+                rewrite = true;
+            }
+            QTAILQ_INSERT_TAIL(&s->free, slot, next);
+        }
+    }
+
+    if (rewrite) {
+        ret = bdrv_pwrite(s->cache, LOCAL_CACHE_INDEX, s->nr_slots * 8,
+                          index, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write cache index");
+            return ret;
+        }
+    }
+
+    trace_local_cache_load(bs, s->nr_slots, g_hash_table_size(s->map),
+                           s->nr_dirty, clean);
+    return 0;
+}
+
+static void local_cache_reset(BDRVLocalCacheState *s)
+{
+    g_hash_table_remove_all(s->map);
+    QTAILQ_INIT(&s->free);
+    QTAILQ_INIT(&s->lru);
+    g_free(s->slots);
+    s->slots = NULL;
+    s->nr_dirty = 0;
+}
+
+/*
+ * Load the cache from the cache image, or set up a new one.  This writes
+ * to the cache image, so it is deferred for inactive nodes.
+ */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+local_cache_setup(BlockDriverState *bs, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    uint64_t i;
+    int ret;
+
+    ret = local_cache_load(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+    if (ret > 0) {
+        local_cache_reset(s);
+        ret = local_cache_format(s, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        s->slots = g_new0(LocalCacheSlot, s->nr_slots);
+        for (i = 0; i < s->nr_slots; i++) {
+            QTAILQ_INSERT_TAIL(&s->free, &s->slots[i], next);
+        }
+    }
+
+    /* Until the node is closed, clean entries may become stale */
+    ret = local_cache_write_header(s, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write cache header");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    local_cache_reset(s);
+    s->nr_slots = 0;
+    return ret;
+}
+
+static int local_cache_parse_options(BDRVLocalCacheState *s, QDict *options,
+                                     const char *source_name, Error **errp)
+{
+    QemuOpts *opts = qemu_opts_create(&local_cache_opts, NULL, 0,
+                                      &error_abort);
+    const char *mode_str, *source_id;
+    uint8_t *digest = s->source_id;
+    size_t digest_len = LOCAL_CACHE_ID_LEN;
+    int mode;
+    int ret = -EINVAL;
+
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        goto out;
+    }
+
+    s->block_size = qemu_opt_get_size(opts, LOCAL_CACHE_OPT_BLOCK_SIZE,
+                                      64 * KiB);
+    if (s->block_size < LOCAL_CACHE_MIN_BLOCK_SIZE ||
+        s->block_size > LOCAL_CACHE_MAX_BLOCK_SIZE ||
+        !is_power_of_2(s->block_size)) {
+        error_setg(errp, "block-size must be a power of two between %d and "
+                   "%d", LOCAL_CACHE_MIN_BLOCK_SIZE,
+                   LOCAL_CACHE_MAX_BLOCK_SIZE);
+        goto out;
+    }
+
+    mode_str = qemu_opt_get(opts, LOCAL_CACHE_OPT_MODE);
+    mode = qapi_enum_parse(&LocalCacheMode_lookup, mode_str,
+                           LOCAL_CACHE_MODE_WRITETHROUGH, errp);
+    if (mode < 0) {
+        goto out;
+    }
+    s->mode = mode;
+
+    source_id = qemu_opt_get(opts, LOCAL_CACHE_OPT_SOURCE_ID) ?: source_name;
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALGO_SHA256, source_id,
+                           strlen(source_id), &digest, &digest_len,
+                           errp) < 0) {
+        goto out;
+    }
+
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int local_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_of_bds,
+                               BDRV_CHILD_METADATA, false, errp);
+    if (!s->cache) {
+        return -EINVAL;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    ret = local_cache_parse_options(s, options, bs->file->bs->filename, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (bdrv_is_read_only(s->cache->bs)) {
+        error_setg(errp, "Cache image must be writable");
+        return -EPERM;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags &
+         s->cache->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+         bs->file->bs->supported_zero_flags);
+
+    s->source_size = bdrv_getlength(bs->file->bs);
+    if (s->source_size < 0) {
+        error_setg_errno(errp, -s->source_size,
+                         "Could not get size of the cached node");
+        return s->source_size;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->queue);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->free);
+    QTAILQ_INIT(&s->lru);
+
+    /* Without slots, all requests bypass the cache until activation */
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = local_cache_setup(bs, errp);
+        if (ret < 0) {
+            g_hash_table_destroy(s->map);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write back all dirty blocks and mark the cache as cleanly shut down, so
+ * that its contents are trusted the next time it is opened.
+ */
+static int GRAPH_RDLOCK local_cache_shutdown(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    g_autofree uint64_t *index = NULL;
+    void *buf;
+    uint64_t i;
+    int ret = 0;
+
+    buf = qemu_blockalign(bs, s->block_size);
+    for (i = 0; i < s->nr_slots && s->nr_dirty; i++) {
+        LocalCacheSlot *slot = &s->slots[i];
+        int64_t len;
+
+        if (!slot->dirty) {
+            continue;
+        }
+        len = block_length(s, slot->block);
+        ret = bdrv_pread(s->cache, slot_data_offset(s, slot), len, buf, 0);
+        if (ret == 0) {
+            ret = bdrv_pwrite(bs->file, slot->block * s->block_size, len,
+                              buf, 0);
+        }
+        if (ret == 0) {
+            slot->dirty = false;
+            s->nr_dirty--;
+        }
+    }
+    qemu_vfree(buf);
+
+    if (s->nr_dirty) {
+        /* Keep the dirty entries, they are written back on the next open */
+        error_report("local-cache: could not write back %" PRIu64 " blocks",
+                     s->nr_dirty);
+        return -EIO;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Errors may have left entries for dropped slots behind, rewrite all */
+    index = g_new0(uint64_t, s->nr_slots);
+    for (i = 0; i < s->nr_slots; i++) {
+        if (s->slots[i].state == SLOT_VALID) {
+            index[i] = cpu_to_be64((s->slots[i].block + 1) << 1);
+        }
+    }
+    ret = bdrv_pwrite(s->cache, LOCAL_CACHE_INDEX, s->nr_slots * 8, index, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return local_cache_write_header(s, true);
+}
+
+static int GRAPH_RDLOCK local_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    if (!s->slots) {
+        return 0;
+    }
+    return local_cache_shutdown(bs);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+local_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+    int ret;
+
+    if (!s->slots) {
+        local_cache_setup(bs, errp);
+        return;
+    }
+
+    ret = local_cache_write_header(s, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write cache header");
+    }
+}
+
+static void local_cache_close(BlockDriverState *bs)
+{
+    BDRVLocalCacheState *s = bs->opaque;
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (s->slots && !(bs->open_flags & BDRV_O_INACTIVE)) {
+        local_cache_shutdown(bs);
+    }
+
+    local_cache_reset(s);
+    g_hash_table_destroy(s->map);
+}
+
+static const char *const local_cache_strong_runtime_opts[] = {
+    LOCAL_CACHE_OPT_BLOCK_SIZE,
+    LOCAL_CACHE_OPT_SOURCE_ID,
+
+    NULL
+};
+
+static BlockDriver bdrv_local_cache = {
+    .format_name                        = "local-cache",
+    .instance_size                      = sizeof(BDRVLocalCacheState),
+
+    .bdrv_open                          = local_cache_open,
+    .bdrv_close                         = local_cache_close,
+    .bdrv_child_perm                    = local_cache_child_perm,
+
+    .bdrv_co_getlength                  = local_cache_co_getlength,
+    .bdrv_co_block_status               = local_cache_co_block_status,
+
+    .bdrv_co_preadv_part                = local_cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = local_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = local_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = local_cache_co_pdiscard,
+    .bdrv_co_flush                      = local_cache_co_flush,
+
+    .bdrv_inactivate                    = local_cache_inactivate,
+    .bdrv_co_invalidate_cache           = local_cache_co_invalidate_cache,
+
+    .strong_runtime_opts                = local_cache_strong_runtime_opts,
+};
+
+static void bdrv_local_cache_init(void)
+{
+    bdrv_register(&bdrv_local_cache);
+}
+
+block_init(bdrv_local_cache_init);
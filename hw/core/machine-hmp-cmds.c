@@ -126,6 +126,14 @@ void hmp_info_memdev(Monitor *mon, const QDict *qdict)
                        m->value->dump ? "true" : "false");
         monitor_printf(mon, "  prealloc: %s\n",
                        m->value->prealloc ? "true" : "false");
+        if (m->value->has_prealloc_status) {
+            monitor_printf(mon, "  prealloc status: %s\n",
+                           MemdevPreallocStatus_str(m->value->prealloc_status));
+        }
+        if (m->value->has_prealloc_done) {
+            monitor_printf(mon, "  prealloc done: %" PRIu64 " of %" PRIu64
+                           "\n", m->value->prealloc_done, m->value->size);
+        }
         monitor_printf(mon, "  share: %s\n",
                        m->value->share ? "true" : "false");
         if (m->value->has_reserve) {
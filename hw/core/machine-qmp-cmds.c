@@ -212,6 +212,12 @@ static int query_memdev(Object *obj, void *opaque)
         m->merge = object_property_get_bool(obj, "merge", &error_abort);
         m->dump = object_property_get_bool(obj, "dump", &error_abort);
         m->prealloc = object_property_get_bool(obj, "prealloc", &error_abort);
+        m->has_prealloc_status =
+            host_memory_backend_prealloc_status(MEMORY_BACKEND(obj),
+                                                &m->prealloc_status,
+                                                &m->prealloc_done);
+        m->has_prealloc_done = m->has_prealloc_status &&
+            m->prealloc_status == MEMDEV_PREALLOC_STATUS_RUNNING;
         m->share = object_property_get_bool(obj, "share", &error_abort);
         m->reserve = object_property_get_bool(obj, "reserve", &err);
         if (err) {
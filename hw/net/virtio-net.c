@@ -12,6 +12,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/aio-wait.h"
 #include "qemu/atomic.h"
 #include "qemu/iov.h"
 #include "qemu/log.h"
@@ -31,6 +32,7 @@
 #include "net/vhost_net.h"
 #include "net/announce.h"
 #include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/iothread-vq-mapping.h"
 #include "qapi/error.h"
 #include "qapi/qapi-events-net.h"
 #include "hw/core/qdev-properties.h"
@@ -46,6 +48,7 @@
 #include "monitor/monitor.h"
 #include "hw/pci/pci_device.h"
 #include "net_rx_pkt.h"
+#include "net_tx_pkt.h"
 #include "hw/virtio/vhost.h"
 #include "system/qtest.h"
 
@@ -208,6 +211,9 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     }
 }
 
+static void virtio_net_dataplane_pause(VirtIONet *n);
+static void virtio_net_dataplane_resume(VirtIONet *n);
+
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -219,8 +225,10 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR) &&
         !virtio_vdev_has_feature(vdev, VIRTIO_F_VERSION_1) &&
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
+        virtio_net_dataplane_pause(n);
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
+        virtio_net_dataplane_resume(n);
     }
 
     /*
@@ -246,8 +254,11 @@ static void virtio_net_announce_notify(VirtIONet *net)
     VirtIODevice *vdev = VIRTIO_DEVICE(net);
     trace_virtio_net_announce_notify();
 
+    /* The data path reads n->status in the IOThread */
+    virtio_net_dataplane_pause(net);
     net->status |= VIRTIO_NET_S_ANNOUNCE;
     virtio_notify_config(vdev);
+    virtio_net_dataplane_resume(net);
 }
 
 static void virtio_net_announce_timer(void *opaque)
@@ -408,6 +419,7 @@ static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    virtio_net_dataplane_pause(n);
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -433,6 +445,10 @@ static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         }
 
         if (queue_started) {
+            if (n->ioeventfd_started) {
+                /* virtio_net_dataplane_resume() kicks tx in the IOThread */
+                continue;
+            }
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
@@ -456,6 +472,7 @@ static int virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_dataplane_resume(n);
     return 0;
 }
 
@@ -465,6 +482,7 @@ static void virtio_net_set_link_status(NetClientState *nc)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     uint16_t old_status = n->status;
 
+    virtio_net_dataplane_pause(n);
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
     else
@@ -474,6 +492,7 @@ static void virtio_net_set_link_status(NetClientState *nc)
         virtio_notify_config(vdev);
 
     virtio_net_set_status(vdev, vdev->status);
+    virtio_net_dataplane_resume(n);
 }
 
 static void rxfilter_notify(NetClientState *nc)
@@ -591,7 +610,9 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
         vhost_net_virtqueue_reset(vdev, nc, queue_index);
     }
 
+    virtio_net_dataplane_pause(n);
     flush_or_purge_queued_packets(nc);
+    virtio_net_dataplane_resume(n);
 }
 
 static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
@@ -955,9 +976,15 @@ static void virtio_net_set_features(VirtIODevice *vdev,
                                                   VIRTIO_NET_F_HASH_REPORT),
                                virtio_has_tunnel_hdr(features));
 
-    n->rsc4_enabled = virtio_has_feature_ex(features, VIRTIO_NET_F_RSC_EXT) &&
+    n->rsc_gro = n->rx_gro && n->has_vnet_hdr &&
+        n->host_hdr_len == n->guest_hdr_len &&
+        !virtio_has_feature_ex(features, VIRTIO_NET_F_RSC_EXT) &&
+        virtio_has_feature_ex(features, VIRTIO_NET_F_GUEST_CSUM);
+    n->rsc4_enabled = (virtio_has_feature_ex(features, VIRTIO_NET_F_RSC_EXT) ||
+                       n->rsc_gro) &&
         virtio_has_feature_ex(features, VIRTIO_NET_F_GUEST_TSO4);
-    n->rsc6_enabled = virtio_has_feature_ex(features, VIRTIO_NET_F_RSC_EXT) &&
+    n->rsc6_enabled = (virtio_has_feature_ex(features, VIRTIO_NET_F_RSC_EXT) ||
+                       n->rsc_gro) &&
         virtio_has_feature_ex(features, VIRTIO_NET_F_GUEST_TSO6);
     n->rss_data.redirect = virtio_has_feature_ex(features, VIRTIO_NET_F_RSS);
 
@@ -1061,9 +1088,14 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
             return VIRTIO_NET_ERR;
         }
 
-        n->rsc4_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
+        n->rsc_gro = n->rx_gro && n->host_hdr_len == n->guest_hdr_len &&
+            !virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
+            virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_CSUM);
+        n->rsc4_enabled = (virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) ||
+                           n->rsc_gro) &&
             virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
-        n->rsc6_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
+        n->rsc6_enabled = (virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) ||
+                           n->rsc_gro) &&
             virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
         virtio_clear_feature(&offloads, VIRTIO_NET_F_RSC_EXT);
 
@@ -1593,8 +1625,14 @@ size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
 
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
+    VirtIONet *n = VIRTIO_NET(vdev);
     VirtQueueElement *elem;
 
+    /*
+     * Control commands update the filters and offloads that the rx/tx
+     * path reads, so keep the IOThreads away while they are applied.
+     */
+    virtio_net_dataplane_pause(n);
     for (;;) {
         size_t written;
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -1614,6 +1652,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             break;
         }
     }
+    virtio_net_dataplane_resume(n);
 }
 
 /* RX */
@@ -2033,10 +2072,16 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
 
     for (j = 0; j < i; j++) {
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
+        virtqueue_fill(q->rx_vq, elems[j], lens[j], q->rx_pending + j);
         g_free(elems[j]);
     }
 
+    if (q->rx_batching) {
+        /* virtio_net_receive_batch() flushes and notifies once at the end */
+        q->rx_pending += i;
+        return size;
+    }
+
     virtqueue_flush(q->rx_vq, i);
     virtio_notify(vdev, q->rx_vq);
 
@@ -2110,6 +2155,49 @@ static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
     unit->payload = read_unit_ip_len(unit) - unit->tcp_hdrlen;
 }
 
+/*
+ * The header in the buffer is still in the peer's format, which
+ * receive_header() may swap to the guest's byte order later on.
+ */
+static uint16_t virtio_net_rsc_hdr16(VirtIONet *n, uint16_t v)
+{
+    return n->needs_vnet_hdr_swap ? v : virtio_tswap16(VIRTIO_DEVICE(n), v);
+}
+
+/* Present a coalesced segment as an ordinary GSO packet */
+static void virtio_net_rsc_gro_hdr(VirtioNetRscChain *chain,
+                                   VirtioNetRscSeg *seg,
+                                   struct virtio_net_hdr_v1 *h)
+{
+    VirtIONet *n = chain->n;
+    struct ip_header *ip;
+    uint16_t hdr_len;
+
+    h->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    h->hdr_len = 0;
+    h->gso_size = 0;
+    h->csum_start = 0;
+    h->csum_offset = 0;
+
+    if (!seg->is_coalesced) {
+        return;
+    }
+
+    hdr_len = (uint8_t *)seg->unit.tcp + seg->unit.tcp_hdrlen -
+              ((uint8_t *)seg->buf + n->guest_hdr_len);
+    h->gso_type = chain->gso_type;
+    h->hdr_len = virtio_net_rsc_hdr16(n, hdr_len);
+    h->gso_size = virtio_net_rsc_hdr16(n, seg->mss);
+
+    if (chain->proto == ETH_P_IP) {
+        ip = seg->unit.ip;
+        ip->ip_sum = 0;
+        ip->ip_sum = cpu_to_be16(net_raw_checksum((uint8_t *)ip,
+                                                  sizeof(struct ip_header)));
+    }
+}
+
 static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
                                        VirtioNetRscSeg *seg)
 {
@@ -2120,7 +2208,9 @@ static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
     h->flags = 0;
     h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
 
-    if (seg->is_coalesced) {
+    if (chain->n->rsc_gro) {
+        virtio_net_rsc_gro_hdr(chain, seg, h);
+    } else if (seg->is_coalesced) {
         h->rsc.segments = seg->packets;
         h->rsc.dup_acks = seg->dup_ack;
         h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
@@ -2158,6 +2248,24 @@ static void virtio_net_rsc_purge(void *opq)
     }
 }
 
+/* Hand whatever @nc coalesced during a receive batch to the guest */
+static void virtio_net_rsc_flush(VirtIONet *n, NetClientState *nc)
+{
+    VirtioNetRscChain *chain;
+    VirtioNetRscSeg *seg, *rn;
+
+    QTAILQ_FOREACH(chain, &n->rsc_chains, next) {
+        QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn) {
+            if (seg->nc == nc && virtio_net_rsc_drain_seg(chain, seg) == 0) {
+                chain->stat.purge_failed++;
+            }
+        }
+        if (QTAILQ_EMPTY(&chain->buffers)) {
+            timer_del(chain->drain_timer);
+        }
+    }
+}
+
 static void virtio_net_rsc_cleanup(VirtIONet *n)
 {
     VirtioNetRscChain *chain, *rn_chain;
@@ -2207,6 +2315,7 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     default:
         g_assert_not_reached();
     }
+    seg->mss = seg->unit.payload;
 }
 
 static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
@@ -2245,6 +2354,31 @@ static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
     }
 }
 
+/*
+ * A GSO packet must be resegmentable into the packets it was built from:
+ * every segment but the last carries exactly mss bytes and the headers,
+ * options included, are otherwise the same.
+ */
+static bool virtio_net_rsc_gro_mergeable(VirtioNetRscSeg *seg,
+                                         VirtioNetRscUnit *n_unit)
+{
+    VirtioNetRscUnit *o_unit = &seg->unit;
+    uint16_t opt_len = o_unit->tcp_hdrlen - sizeof(struct tcp_header);
+
+    if (!seg->mss || o_unit->payload % seg->mss ||
+        n_unit->payload > seg->mss) {
+        return false;
+    }
+
+    if (htons(o_unit->tcp->th_offset_flags) & TH_PUSH) {
+        return false;
+    }
+
+    return o_unit->tcp->th_ack == n_unit->tcp->th_ack &&
+           o_unit->tcp_hdrlen == n_unit->tcp_hdrlen &&
+           !memcmp(o_unit->tcp + 1, n_unit->tcp + 1, opt_len);
+}
+
 static int32_t virtio_net_rsc_coalesce_data(VirtioNetRscChain *chain,
                                             VirtioNetRscSeg *seg,
                                             const uint8_t *buf,
@@ -2287,6 +2421,11 @@ coalesce:
             return RSC_FINAL;
         }
 
+        if (chain->n->rsc_gro && !virtio_net_rsc_gro_mergeable(seg, n_unit)) {
+            chain->stat.gro_final++;
+            return RSC_FINAL;
+        }
+
         /* Here comes the right data, the payload length in v4/v6 is different,
            so use the field value to update and record the new data len */
         o_unit->payload += n_unit->payload; /* update new data len */
@@ -2370,7 +2509,7 @@ static int virtio_net_rsc_tcp_ctrl_check(VirtioNetRscChain *chain,
         return RSC_FINAL;
     }
 
-    if (tcp_hdr > sizeof(struct tcp_header)) {
+    if (tcp_hdr > sizeof(struct tcp_header) && !chain->n->rsc_gro) {
         chain->stat.tcp_all_opt++;
         return RSC_FINAL;
     }
@@ -2497,6 +2636,62 @@ static int32_t virtio_net_rsc_sanity_check4(VirtioNetRscChain *chain,
     return RSC_CANDIDATE;
 }
 
+static bool virtio_net_rsc_tcp_csum_ok(VirtioNetRscChain *chain,
+                                       VirtioNetRscUnit *unit)
+{
+    uint16_t len = unit->tcp_hdrlen + unit->payload;
+    uint32_t sum;
+
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip = unit->ip;
+
+        sum = net_checksum_add(2 * sizeof(ip->ip_src),
+                               (uint8_t *)&ip->ip_src);
+    } else {
+        struct ip6_header *ip6 = unit->ip;
+
+        sum = net_checksum_add(2 * sizeof(struct in6_address),
+                               (uint8_t *)&ip6->ip6_src);
+    }
+    sum += IP_PROTO_TCP + len;
+    sum += net_checksum_add(len, (uint8_t *)unit->tcp);
+
+    return net_checksum_finish(sum) == 0;
+}
+
+/*
+ * Without the guest's RSC extension only packets that are complete and
+ * known to be good are coalesced, since the guest gets no chance to
+ * check the checksum of each of them.
+ */
+static bool virtio_net_rsc_gro_candidate(VirtioNetRscChain *chain,
+                                         const uint8_t *buf,
+                                         VirtioNetRscUnit *unit)
+{
+    const struct virtio_net_hdr *h = (const struct virtio_net_hdr *)buf;
+
+    /* The tcp header must fit in the ip payload */
+    if (unit->tcp_hdrlen < sizeof(struct tcp_header) ||
+        unit->tcp_hdrlen + unit->payload > VIRTIO_NET_MAX_TCP_PAYLOAD) {
+        chain->stat.ip_hacked++;
+        return false;
+    }
+
+    if (h->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        (h->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        chain->stat.gro_bypass++;
+        return false;
+    }
+
+    if (!(h->flags & VIRTIO_NET_HDR_F_DATA_VALID) &&
+        !virtio_net_rsc_tcp_csum_ok(chain, unit)) {
+        chain->stat.gro_csum_bad++;
+        return false;
+    }
+
+    return true;
+}
+
 static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
                                       NetClientState *nc,
                                       const uint8_t *buf, size_t size)
@@ -2520,6 +2715,10 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
     }
 
     ret = virtio_net_rsc_tcp_ctrl_check(chain, unit.tcp);
+    if (chain->n->rsc_gro && ret == RSC_CANDIDATE &&
+        !virtio_net_rsc_gro_candidate(chain, buf, &unit)) {
+        ret = RSC_FINAL;
+    }
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
@@ -2589,6 +2788,10 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
     }
 
     ret = virtio_net_rsc_tcp_ctrl_check(chain, unit.tcp);
+    if (chain->n->rsc_gro && ret == RSC_CANDIDATE &&
+        !virtio_net_rsc_gro_candidate(chain, buf, &unit)) {
+        ret = RSC_FINAL;
+    }
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
@@ -2678,6 +2881,62 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
     }
 }
 
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const NetPacketVec *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    g_autofree uint8_t *linear = NULL;
+    int i;
+
+    /*
+     * Used ring entries are filled as packets arrive but only published,
+     * and the guest only interrupted, once for the whole batch.  Packets
+     * steered to another queue by software RSS are still flushed one by one.
+     */
+    q->rx_batching = true;
+
+    for (i = 0; i < count; i++) {
+        const struct iovec *iov = pkts[i].iov;
+        const uint8_t *buf;
+        size_t size;
+
+        if (pkts[i].iovcnt == 1) {
+            buf = iov[0].iov_base;
+            size = iov[0].iov_len;
+        } else {
+            size = iov_size(iov, pkts[i].iovcnt);
+            if (size > NET_BUFSIZE) {
+                continue;
+            }
+            if (!linear) {
+                linear = g_malloc(NET_BUFSIZE);
+            }
+            size = iov_to_buf(iov, pkts[i].iovcnt, 0, linear, size);
+            buf = linear;
+        }
+
+        if (!virtio_net_receive(nc, buf, size)) {
+            break;
+        }
+    }
+
+    /* A batch is as far as software GRO waits for more segments */
+    if (n->rsc_gro) {
+        virtio_net_rsc_flush(n, nc);
+    }
+
+    q->rx_batching = false;
+
+    if (q->rx_pending) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+        q->rx_pending = 0;
+    }
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -2712,6 +2971,85 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     }
 }
 
+static void virtio_net_tx_pkt_free_frag(void *context, void *base, size_t len)
+{
+    /* Fragments point into the element, which flush_tx owns */
+}
+
+static void virtio_net_tx_sw_gso_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    assert(q->async_tx.segments);
+    /* Segments may complete while virtio_net_tx_sw_gso() is still sending */
+    if (--q->async_tx.segments == 0 && q->async_tx.elem) {
+        virtio_net_tx_complete(nc, len);
+    }
+}
+
+static void virtio_net_tx_sw_gso_sendv(void *opaque,
+                                       const struct iovec *iov, int iov_cnt,
+                                       const struct iovec *virt_iov,
+                                       int virt_iov_cnt)
+{
+    NetClientState *nc = opaque;
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    /* The peer takes no vnet header, so only @iov is sent */
+    if (!qemu_sendv_packet_async(nc, iov, iov_cnt,
+                                 virtio_net_tx_sw_gso_complete)) {
+        q->async_tx.segments++;
+    }
+}
+
+/*
+ * The peer takes no vnet header, so segment and checksum packets the
+ * guest left for the device to finish.  Returns false when there is
+ * nothing to do and the packet can be sent as is.  Segments that the
+ * peer cannot take yet are queued and counted in q->async_tx.segments.
+ */
+static bool virtio_net_tx_sw_gso(VirtIONetQueue *q, NetClientState *nc,
+                                 const struct iovec *out_sg,
+                                 unsigned int out_num)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    struct virtio_net_hdr *vhdr = net_tx_pkt_get_vhdr(q->tx_pkt);
+    size_t skip = n->guest_hdr_len;
+    unsigned int i;
+
+    if (iov_to_buf(out_sg, out_num, 0, vhdr, sizeof(*vhdr)) < sizeof(*vhdr)) {
+        return false;
+    }
+    if (vhdr->gso_type == VIRTIO_NET_HDR_GSO_NONE &&
+        !(vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        return false;
+    }
+    virtio_net_hdr_swap(vdev, vhdr);
+
+    for (i = 0; i < out_num; i++) {
+        if (out_sg[i].iov_len <= skip) {
+            skip -= out_sg[i].iov_len;
+            continue;
+        }
+        if (!net_tx_pkt_add_raw_fragment(q->tx_pkt,
+                                         out_sg[i].iov_base + skip,
+                                         out_sg[i].iov_len - skip)) {
+            goto out;
+        }
+        skip = 0;
+    }
+
+    if (net_tx_pkt_parse(q->tx_pkt)) {
+        net_tx_pkt_send_custom(q->tx_pkt, false, virtio_net_tx_sw_gso_sendv,
+                               nc);
+    }
+
+out:
+    net_tx_pkt_reset(q->tx_pkt, virtio_net_tx_pkt_free_frag, NULL);
+    return true;
+}
+
 /* TX */
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
@@ -2764,6 +3102,18 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_num += 1;
             out_sg = sg2;
         }
+        if (q->tx_pkt &&
+            virtio_net_tx_sw_gso(q, qemu_get_subqueue(n->nic, queue_index),
+                                 out_sg, out_num)) {
+            if (q->async_tx.segments) {
+                /* Like below, wait for the peer instead of dropping */
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.elem = elem;
+                return -EBUSY;
+            }
+            goto drop;
+        }
+
         /*
          * If host wants to see the guest header as is, we can
          * pass it on unchanged. Otherwise, copy just the parts
@@ -2974,27 +3324,34 @@ static void virtio_net_tx_bh(void *opaque)
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtIONetQueue *q = &n->vqs[index];
 
-    n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
-                                           virtio_net_handle_rx);
+    q->rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
+                                virtio_net_handle_rx);
 
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
-        n->vqs[index].tx_vq =
-            virtio_add_queue(vdev, n->net_conf.tx_queue_size,
-                             virtio_net_handle_tx_timer);
-        n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                              virtio_net_tx_timer,
-                                              &n->vqs[index]);
+        q->tx_vq = virtio_add_queue(vdev, n->net_conf.tx_queue_size,
+                                    virtio_net_handle_tx_timer);
+        if (q->ctx == qemu_get_aio_context()) {
+            q->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       virtio_net_tx_timer, q);
+        } else {
+            q->tx_timer = aio_timer_new(q->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        virtio_net_tx_timer, q);
+        }
     } else {
-        n->vqs[index].tx_vq =
-            virtio_add_queue(vdev, n->net_conf.tx_queue_size,
-                             virtio_net_handle_tx_bh);
-        n->vqs[index].tx_bh = qemu_bh_new_guarded(virtio_net_tx_bh, &n->vqs[index],
-                                                  &DEVICE(vdev)->mem_reentrancy_guard);
+        q->tx_vq = virtio_add_queue(vdev, n->net_conf.tx_queue_size,
+                                    virtio_net_handle_tx_bh);
+        q->tx_bh = aio_bh_new_guarded(q->ctx, virtio_net_tx_bh, q,
+                                      &DEVICE(vdev)->mem_reentrancy_guard);
+    }
+
+    if (n->tx_gso && !peer_has_vnet_hdr(n)) {
+        net_tx_pkt_init(&q->tx_pkt, VIRTQUEUE_MAX_SIZE);
     }
 
-    n->vqs[index].tx_waiting = 0;
-    n->vqs[index].n = n;
+    q->tx_waiting = 0;
+    q->n = n;
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -3013,6 +3370,10 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
         qemu_bh_delete(q->tx_bh);
         q->tx_bh = NULL;
     }
+    if (q->tx_pkt) {
+        net_tx_pkt_uninit(q->tx_pkt);
+        q->tx_pkt = NULL;
+    }
     q->tx_waiting = 0;
     virtio_del_queue(vdev, index * 2 + 1);
 }
@@ -3068,6 +3429,368 @@ static int virtio_net_pre_load_queues(VirtIODevice *vdev, uint32_t n)
     return 0;
 }
 
+static bool virtio_net_has_iothread(VirtIONet *n)
+{
+    return n->net_conf.iothread || n->net_conf.iothread_vq_mapping_list;
+}
+
+/* Queue pairs whose host notifiers were set up by the last ioeventfd start */
+static int virtio_net_ioeventfd_queue_pairs(VirtIONet *n)
+{
+    return (n->ioeventfd_nvqs - 1) / 2;
+}
+
+/*
+ * Stop notifications and tx flushing for a queue pair and hand its peer
+ * back to the main loop.
+ *
+ * Context: BH in the AioContext of the queue pair
+ */
+static void virtio_net_ioeventfd_stop_queue_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    virtio_queue_aio_detach_host_notifier(q->rx_vq, ctx);
+    virtio_queue_aio_detach_host_notifier(q->tx_vq, ctx);
+
+    /*
+     * Test and clear notifiers after disabling events, in case poll callback
+     * didn't have time to run.
+     */
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->rx_vq));
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(q->tx_vq));
+
+    /* ->tx_waiting stays set, virtio_net_ioeventfd_attach() rearms it */
+    if (q->tx_timer) {
+        timer_del(q->tx_timer);
+    } else {
+        qemu_bh_cancel(q->tx_bh);
+    }
+
+    if (nc->peer && nc->peer->aio_context) {
+        qemu_set_net_aio_context(nc->peer, NULL);
+    }
+}
+
+/* Context: BQL held */
+static void virtio_net_ioeventfd_detach(VirtIONet *n)
+{
+    for (int i = 0; i < virtio_net_ioeventfd_queue_pairs(n); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_wait_bh_oneshot(q->notifier_ctx,
+                            virtio_net_ioeventfd_stop_queue_bh, q);
+    }
+}
+
+/* Context: BQL held */
+static void virtio_net_ioeventfd_attach(VirtIONet *n)
+{
+    for (int i = 0; i < virtio_net_ioeventfd_queue_pairs(n); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+        AioContext *ctx = q->ctx;
+
+        if (nc->peer) {
+            if (qemu_can_set_net_aio_context(nc->peer)) {
+                qemu_set_net_aio_context(nc->peer, ctx);
+            } else {
+                /* Filtered after realize, keep the queue pair with it */
+                ctx = qemu_get_aio_context();
+            }
+        }
+        q->notifier_ctx = ctx;
+
+        if (q->tx_waiting) {
+            if (q->tx_timer) {
+                timer_mod(q->tx_timer,
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                          n->tx_timeout);
+            } else {
+                replay_bh_schedule_event(q->tx_bh);
+            }
+        }
+
+        /* Attaching the notifiers also kicks the virtqueues */
+        virtio_queue_aio_attach_host_notifier(q->rx_vq, ctx);
+        virtio_queue_aio_attach_host_notifier(q->tx_vq, ctx);
+    }
+}
+
+/*
+ * Keep the IOThreads off the rx/tx path while the main loop changes state
+ * that the datapath reads.  Calls nest and are no-ops unless the device
+ * was configured with an iothread and ioeventfd is started.
+ *
+ * Context: BQL held
+ */
+static void virtio_net_dataplane_pause(VirtIONet *n)
+{
+    if (n->dataplane_pause_count++ == 0 && n->ioeventfd_started) {
+        virtio_net_ioeventfd_detach(n);
+    }
+}
+
+/* Context: BQL held */
+static void virtio_net_dataplane_resume(VirtIONet *n)
+{
+    assert(n->dataplane_pause_count > 0);
+
+    if (--n->dataplane_pause_count == 0 && n->ioeventfd_started) {
+        virtio_net_ioeventfd_attach(n);
+    }
+}
+
+/* Context: BQL held */
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_get_num_queues(vdev);
+    int i, r;
+
+    if (!virtio_net_has_iothread(n)) {
+        return virtio_device_start_ioeventfd_impl(vdev);
+    }
+
+    if (n->ioeventfd_started || n->ioeventfd_starting) {
+        return 0;
+    }
+
+    n->ioeventfd_starting = true;
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        goto fail_guest_notifiers;
+    }
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r != 0) {
+            int j = i;
+
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+
+            /*
+             * The transaction expects the ioeventfds to be open when it
+             * commits. Do it now, before the cleanup loop.
+             */
+            memory_region_transaction_commit();
+
+            while (j--) {
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), j);
+            }
+            goto fail_host_notifiers;
+        }
+    }
+
+    memory_region_transaction_commit();
+
+    n->ioeventfd_nvqs = nvqs;
+    n->ioeventfd_starting = false;
+    n->ioeventfd_started = true;
+    smp_wmb(); /* paired with aio_notify_accept() on the read side */
+
+    /* The control virtqueue always stays in the main loop */
+    virtio_queue_aio_attach_host_notifier(n->ctrl_vq, qemu_get_aio_context());
+    if (n->dataplane_pause_count == 0) {
+        virtio_net_ioeventfd_attach(n);
+    }
+    return 0;
+
+fail_host_notifiers:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+fail_guest_notifiers:
+    n->ioeventfd_starting = false;
+    return -ENOSYS;
+}
+
+/* Context: BQL held */
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(n)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = n->ioeventfd_nvqs;
+    int i;
+
+    if (!virtio_net_has_iothread(n)) {
+        virtio_device_stop_ioeventfd_impl(vdev);
+        return;
+    }
+
+    if (!n->ioeventfd_started || n->ioeventfd_stopping) {
+        return;
+    }
+    n->ioeventfd_stopping = true;
+
+    if (n->dataplane_pause_count == 0) {
+        virtio_net_ioeventfd_detach(n);
+    }
+
+    /*
+     * Clear ->ioeventfd_started before draining the control virtqueue so
+     * that the commands it runs do not try to pause the datapath again.
+     */
+    n->ioeventfd_started = false;
+
+    virtio_queue_aio_detach_host_notifier(n->ctrl_vq, qemu_get_aio_context());
+    virtio_queue_host_notifier_read(virtio_queue_get_host_notifier(n->ctrl_vq));
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+
+    /*
+     * The transaction expects the ioeventfds to be open when it
+     * commits. Do it now, before the cleanup loop.
+     */
+    memory_region_transaction_commit();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    n->ioeventfd_stopping = false;
+}
+
+/* Context: BQL held */
+static bool virtio_net_vq_aio_context_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    virtio_net_conf *conf = &n->net_conf;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    g_autofree AioContext **vq_aio_context = NULL;
+    int i;
+
+    if (conf->iothread && conf->iothread_vq_mapping_list) {
+        error_setg(errp,
+                   "iothread and iothread-vq-mapping properties cannot be set "
+                   "at the same time");
+        return false;
+    }
+
+    if (!virtio_net_has_iothread(n)) {
+        for (i = 0; i < n->max_queue_pairs; i++) {
+            n->vqs[i].ctx = qemu_get_aio_context();
+        }
+        return true;
+    }
+
+    if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+        error_setg(errp,
+                   "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return false;
+    }
+    if (!virtio_device_ioeventfd_enabled(vdev)) {
+        error_setg(errp, "ioeventfd is required for iothread");
+        return false;
+    }
+
+    /*
+     * Software RSS and receive segment coalescing move packets between
+     * queue pairs and share state across them.
+     */
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS) ||
+        virtio_has_feature(n->host_features, VIRTIO_NET_F_HASH_REPORT) ||
+        virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT) ||
+        n->rx_gro) {
+        error_setg(errp, "rss, hash, guest_rsc_ext and rx-gro cannot be used "
+                   "with iothread");
+        return false;
+    }
+
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+        if (!peer || !peer->is_datapath) {
+            continue;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "iothread cannot be used with vhost");
+            return false;
+        }
+        if (!qemu_can_set_net_aio_context(peer)) {
+            error_setg(errp, "netdev '%s' does not support iothread",
+                       peer->name);
+            return false;
+        }
+    }
+
+    /* With iothread-vq-mapping, "vqs" are queue pair indices */
+    vq_aio_context = g_new(AioContext *, n->max_queue_pairs);
+
+    if (conf->iothread_vq_mapping_list) {
+        if (!iothread_vq_mapping_apply(conf->iothread_vq_mapping_list,
+                                       vq_aio_context,
+                                       n->max_queue_pairs,
+                                       errp)) {
+            return false;
+        }
+    } else {
+        AioContext *ctx = iothread_get_aio_context(conf->iothread);
+        for (i = 0; i < n->max_queue_pairs; i++) {
+            vq_aio_context[i] = ctx;
+        }
+
+        /* Released in virtio_net_vq_aio_context_cleanup() */
+        object_ref(OBJECT(conf->iothread));
+    }
+
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        n->vqs[i].ctx = vq_aio_context[i];
+    }
+
+    /*
+     * ->guest_notifier_mask() only knows about vhost, let virtio-pci set up
+     * irqfds for the IOThreads directly.
+     */
+    vdev->use_guest_notifier_mask = false;
+    return true;
+}
+
+/* Context: BQL held */
+static void virtio_net_vq_aio_context_cleanup(VirtIONet *n)
+{
+    virtio_net_conf *conf = &n->net_conf;
+
+    assert(!n->ioeventfd_started);
+
+    if (conf->iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(conf->iothread_vq_mapping_list);
+    }
+
+    if (conf->iothread) {
+        object_unref(OBJECT(conf->iothread));
+    }
+}
+
 static void virtio_net_get_features(VirtIODevice *vdev, uint64_t *features,
                                     Error **errp)
 {
@@ -3088,9 +3811,12 @@ static void virtio_net_get_features(VirtIODevice *vdev, uint64_t *features,
     virtio_add_feature_ex(features, VIRTIO_NET_F_MAC);
 
     if (!peer_has_vnet_hdr(n)) {
-        virtio_clear_feature_ex(features, VIRTIO_NET_F_CSUM);
-        virtio_clear_feature_ex(features, VIRTIO_NET_F_HOST_TSO4);
-        virtio_clear_feature_ex(features, VIRTIO_NET_F_HOST_TSO6);
+        /* With tx-gso, checksums and TSO are done by virtio_net_tx_sw_gso() */
+        if (!n->tx_gso) {
+            virtio_clear_feature_ex(features, VIRTIO_NET_F_CSUM);
+            virtio_clear_feature_ex(features, VIRTIO_NET_F_HOST_TSO4);
+            virtio_clear_feature_ex(features, VIRTIO_NET_F_HOST_TSO6);
+        }
         virtio_clear_feature_ex(features, VIRTIO_NET_F_HOST_ECN);
 
         virtio_clear_feature_ex(features, VIRTIO_NET_F_GUEST_CSUM);
@@ -3630,6 +4356,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3958,6 +4685,12 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
     n->vqs = g_new0(VirtIONetQueue, n->max_queue_pairs);
+    if (!virtio_net_vq_aio_context_init(n, errp)) {
+        g_free(n->vqs);
+        n->vqs = NULL;
+        virtio_cleanup(vdev);
+        return;
+    }
     n->curr_queue_pairs = 1;
     n->tx_timeout = n->net_conf.txtimer;
 
@@ -4082,6 +4815,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     }
     /* delete also control vq */
     virtio_del_queue(vdev, max_queue_pairs * 2);
+    virtio_net_vq_aio_context_cleanup(n);
     qemu_announce_timer_del(&n->announce_timer, false);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
@@ -4238,6 +4972,8 @@ static const Property virtio_net_properties[] = {
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
+    DEFINE_PROP_BOOL("rx-gro", VirtIONet, rx_gro, false),
+    DEFINE_PROP_BOOL("tx-gso", VirtIONet, tx_gso, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -4253,6 +4989,10 @@ static const Property virtio_net_properties[] = {
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_LINK("iothread", VirtIONet, net_conf.iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_IOTHREAD_VQ_MAPPING_LIST("iothread-vq-mapping", VirtIONet,
+                                         net_conf.iothread_vq_mapping_list),
     DEFINE_PROP_BIT64("guest_uso4", VirtIONet, host_features,
                       VIRTIO_NET_F_GUEST_USO4, true),
     DEFINE_PROP_BIT64("guest_uso6", VirtIONet, host_features,
@@ -4332,6 +5072,8 @@ static void virtio_net_class_init(ObjectClass *klass, const void *data)
     vdc->queue_reset = virtio_net_queue_reset;
     vdc->queue_enable = virtio_net_queue_enable;
     vdc->set_status = virtio_net_set_status;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
@@ -95,6 +95,9 @@ static const Property pci_props[] = {
                     QEMU_PCIE_ARI_NEXTFN_1_BITNR, false),
     DEFINE_PROP_SIZE32("x-max-bounce-buffer-size", PCIDevice,
                      max_bounce_buffer_size, DEFAULT_MAX_BOUNCE_BUFFER_SIZE),
+    DEFINE_PROP_UINT32("x-bounce-buffer-pool-depth", PCIDevice,
+                       bounce_buffer_pool_depth,
+                       DEFAULT_BOUNCE_BUFFER_POOL_DEPTH),
     DEFINE_PROP_STRING("sriov-pf", PCIDevice, sriov_pf),
     DEFINE_PROP_BIT("x-pcie-ext-tag", PCIDevice, cap_present,
                     QEMU_PCIE_EXT_TAG_BITNR, true),
@@ -1380,6 +1383,8 @@ static PCIDevice *do_pci_register_device(PCIDevice *pci_dev,
                        &pci_dev->bus_master_container_region, pci_dev->name);
     pci_dev->bus_master_as.max_bounce_buffer_size =
         pci_dev->max_bounce_buffer_size;
+    pci_dev->bus_master_as.bounce_buffer_pool_depth =
+        pci_dev->bounce_buffer_pool_depth;
 
     if (phase_check(PHASE_MACHINE_READY)) {
         pci_init_bus_master(pci_dev);
@@ -2847,6 +2852,10 @@ static void pci_device_class_init(ObjectClass *klass, const void *data)
         klass, "x-max-bounce-buffer-size",
         "Maximum buffer size allocated for bounce buffers used for mapped "
         "access to indirect DMA memory");
+    object_class_property_set_description(
+        klass, "x-bounce-buffer-pool-depth",
+        "Number of idle bounce buffers kept for reuse by mapped access to "
+        "indirect DMA memory");
 }
 
 static void pci_device_class_base_init(ObjectClass *klass, const void *data)
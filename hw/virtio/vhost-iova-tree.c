@@ -8,7 +8,10 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
 #include "qemu/iova-tree.h"
+#include "qemu/lockable.h"
+#include "qemu/thread.h"
 #include "vhost-iova-tree.h"
 
 #define iova_min_addr qemu_real_host_page_size()
@@ -34,6 +37,16 @@ struct VhostIOVATree {
 
     /* GPA->IOVA address memory maps */
     IOVATree *gpa_iova_map;
+
+    /*
+     * Serializes tree updates against vhost_iova_tree_find_cached() calls
+     * from shadow virtqueues running outside of the BQL.  Updates only
+     * happen with the BQL held, so lookups under the BQL need no lock.
+     */
+    QemuMutex lock;
+
+    /* Bumped whenever a mapping is removed, invalidating VhostIOVACache */
+    uint64_t gen;
 };
 
 /**
@@ -52,6 +65,8 @@ VhostIOVATree *vhost_iova_tree_new(hwaddr iova_first, hwaddr iova_last)
     tree->iova_taddr_map = iova_tree_new();
     tree->iova_map = iova_tree_new();
     tree->gpa_iova_map = gpa_tree_new();
+    qemu_mutex_init(&tree->lock);
+    tree->gen = 1;
     return tree;
 }
 
@@ -63,6 +78,7 @@ void vhost_iova_tree_delete(VhostIOVATree *iova_tree)
     iova_tree_destroy(iova_tree->iova_taddr_map);
     iova_tree_destroy(iova_tree->iova_map);
     iova_tree_destroy(iova_tree->gpa_iova_map);
+    qemu_mutex_destroy(&iova_tree->lock);
     g_free(iova_tree);
 }
 
@@ -105,6 +121,8 @@ int vhost_iova_tree_map_alloc(VhostIOVATree *tree, DMAMap *map, hwaddr taddr)
         return IOVA_ERR_INVALID;
     }
 
+    QEMU_LOCK_GUARD(&tree->lock);
+
     /* Allocate a node in the IOVA-only tree */
     ret = iova_tree_alloc_map(tree->iova_map, map, iova_first, tree->iova_last);
     if (unlikely(ret != IOVA_OK)) {
@@ -124,8 +142,10 @@ int vhost_iova_tree_map_alloc(VhostIOVATree *tree, DMAMap *map, hwaddr taddr)
  */
 void vhost_iova_tree_remove(VhostIOVATree *iova_tree, DMAMap map)
 {
+    QEMU_LOCK_GUARD(&iova_tree->lock);
     iova_tree_remove(iova_tree->iova_taddr_map, map);
     iova_tree_remove(iova_tree->iova_map, map);
+    qatomic_inc(&iova_tree->gen);
 }
 
 /**
@@ -167,6 +187,8 @@ int vhost_iova_tree_map_alloc_gpa(VhostIOVATree *tree, DMAMap *map, hwaddr taddr
         return IOVA_ERR_INVALID;
     }
 
+    QEMU_LOCK_GUARD(&tree->lock);
+
     /* Allocate a node in the IOVA-only tree */
     ret = iova_tree_alloc_map(tree->iova_map, map, iova_first, tree->iova_last);
     if (unlikely(ret != IOVA_OK)) {
@@ -186,6 +208,65 @@ int vhost_iova_tree_map_alloc_gpa(VhostIOVATree *tree, DMAMap *map, hwaddr taddr
  */
 void vhost_iova_tree_remove_gpa(VhostIOVATree *iova_tree, DMAMap map)
 {
+    QEMU_LOCK_GUARD(&iova_tree->lock);
     iova_tree_remove(iova_tree->gpa_iova_map, map);
     iova_tree_remove(iova_tree->iova_map, map);
+    qatomic_inc(&iova_tree->gen);
+}
+
+/**
+ * Find a mapping, looking first in a small cache of recent translations
+ *
+ * @tree: The VhostIOVATree
+ * @cache: The caller's cache of recent translations
+ * @needle: The map with the memory address to translate
+ * @gpa: True to search the GPA->IOVA tree, false for the IOVA->HVA tree
+ *
+ * Descriptors tend to reuse a handful of guest memory regions, and each
+ * tree search walks the whole tree, so keep copies of the last few maps
+ * found.  The cache is dropped as soon as any mapping is removed from the
+ * tree.  Unlike the other lookups this one is safe to call without the BQL.
+ *
+ * The cache is validated and the mapping copied with the tree lock held, so
+ * that a concurrent vhost_iova_tree_remove() cannot hand out a stale entry.
+ *
+ * Returns true and stores a copy of the mapping containing the start of
+ * @needle in @result, or false if not found.
+ */
+bool vhost_iova_tree_find_cached(VhostIOVATree *tree, VhostIOVACache *cache,
+                                 const DMAMap *needle, bool gpa,
+                                 DMAMap *result)
+{
+    const DMAMap *map;
+    uint64_t gen;
+
+    QEMU_LOCK_GUARD(&tree->lock);
+
+    gen = qatomic_read(&tree->gen);
+    if (unlikely(cache->gen != gen)) {
+        for (size_t i = 0; i < VHOST_IOVA_CACHE_SIZE; ++i) {
+            cache->maps[i].perm = IOMMU_NONE;
+        }
+        cache->gen = gen;
+    }
+
+    for (size_t i = 0; i < VHOST_IOVA_CACHE_SIZE; ++i) {
+        map = &cache->maps[i];
+        if (map->perm != IOMMU_NONE &&
+            needle->translated_addr >= map->translated_addr &&
+            needle->translated_addr - map->translated_addr <= map->size) {
+            *result = *map;
+            return true;
+        }
+    }
+
+    map = iova_tree_find_iova(gpa ? tree->gpa_iova_map : tree->iova_taddr_map,
+                              needle);
+    if (!map) {
+        return false;
+    }
+
+    cache->maps[cache->next++ % VHOST_IOVA_CACHE_SIZE] = *map;
+    *result = *map;
+    return true;
 }
@@ -15,6 +15,17 @@
 
 typedef struct VhostIOVATree VhostIOVATree;
 
+#define VHOST_IOVA_CACHE_SIZE 4
+
+/* Recent translations of one VhostIOVATree user */
+typedef struct VhostIOVACache {
+    /* Tree generation the entries belong to, 0 for an empty cache */
+    uint64_t gen;
+    /* Next entry to replace */
+    unsigned int next;
+    DMAMap maps[VHOST_IOVA_CACHE_SIZE];
+} VhostIOVACache;
+
 VhostIOVATree *vhost_iova_tree_new(uint64_t iova_first, uint64_t iova_last);
 void vhost_iova_tree_delete(VhostIOVATree *iova_tree);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(VhostIOVATree, vhost_iova_tree_delete);
@@ -29,5 +40,9 @@ const DMAMap *vhost_iova_tree_find_gpa(const VhostIOVATree *iova_tree,
 int vhost_iova_tree_map_alloc_gpa(VhostIOVATree *iova_tree, DMAMap *map,
                                   hwaddr taddr);
 void vhost_iova_tree_remove_gpa(VhostIOVATree *iova_tree, DMAMap map);
+bool vhost_iova_tree_find_cached(VhostIOVATree *iova_tree,
+                                 VhostIOVACache *cache,
+                                 const DMAMap *needle, bool gpa,
+                                 DMAMap *result);
 
 #endif
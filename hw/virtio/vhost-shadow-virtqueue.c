@@ -10,6 +10,7 @@
 #include "qemu/osdep.h"
 #include "hw/virtio/vhost-shadow-virtqueue.h"
 
+#include "qemu/aio-wait.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "qemu/main-loop.h"
@@ -17,6 +18,9 @@
 #include "qemu/memalign.h"
 #include "linux-headers/linux/vhost.h"
 
+/* Guest elements fetched per virtqueue_pop_batch() call */
+#define VHOST_SVQ_POP_BATCH 32
+
 /**
  * Validate the transport device features that both guests can use with the SVQ
  * and SVQs can use with the device.
@@ -80,7 +84,7 @@ uint16_t vhost_svq_available_slots(const VhostShadowVirtqueue *svq)
  * @num: Length of iovec and minimum length of vaddr
  * @gpas: Descriptors' GPAs, if backed by guest memory
  */
-static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
+static bool vhost_svq_translate_addr(VhostShadowVirtqueue *svq,
                                      hwaddr *addrs, const struct iovec *iovec,
                                      size_t num, const hwaddr *gpas)
 {
@@ -91,8 +95,8 @@ static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
     for (size_t i = 0; i < num; ++i) {
         Int128 needle_last, map_last;
         size_t off;
-        const DMAMap *map;
-        DMAMap needle;
+        DMAMap needle, map;
+        bool found;
 
         /* Check if the descriptor is backed by guest memory  */
         if (gpas) {
@@ -101,33 +105,37 @@ static bool vhost_svq_translate_addr(const VhostShadowVirtqueue *svq,
                 .translated_addr = gpas[i],
                 .size = iovec[i].iov_len,
             };
-            map = vhost_iova_tree_find_gpa(svq->iova_tree, &needle);
+            found = vhost_iova_tree_find_cached(svq->iova_tree,
+                                                &svq->gpa_cache, &needle,
+                                                true, &map);
         } else {
             /* Search the IOVA->HVA tree */
             needle = (DMAMap) {
                 .translated_addr = (hwaddr)(uintptr_t)iovec[i].iov_base,
                 .size = iovec[i].iov_len,
             };
-            map = vhost_iova_tree_find_iova(svq->iova_tree, &needle);
+            found = vhost_iova_tree_find_cached(svq->iova_tree,
+                                                &svq->iova_cache, &needle,
+                                                false, &map);
         }
 
         /*
          * Map cannot be NULL since iova map contains all guest space and
          * qemu already has a physical address mapped
          */
-        if (unlikely(!map)) {
+        if (unlikely(!found)) {
             qemu_log_mask(LOG_GUEST_ERROR,
                           "Invalid address 0x%"HWADDR_PRIx" given by guest",
                           needle.translated_addr);
             return false;
         }
 
-        off = needle.translated_addr - map->translated_addr;
-        addrs[i] = map->iova + off;
+        off = needle.translated_addr - map.translated_addr;
+        addrs[i] = map.iova + off;
 
         needle_last = int128_add(int128_make64(needle.translated_addr),
                                  int128_makes64(iovec[i].iov_len - 1));
-        map_last = int128_make64(map->translated_addr + map->size);
+        map_last = int128_make64(map.translated_addr + map.size);
         if (unlikely(int128_gt(needle_last, map_last))) {
             qemu_log_mask(LOG_GUEST_ERROR,
                           "Guest buffer expands over iova range");
@@ -236,7 +244,13 @@ static bool vhost_svq_add_split(VhostShadowVirtqueue *svq,
     return true;
 }
 
-static void vhost_svq_kick(VhostShadowVirtqueue *svq)
+/**
+ * Notify the device if it asked for it since @old_avail_idx.
+ *
+ * @svq: The svq
+ * @old_avail_idx: shadow_avail_idx before the buffers were made available
+ */
+static void vhost_svq_kick(VhostShadowVirtqueue *svq, uint16_t old_avail_idx)
 {
     bool needs_kick;
 
@@ -249,7 +263,8 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
     if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t avail_event = le16_to_cpu(
                 *(uint16_t *)(&svq->vring.used->ring[svq->vring.num]));
-        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, svq->shadow_avail_idx - 1);
+        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx,
+                                      old_avail_idx);
     } else {
         needs_kick =
                 !(svq->vring.used->flags & cpu_to_le16(VRING_USED_F_NO_NOTIFY));
@@ -262,15 +277,11 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
     event_notifier_set(&svq->hdev_kick);
 }
 
-/**
- * Add an element to a SVQ.
- *
- * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
- */
-int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
-                  size_t out_num, const hwaddr *out_addr,
-                  const struct iovec *in_sg, size_t in_num,
-                  const hwaddr *in_addr, VirtQueueElement *elem)
+static int vhost_svq_add_nokick(VhostShadowVirtqueue *svq,
+                                const struct iovec *out_sg, size_t out_num,
+                                const hwaddr *out_addr,
+                                const struct iovec *in_sg, size_t in_num,
+                                const hwaddr *in_addr, VirtQueueElement *elem)
 {
     unsigned qemu_head;
     unsigned ndescs = in_num + out_num;
@@ -289,16 +300,81 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
     svq->num_free -= ndescs;
     svq->desc_state[qemu_head].elem = elem;
     svq->desc_state[qemu_head].ndescs = ndescs;
-    vhost_svq_kick(svq);
     return 0;
 }
 
-/* Convenience wrapper to add a guest's element to SVQ */
+/**
+ * Add an element to a SVQ.
+ *
+ * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+ */
+int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
+                  size_t out_num, const hwaddr *out_addr,
+                  const struct iovec *in_sg, size_t in_num,
+                  const hwaddr *in_addr, VirtQueueElement *elem)
+{
+    int r = vhost_svq_add_nokick(svq, out_sg, out_num, out_addr, in_sg,
+                                 in_num, in_addr, elem);
+
+    if (likely(r == 0)) {
+        vhost_svq_kick(svq, svq->shadow_avail_idx - 1);
+    }
+    return r;
+}
+
+/*
+ * Convenience wrapper to add a guest's element to SVQ.  The caller kicks the
+ * device once the whole batch is available.
+ */
 static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
                                  VirtQueueElement *elem)
 {
-    return vhost_svq_add(svq, elem->out_sg, elem->out_num, elem->out_addr,
-                         elem->in_sg, elem->in_num, elem->in_addr, elem);
+    return vhost_svq_add_nokick(svq, elem->out_sg, elem->out_num,
+                                elem->out_addr, elem->in_sg, elem->in_num,
+                                elem->in_addr, elem);
+}
+
+/* Return popped but not forwarded guest elements to the guest's vring */
+static void vhost_svq_unpop_elems(VhostShadowVirtqueue *svq,
+                                  VirtQueueElement **elems, unsigned int num)
+{
+    /* Last popped first, so the rewinds undo the pops in order */
+    while (num--) {
+        virtqueue_unpop(svq->vq, elems[num], 0);
+        g_free(elems[num]);
+    }
+}
+
+static void vhost_svq_detach_notifier_bh(void *opaque)
+{
+    EventNotifier *e = opaque;
+
+    aio_set_event_notifier(qemu_get_current_aio_context(), e, NULL, NULL,
+                           NULL);
+}
+
+/**
+ * Set the handler of one of the SVQ notifiers in the SVQ context
+ *
+ * @svq: The svq
+ * @e: The notifier
+ * @handler: The handler, or NULL to stop handling @e
+ *
+ * Called on BQL context.  Once this returns with a NULL @handler, the
+ * previous handler is not running anymore even if the SVQ has its own
+ * thread.
+ */
+static void vhost_svq_set_notifier_handler(VhostShadowVirtqueue *svq,
+                                           EventNotifier *e,
+                                           EventNotifierHandler *handler)
+{
+    if (!svq->ctx) {
+        event_notifier_set_handler(e, handler);
+    } else if (handler) {
+        aio_set_event_notifier(svq->ctx, e, handler, NULL, NULL);
+    } else {
+        aio_wait_bh_oneshot(svq->ctx, vhost_svq_detach_notifier_bh, e);
+    }
 }
 
 /**
@@ -316,6 +392,8 @@ static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
  */
 static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
 {
+    uint16_t old_avail_idx = svq->shadow_avail_idx;
+
     /* Clear event notifier */
     event_notifier_test_and_clear(&svq->svq_kick);
 
@@ -324,25 +402,35 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
         virtio_queue_set_notification(svq->vq, false);
 
         while (true) {
-            g_autofree VirtQueueElement *elem = NULL;
-            int r;
+            VirtQueueElement *elems[VHOST_SVQ_POP_BATCH];
+            unsigned int i, n;
 
             if (svq->next_guest_avail_elem) {
-                elem = g_steal_pointer(&svq->next_guest_avail_elem);
+                elems[0] = g_steal_pointer(&svq->next_guest_avail_elem);
+                n = 1;
             } else {
-                elem = virtqueue_pop(svq->vq, sizeof(*elem));
+                n = virtqueue_pop_batch(svq->vq, sizeof(VirtQueueElement),
+                                        (void **)elems, ARRAY_SIZE(elems));
             }
 
-            if (!elem) {
+            if (!n) {
                 break;
             }
 
-            if (svq->ops) {
-                r = svq->ops->avail_handler(svq, elem, svq->ops_opaque);
-            } else {
-                r = vhost_svq_add_element(svq, elem);
-            }
-            if (unlikely(r != 0)) {
+            for (i = 0; i < n; i++) {
+                int r;
+
+                if (svq->ops) {
+                    r = svq->ops->avail_handler(svq, elems[i],
+                                                svq->ops_opaque);
+                } else {
+                    r = vhost_svq_add_element(svq, elems[i]);
+                }
+                if (likely(r == 0)) {
+                    /* elem belongs to SVQ or external caller now */
+                    continue;
+                }
+
                 if (r == -ENOSPC) {
                     /*
                      * This condition is possible since a contiguous buffer in
@@ -355,18 +443,25 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
                      * queue the current guest descriptor and ignore kicks
                      * until some elements are used.
                      */
-                    svq->next_guest_avail_elem = g_steal_pointer(&elem);
+                    svq->next_guest_avail_elem = elems[i];
+                } else {
+                    g_free(elems[i]);
                 }
+                vhost_svq_unpop_elems(svq, elems + i + 1, n - i - 1);
 
                 /* VQ is full or broken, just return and ignore kicks */
-                return;
+                goto out;
             }
-            /* elem belongs to SVQ or external caller now */
-            elem = NULL;
         }
 
         virtio_queue_set_notification(svq->vq, true);
     } while (!virtio_queue_empty(svq->vq));
+
+out:
+    /* avail_handler adds and kicks by itself through vhost_svq_add() */
+    if (!svq->ops && svq->shadow_avail_idx != old_avail_idx) {
+        vhost_svq_kick(svq, old_avail_idx);
+    }
 }
 
 /**
@@ -589,15 +684,13 @@ static void vhost_svq_handle_call(EventNotifier *n)
     vhost_svq_flush(svq, true);
 }
 
-/**
- * Set the call notifier for the SVQ to call the guest
- *
- * @svq: Shadow virtqueue
- * @call_fd: call notifier
- *
- * Called on BQL context.
- */
-void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd)
+typedef struct VhostSVQCallFd {
+    VhostShadowVirtqueue *svq;
+    int call_fd;
+} VhostSVQCallFd;
+
+static void vhost_svq_do_set_svq_call_fd(VhostShadowVirtqueue *svq,
+                                         int call_fd)
 {
     if (call_fd == VHOST_FILE_UNBIND) {
         /*
@@ -612,6 +705,37 @@ void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd)
     }
 }
 
+static void vhost_svq_set_svq_call_fd_bh(void *opaque)
+{
+    VhostSVQCallFd *data = opaque;
+
+    vhost_svq_do_set_svq_call_fd(data->svq, data->call_fd);
+}
+
+/**
+ * Set the call notifier for the SVQ to call the guest
+ *
+ * @svq: Shadow virtqueue
+ * @call_fd: call notifier
+ *
+ * Called on BQL context.
+ */
+void vhost_svq_set_svq_call_fd(VhostShadowVirtqueue *svq, int call_fd)
+{
+    VhostSVQCallFd data = {
+        .svq = svq,
+        .call_fd = call_fd,
+    };
+
+    if (!svq->ctx) {
+        vhost_svq_do_set_svq_call_fd(svq, call_fd);
+        return;
+    }
+
+    /* Do not switch the notifier under the feet of vhost_svq_flush() */
+    aio_wait_bh_oneshot(svq->ctx, vhost_svq_set_svq_call_fd_bh, &data);
+}
+
 /**
  * Get the shadow vq vring address.
  * @svq: Shadow virtqueue
@@ -641,6 +765,23 @@ size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq)
     return ROUND_UP(used_size, qemu_real_host_page_size());
 }
 
+/*
+ * Start handling guest kicks, checking for buffers made available while no
+ * handler was installed.
+ */
+static void vhost_svq_start_kick(VhostShadowVirtqueue *svq)
+{
+    EventNotifier *svq_kick = &svq->svq_kick;
+
+    if (event_notifier_get_fd(svq_kick) == VHOST_FILE_UNBIND) {
+        return;
+    }
+
+    event_notifier_set(svq_kick);
+    vhost_svq_set_notifier_handler(svq, svq_kick,
+                                   vhost_handle_guest_kick_notifier);
+}
+
 /**
  * Set a new file descriptor for the guest to kick the SVQ and notify for avail
  *
@@ -648,26 +789,22 @@ size_t vhost_svq_device_area_size(const VhostShadowVirtqueue *svq)
  * @svq_kick_fd: The svq kick fd
  *
  * Note that the SVQ will never close the old file descriptor.
+ *
+ * The kick handler is only installed once the SVQ is started, as it may run
+ * in the SVQ thread right away and needs the vring.
  */
 void vhost_svq_set_svq_kick_fd(VhostShadowVirtqueue *svq, int svq_kick_fd)
 {
     EventNotifier *svq_kick = &svq->svq_kick;
     bool poll_stop = VHOST_FILE_UNBIND != event_notifier_get_fd(svq_kick);
-    bool poll_start = svq_kick_fd != VHOST_FILE_UNBIND;
 
     if (poll_stop) {
-        event_notifier_set_handler(svq_kick, NULL);
+        vhost_svq_set_notifier_handler(svq, svq_kick, NULL);
     }
 
     event_notifier_init_fd(svq_kick, svq_kick_fd);
-    /*
-     * event_notifier_set_handler already checks for guest's notifications if
-     * they arrive at the new file descriptor in the switch, so there is no
-     * need to explicitly check for them.
-     */
-    if (poll_start) {
-        event_notifier_set(svq_kick);
-        event_notifier_set_handler(svq_kick, vhost_handle_guest_kick_notifier);
+    if (svq->vq) {
+        vhost_svq_start_kick(svq);
     }
 }
 
@@ -684,7 +821,6 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
 {
     size_t desc_size;
 
-    event_notifier_set_handler(&svq->hdev_call, vhost_svq_handle_call);
     svq->next_guest_avail_elem = NULL;
     svq->shadow_avail_idx = 0;
     svq->shadow_used_idx = 0;
@@ -692,6 +828,8 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
     svq->vdev = vdev;
     svq->vq = vq;
     svq->iova_tree = iova_tree;
+    svq->iova_cache = (VhostIOVACache) {};
+    svq->gpa_cache = (VhostIOVACache) {};
 
     svq->vring.num = virtio_queue_get_num(vdev, virtio_get_queue_index(vq));
     svq->num_free = svq->vring.num;
@@ -708,6 +846,10 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
     for (unsigned i = 0; i < svq->vring.num - 1; i++) {
         svq->desc_next[i] = i + 1;
     }
+
+    vhost_svq_set_notifier_handler(svq, &svq->hdev_call,
+                                   vhost_svq_handle_call);
+    vhost_svq_start_kick(svq);
 }
 
 /**
@@ -716,13 +858,21 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
  */
 void vhost_svq_stop(VhostShadowVirtqueue *svq)
 {
-    vhost_svq_set_svq_kick_fd(svq, VHOST_FILE_UNBIND);
     g_autofree VirtQueueElement *next_avail_elem = NULL;
 
+    /*
+     * Synchronously detaches the kick handler from the SVQ thread, so it
+     * cannot run while the vring is torn down below.
+     */
+    vhost_svq_set_svq_kick_fd(svq, VHOST_FILE_UNBIND);
+
     if (!svq->vq) {
         return;
     }
 
+    /* The SVQ thread must not race with the flush below */
+    vhost_svq_set_notifier_handler(svq, &svq->hdev_call, NULL);
+
     /* Send all pending used descriptors to guest */
     vhost_svq_flush(svq, false);
 
@@ -747,7 +897,6 @@ void vhost_svq_stop(VhostShadowVirtqueue *svq)
     g_free(svq->desc_state);
     munmap(svq->vring.desc, vhost_svq_driver_area_size(svq));
     munmap(svq->vring.used, vhost_svq_device_area_size(svq));
-    event_notifier_set_handler(&svq->hdev_call, NULL);
 }
 
 /**
@@ -756,15 +905,20 @@ void vhost_svq_stop(VhostShadowVirtqueue *svq)
  *
  * @ops: SVQ owner callbacks
  * @ops_opaque: ops opaque pointer
+ * @ctx: context to forward buffers in, or NULL for the main loop
  */
 VhostShadowVirtqueue *vhost_svq_new(const VhostShadowVirtqueueOps *ops,
-                                    void *ops_opaque)
+                                    void *ops_opaque, AioContext *ctx)
 {
     VhostShadowVirtqueue *svq = g_new0(VhostShadowVirtqueue, 1);
 
+    /* Owner callbacks, like CVQ's vhost_svq_poll(), expect the main loop */
+    assert(!ctx || !ops);
+
     event_notifier_init_fd(&svq->svq_kick, VHOST_FILE_UNBIND);
     svq->ops = ops;
     svq->ops_opaque = ops_opaque;
+    svq->ctx = ctx;
     return svq;
 }
 
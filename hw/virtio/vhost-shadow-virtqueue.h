@@ -11,6 +11,7 @@
 #define VHOST_SHADOW_VIRTQUEUE_H
 
 #include "qemu/event_notifier.h"
+#include "qemu/aio.h"
 #include "hw/virtio/virtio.h"
 #include "standard-headers/linux/vhost_types.h"
 #include "hw/virtio/vhost-iova-tree.h"
@@ -78,6 +79,16 @@ typedef struct VhostShadowVirtqueue {
     /* IOVA mapping */
     VhostIOVATree *iova_tree;
 
+    /* Recent IOVA->HVA and GPA->IOVA translations */
+    VhostIOVACache iova_cache;
+    VhostIOVACache gpa_cache;
+
+    /*
+     * Context the SVQ notifiers are handled in, or NULL for the main loop.
+     * Only SVQs without ops can run outside of the main loop.
+     */
+    AioContext *ctx;
+
     /* SVQ vring descriptors state */
     SVQDescState *desc_state;
 
@@ -135,7 +146,7 @@ void vhost_svq_start(VhostShadowVirtqueue *svq, VirtIODevice *vdev,
 void vhost_svq_stop(VhostShadowVirtqueue *svq);
 
 VhostShadowVirtqueue *vhost_svq_new(const VhostShadowVirtqueueOps *ops,
-                                    void *ops_opaque);
+                                    void *ops_opaque, AioContext *ctx);
 
 void vhost_svq_free(gpointer vq);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(VhostShadowVirtqueue, vhost_svq_free);
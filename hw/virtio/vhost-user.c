@@ -104,6 +104,7 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_SHARED_OBJECT = 41,
     VHOST_USER_SET_DEVICE_STATE_FD = 42,
     VHOST_USER_CHECK_DEVICE_STATE = 43,
+    VHOST_USER_SET_VRING_BUSYLOOP_TIMEOUT = 44,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -1181,6 +1182,18 @@ static int vhost_user_set_vring_num(struct vhost_dev *dev,
     return vhost_set_vring(dev, VHOST_USER_SET_VRING_NUM, ring, false);
 }
 
+static int vhost_user_set_vring_busyloop_timeout(struct vhost_dev *dev,
+                                                 struct vhost_vring_state *ring)
+{
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_BUSY_POLL)) {
+        return -ENOTSUP;
+    }
+
+    return vhost_set_vring(dev, VHOST_USER_SET_VRING_BUSYLOOP_TIMEOUT,
+                           ring, false);
+}
+
 static void vhost_user_host_notifier_free(VhostUserHostNotifier *n)
 {
     if (n->unmap_addr) {
@@ -3037,6 +3050,8 @@ const VhostOps user_ops = {
         .vhost_set_vring_kick = vhost_user_set_vring_kick,
         .vhost_set_vring_call = vhost_user_set_vring_call,
         .vhost_set_vring_err = vhost_user_set_vring_err,
+        .vhost_set_vring_busyloop_timeout =
+                                vhost_user_set_vring_busyloop_timeout,
         .vhost_set_features = vhost_user_set_features,
         .vhost_get_features = vhost_user_get_features,
         .vhost_set_owner = vhost_user_set_owner,
@@ -17,6 +17,7 @@
 #include "qapi/error.h"
 #include "hw/virtio/vhost.h"
 #include "qemu/atomic.h"
+#include "qemu/cutils.h"
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
@@ -83,6 +84,27 @@ unsigned int vhost_get_free_memslots(void)
     return free;
 }
 
+/*
+ * Number of log chunks checked at once with buffer_is_zero() before looking
+ * at individual chunks.  The log is mostly clean, so most of it is skipped
+ * this way.
+ */
+#define VHOST_LOG_SCAN_CHUNKS 64
+
+static void vhost_dev_set_dirty_run(MemoryRegionSection *section,
+                                    hwaddr addr, uint64_t pages)
+{
+    hwaddr section_offset;
+    hwaddr mr_offset;
+
+    if (!pages) {
+        return;
+    }
+    section_offset = addr - section->offset_within_address_space;
+    mr_offset = section_offset + section->offset_within_region;
+    memory_region_set_dirty(section->mr, mr_offset, pages * VHOST_LOG_PAGE);
+}
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
                                   uint64_t mfirst, uint64_t mlast,
@@ -95,6 +117,9 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     vhost_log_chunk_t *from = dev_log + start / VHOST_LOG_CHUNK;
     vhost_log_chunk_t *to = dev_log + end / VHOST_LOG_CHUNK + 1;
     uint64_t addr = QEMU_ALIGN_DOWN(start, VHOST_LOG_CHUNK);
+    /* Contiguous dirty pages not yet passed to memory_region_set_dirty() */
+    hwaddr run_addr = 0;
+    uint64_t run_pages = 0;
 
     if (end < start) {
         return;
@@ -102,30 +127,48 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
-        vhost_log_chunk_t log;
-        /* We first check with non-atomic: much cheaper,
-         * and we expect non-dirty to be the common case. */
-        if (!*from) {
-            addr += VHOST_LOG_CHUNK;
+    while (from < to) {
+        size_t n = MIN(to - from, VHOST_LOG_SCAN_CHUNKS);
+
+        /* Non-atomic check first, for the same reason as below */
+        if (buffer_is_zero(from, n * sizeof(*from))) {
+            from += n;
+            addr += n * VHOST_LOG_CHUNK;
             continue;
         }
-        /* Data must be read atomically. We don't really need barrier semantics
-         * but it's easier to use atomic_* than roll our own. */
-        log = qatomic_xchg(from, 0);
-        while (log) {
-            int bit = ctzl(log);
-            hwaddr page_addr;
-            hwaddr section_offset;
-            hwaddr mr_offset;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+
+        for (; n; --n, ++from, addr += VHOST_LOG_CHUNK) {
+            vhost_log_chunk_t log;
+            /* We first check with non-atomic: much cheaper,
+             * and we expect non-dirty to be the common case. */
+            if (!*from) {
+                continue;
+            }
+            /* Data must be read atomically. We don't really need barrier
+             * semantics but it's easier to use atomic_* than roll our own. */
+            log = qatomic_xchg(from, 0);
+            while (log) {
+                int bit = ctzl(log);
+                int len = ctzl(~(log >> bit));
+                hwaddr page_addr = addr + bit * VHOST_LOG_PAGE;
+
+                /* Coalesce runs of dirty pages, even across chunks */
+                if (run_addr + run_pages * VHOST_LOG_PAGE == page_addr) {
+                    run_pages += len;
+                } else {
+                    vhost_dev_set_dirty_run(section, run_addr, run_pages);
+                    run_addr = page_addr;
+                    run_pages = len;
+                }
+
+                if (bit + len >= VHOST_LOG_BITS) {
+                    break;
+                }
+                log &= ~0UL << (bit + len);
+            }
         }
-        addr += VHOST_LOG_CHUNK;
     }
+    vhost_dev_set_dirty_run(section, run_addr, run_pages);
 }
 
 bool vhost_dev_has_iommu(struct vhost_dev *dev)
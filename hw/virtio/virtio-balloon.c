@@ -14,6 +14,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/aio-wait.h"
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
@@ -338,24 +339,77 @@ static void balloon_stats_set_poll_interval(Object *obj, Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
-static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+/* The reporting queue size, which bounds the number of elements in flight. */
+#define BALLOON_REPORTING_VQ_SIZE 32
+
+typedef struct BalloonDiscardRange {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t size;
+} BalloonDiscardRange;
+
+/*
+ * Reports that were popped from the reporting queue, and the memory that
+ * they report.  The elements stay mapped until they are pushed back, which
+ * keeps the RAMBlocks of the ranges alive.
+ */
+struct BalloonReportBatch {
+    VirtQueueElement *elems[BALLOON_REPORTING_VQ_SIZE];
+    unsigned int nelems;
+    GArray *ranges;
+};
+
+/*
+ * Queue a reported range for discarding. A range that directly follows the
+ * previous one in the same RAMBlock is merged with it, so neighbouring free
+ * blocks reported in one batch cost a single syscall.
+ */
+static void balloon_discard_range_add(BalloonReportBatch *batch,
+                                      RAMBlock *rb, ram_addr_t offset,
+                                      size_t size)
 {
-    VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
-    VirtQueueElement *elem;
+    BalloonDiscardRange range = {
+        .rb = rb,
+        .offset = offset,
+        .size = size,
+    };
+
+    if (batch->ranges->len) {
+        BalloonDiscardRange *last = &g_array_index(batch->ranges,
+                                                   BalloonDiscardRange,
+                                                   batch->ranges->len - 1);
+
+        if (last->rb == rb && last->offset + last->size == offset) {
+            last->size += size;
+            return;
+        }
+    }
+    g_array_append_val(batch->ranges, range);
+}
 
-    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
-        unsigned int i;
+/*
+ * Pop all available reports into @batch and collect the memory that they
+ * report.  Returns the number of elements popped.
+ */
+static unsigned int virtio_balloon_pop_reports(VirtIOBalloon *dev,
+                                               BalloonReportBatch *batch)
+{
+    VirtQueue *vq = dev->reporting_vq;
+    unsigned int n;
 
-        /*
-         * When we discard the page it has the effect of removing the page
-         * from the hypervisor itself and causing it to be zeroed when it
-         * is returned to us. So we must not discard the page if it is
-         * accessible by another device or process, or if the guest is
-         * expecting it to retain a non-zero value.
-         */
-        if (virtio_balloon_inhibited() || dev->poison_val) {
-            goto skip_element;
+    while (batch->nelems < ARRAY_SIZE(batch->elems)) {
+        VirtQueueElement *elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
+
+        if (!elem) {
+            break;
         }
+        batch->elems[batch->nelems++] = elem;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    for (n = 0; n < batch->nelems; n++) {
+        VirtQueueElement *elem = batch->elems[n];
+        unsigned int i;
 
         for (i = 0; i < elem->in_num; i++) {
             void *addr = elem->in_sg[i].iov_base;
@@ -389,13 +443,138 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
                 continue;
             }
 
-            ram_block_discard_range(rb, ram_offset, size);
+            balloon_discard_range_add(batch, rb, ram_offset, size);
         }
+    }
 
-skip_element:
-        virtqueue_push(vq, elem, 0);
+    return batch->nelems;
+}
+
+/*
+ * Discard the memory reported by @batch and return its elements to the
+ * guest.  The caller is responsible for clearing batch->nelems, which
+ * tells virtio_balloon_get_reports() that the batch is done, and for
+ * notifying the guest.
+ *
+ * Context: BQL held, so that the memory cannot become inhibited from
+ * discarding (e.g. by ram_block_discard_disable()) before it is discarded.
+ */
+static void virtio_balloon_complete_reports(VirtIOBalloon *dev,
+                                            BalloonReportBatch *batch)
+{
+    unsigned int n;
+
+    /*
+     * When we discard the page it has the effect of removing the page
+     * from the hypervisor itself and causing it to be zeroed when it
+     * is returned to us. So we must not discard the page if it is
+     * accessible by another device or process, or if the guest is
+     * expecting it to retain a non-zero value.
+     */
+    if (!virtio_balloon_inhibited() && !dev->poison_val) {
+        for (n = 0; n < batch->ranges->len; n++) {
+            BalloonDiscardRange *range = &g_array_index(batch->ranges,
+                                                        BalloonDiscardRange,
+                                                        n);
+
+            ram_block_discard_range(range->rb, range->offset, range->size);
+        }
+    }
+    g_array_set_size(batch->ranges, 0);
+
+    for (n = 0; n < batch->nelems; n++) {
+        virtqueue_push(dev->reporting_vq, batch->elems[n], 0);
+        g_free(batch->elems[n]);
+    }
+    trace_virtio_balloon_process_reports(batch->nelems);
+}
+
+/*
+ * Runs in the iothread.  Only one batch is in flight at a time, and the
+ * reporting queue is not touched until the main loop completed it.
+ */
+static void virtio_balloon_get_reports(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+    BalloonReportBatch *batch = dev->reporting_batch;
+
+    qemu_mutex_lock(&dev->free_page_lock);
+    /* We'll get rescheduled once the VM is running again. */
+    if (!dev->block_iothread && !batch->nelems &&
+        virtio_balloon_pop_reports(dev, batch)) {
+        qemu_bh_schedule(dev->reporting_discard_bh);
+    }
+    qemu_mutex_unlock(&dev->free_page_lock);
+}
+
+/* Completes the batch of virtio_balloon_get_reports() with the BQL held */
+static void virtio_balloon_reporting_flush(VirtIOBalloon *dev)
+{
+    BalloonReportBatch *batch = dev->reporting_batch;
+
+    qemu_bh_cancel(dev->reporting_discard_bh);
+    if (!batch->nelems) {
+        return;
+    }
+
+    virtio_balloon_complete_reports(dev, batch);
+    virtio_notify(VIRTIO_DEVICE(dev), dev->reporting_vq);
+
+    qemu_mutex_lock(&dev->free_page_lock);
+    batch->nelems = 0;
+    qemu_mutex_unlock(&dev->free_page_lock);
+}
+
+static void virtio_balloon_reporting_discard_bh(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+
+    virtio_balloon_reporting_flush(dev);
+    qemu_bh_schedule(dev->reporting_bh);
+}
+
+static void virtio_balloon_reporting_quiesce_bh(void *opaque)
+{
+}
+
+/*
+ * Make sure that virtio_balloon_get_reports() is neither scheduled nor
+ * running, so that the reporting queue can be reset or deleted.  The BH
+ * is only scheduled with the BQL held, so it stays idle until the BQL is
+ * released.  Reports that it popped are dropped.
+ */
+static void virtio_balloon_reporting_quiesce(VirtIOBalloon *dev)
+{
+    BalloonReportBatch *batch = dev->reporting_batch;
+    unsigned int n;
+
+    qemu_bh_cancel(dev->reporting_bh);
+    aio_wait_bh_oneshot(iothread_get_aio_context(dev->iothread),
+                        virtio_balloon_reporting_quiesce_bh, NULL);
+
+    qemu_bh_cancel(dev->reporting_discard_bh);
+    for (n = 0; n < batch->nelems; n++) {
+        virtqueue_detach_element(dev->reporting_vq, batch->elems[n], 0);
+        g_free(batch->elems[n]);
+    }
+    batch->nelems = 0;
+    g_array_set_size(batch->ranges, 0);
+}
+
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
+    BalloonReportBatch *batch = dev->reporting_batch;
+
+    if (dev->reporting_bh) {
+        qemu_bh_schedule(dev->reporting_bh);
+        return;
+    }
+
+    while (virtio_balloon_pop_reports(dev, batch)) {
+        virtio_balloon_complete_reports(dev, batch);
+        batch->nelems = 0;
         virtio_notify(vdev, vq);
-        g_free(elem);
     }
 }
 
@@ -906,8 +1085,26 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     }
 
     if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
-        s->reporting_vq = virtio_add_queue(vdev, 32,
+        s->reporting_vq = virtio_add_queue(vdev, BALLOON_REPORTING_VQ_SIZE,
                                            virtio_balloon_handle_report);
+        s->reporting_batch = g_new0(BalloonReportBatch, 1);
+        s->reporting_batch->ranges = g_array_new(false, false,
+                                                 sizeof(BalloonDiscardRange));
+        /*
+         * Keep popping reports from competing for the BQL.  The memory is
+         * still discarded in the main loop, where it cannot become
+         * inhibited from discarding at the same time.
+         */
+        if (s->iothread) {
+            object_ref(OBJECT(s->iothread));
+            s->reporting_bh =
+                aio_bh_new_guarded(iothread_get_aio_context(s->iothread),
+                                   virtio_balloon_get_reports, s,
+                                   &dev->mem_reentrancy_guard);
+            s->reporting_discard_bh =
+                qemu_bh_new_guarded(virtio_balloon_reporting_discard_bh, s,
+                                    &dev->mem_reentrancy_guard);
+        }
     }
 
     reset_stats(s);
@@ -927,6 +1124,16 @@ static void virtio_balloon_device_unrealize(DeviceState *dev)
         virtio_balloon_free_page_stop(s);
         precopy_remove_notifier(&s->free_page_hint_notify);
     }
+    if (s->reporting_bh) {
+        virtio_balloon_reporting_quiesce(s);
+        qemu_bh_delete(s->reporting_bh);
+        qemu_bh_delete(s->reporting_discard_bh);
+        object_unref(OBJECT(s->iothread));
+    }
+    if (s->reporting_batch) {
+        g_array_free(s->reporting_batch->ranges, true);
+        g_free(s->reporting_batch);
+    }
     balloon_stats_destroy_timer(s);
     qemu_remove_balloon_handler(s);
 
@@ -950,6 +1157,10 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         virtio_balloon_free_page_stop(s);
     }
 
+    if (s->reporting_bh) {
+        virtio_balloon_reporting_quiesce(s);
+    }
+
     if (s->stats_vq_elem != NULL) {
         virtqueue_unpop(s->svq, s->stats_vq_elem, 0);
         g_free(s->stats_vq_elem);
@@ -970,7 +1181,7 @@ static int virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
         virtio_balloon_receive_stats(vdev, s->svq);
     }
 
-    if (virtio_balloon_free_page_support(s)) {
+    if (virtio_balloon_free_page_support(s) || s->reporting_bh) {
         /*
          * The VM is woken up and the iothread was blocked, so signal it to
          * continue.
@@ -980,6 +1191,9 @@ static int virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
             s->block_iothread = false;
             qemu_cond_signal(&s->free_page_cond);
             qemu_mutex_unlock(&s->free_page_lock);
+            if (s->reporting_bh) {
+                qemu_bh_schedule(s->reporting_bh);
+            }
         }
 
         /* The VM is stopped, block the iothread. */
@@ -987,6 +1201,10 @@ static int virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
             qemu_mutex_lock(&s->free_page_lock);
             s->block_iothread = true;
             qemu_mutex_unlock(&s->free_page_lock);
+            /* Don't leave reports in flight, e.g. for migration */
+            if (s->reporting_bh) {
+                virtio_balloon_reporting_flush(s);
+            }
         }
     }
     return 0;
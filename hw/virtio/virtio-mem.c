@@ -16,6 +16,8 @@
 #include "qemu/error-report.h"
 #include "qemu/units.h"
 #include "qemu/target-info-qapi.h"
+#include "qemu/aio-wait.h"
+#include "block/thread-pool.h"
 #include "system/numa.h"
 #include "system/system.h"
 #include "system/ramblock.h"
@@ -577,72 +579,92 @@ static void virtio_mem_deactivate_unplugged_memslots(VirtIOMEM *vmem,
     memory_region_transaction_commit();
 }
 
-static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
-                                      uint64_t size, bool plug)
+/*
+ * Discard the memory of blocks to unplug or preallocate the memory of blocks
+ * to plug. This is the expensive part of a state change and does not touch
+ * the device state, so it can be performed without holding the BQL.
+ */
+static int virtio_mem_prepare_block_state(VirtIOMEM *vmem, uint64_t offset,
+                                          uint64_t size, bool plug,
+                                          int prealloc_threads,
+                                          ThreadContext *prealloc_context,
+                                          Error **errp)
 {
-    const uint64_t offset = start_gpa - vmem->addr;
     RAMBlock *rb = vmem->memdev->mr.ram_block;
-    int ret = 0;
-
-    if (virtio_mem_is_busy()) {
-        return -EBUSY;
-    }
 
     if (!plug) {
         if (ram_block_discard_range(rb, offset, size)) {
             return -EBUSY;
         }
-        virtio_mem_notify_unplug(vmem, offset, size);
-        virtio_mem_set_range_unplugged(vmem, start_gpa, size);
-        /* Deactivate completely unplugged memslots after updating the state. */
-        if (vmem->dynamic_memslots) {
-            virtio_mem_deactivate_unplugged_memslots(vmem, offset, size);
-        }
         return 0;
     }
 
     if (vmem->prealloc) {
         void *area = memory_region_get_ram_ptr(&vmem->memdev->mr) + offset;
         int fd = memory_region_get_fd(&vmem->memdev->mr);
-        Error *local_err = NULL;
-
-        if (!qemu_prealloc_mem(fd, area, size, 1, NULL, false, &local_err)) {
-            static bool warned;
-
-            /*
-             * Warn only once, we don't want to fill the log with these
-             * warnings.
-             */
-            if (!warned) {
-                warn_report_err(local_err);
-                warned = true;
-            } else {
-                error_free(local_err);
-            }
-            ret = -EBUSY;
+
+        if (!qemu_prealloc_mem(fd, area, size, prealloc_threads,
+                               prealloc_context, false, errp)) {
+            return -EBUSY;
         }
     }
+    return 0;
+}
 
-    if (!ret) {
-        /*
-         * Activate before notifying and rollback in case of any errors.
-         *
-         * When activating a yet inactive memslot, memory notifiers will get
-         * notified about the added memory region and can register with the
-         * RamDiscardManager; this will traverse all plugged blocks and skip the
-         * blocks we are plugging here. The following notification will inform
-         * registered listeners about the blocks we're plugging.
-         */
+static void virtio_mem_report_prealloc_error(Error *err)
+{
+    static bool warned;
+
+    /*
+     * Warn only once, we don't want to fill the log with these
+     * warnings.
+     */
+    if (!warned) {
+        warn_report_err(err);
+        warned = true;
+    } else {
+        error_free(err);
+    }
+}
+
+/*
+ * Update the device state and notify listeners after the memory was prepared
+ * using virtio_mem_prepare_block_state().
+ */
+static int virtio_mem_commit_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
+                                         uint64_t size, bool plug)
+{
+    const uint64_t offset = start_gpa - vmem->addr;
+    int ret;
+
+    if (!plug) {
+        virtio_mem_notify_unplug(vmem, offset, size);
+        virtio_mem_set_range_unplugged(vmem, start_gpa, size);
+        /* Deactivate completely unplugged memslots after updating the state. */
         if (vmem->dynamic_memslots) {
-            virtio_mem_activate_memslots_to_plug(vmem, offset, size);
-        }
-        ret = virtio_mem_notify_plug(vmem, offset, size);
-        if (ret && vmem->dynamic_memslots) {
             virtio_mem_deactivate_unplugged_memslots(vmem, offset, size);
         }
+        return 0;
     }
+
+    /*
+     * Activate before notifying and rollback in case of any errors.
+     *
+     * When activating a yet inactive memslot, memory notifiers will get
+     * notified about the added memory region and can register with the
+     * RamDiscardManager; this will traverse all plugged blocks and skip the
+     * blocks we are plugging here. The following notification will inform
+     * registered listeners about the blocks we're plugging.
+     */
+    if (vmem->dynamic_memslots) {
+        virtio_mem_activate_memslots_to_plug(vmem, offset, size);
+    }
+    ret = virtio_mem_notify_plug(vmem, offset, size);
     if (ret) {
-        /* Could be preallocation or a notifier populated memory. */
+        if (vmem->dynamic_memslots) {
+            virtio_mem_deactivate_unplugged_memslots(vmem, offset, size);
+        }
+        /* A notifier might have populated memory. */
         ram_block_discard_range(vmem->memdev->mr.ram_block, offset, size);
         return -EBUSY;
     }
@@ -651,8 +673,165 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
     return 0;
 }
 
-static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
-                                           uint16_t nb_blocks, bool plug)
+static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
+                                      uint64_t size, bool plug)
+{
+    const uint64_t offset = start_gpa - vmem->addr;
+    Error *local_err = NULL;
+
+    if (virtio_mem_is_busy()) {
+        return -EBUSY;
+    }
+
+    if (virtio_mem_prepare_block_state(vmem, offset, size, plug, 1, NULL,
+                                       &local_err)) {
+        if (plug) {
+            virtio_mem_report_prealloc_error(local_err);
+            /* Preallocation might have populated memory. */
+            ram_block_discard_range(vmem->memdev->mr.ram_block, offset, size);
+        }
+        return -EBUSY;
+    }
+    return virtio_mem_commit_block_state(vmem, start_gpa, size, plug);
+}
+
+static void virtio_mem_update_size(VirtIOMEM *vmem, uint64_t size, bool plug)
+{
+    if (plug) {
+        vmem->size += size;
+    } else {
+        vmem->size -= size;
+    }
+    notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
+}
+
+typedef struct VirtIOMEMAsyncRequest {
+    VirtIOMEM *vmem;
+    VirtQueueElement *elem;
+    uint64_t gpa;
+    uint64_t size;
+    bool plug;
+    int prealloc_threads;
+    ThreadContext *prealloc_context;
+    Error *err;
+} VirtIOMEMAsyncRequest;
+
+static bool virtio_mem_is_range_inflight(const VirtIOMEM *vmem,
+                                         uint64_t start_gpa, uint64_t size)
+{
+    const unsigned long first_bit = (start_gpa - vmem->addr) / vmem->block_size;
+    const unsigned long last_bit = first_bit + (size / vmem->block_size) - 1;
+
+    /* We fake a shorter bitmap to avoid searching too far. */
+    return find_next_bit(vmem->inflight_bitmap, last_bit + 1,
+                         first_bit) <= last_bit;
+}
+
+static void virtio_mem_set_range_inflight(VirtIOMEM *vmem, uint64_t start_gpa,
+                                          uint64_t size, bool inflight)
+{
+    const unsigned long bit = (start_gpa - vmem->addr) / vmem->block_size;
+    const unsigned long nbits = size / vmem->block_size;
+
+    if (inflight) {
+        bitmap_set(vmem->inflight_bitmap, bit, nbits);
+    } else {
+        bitmap_clear(vmem->inflight_bitmap, bit, nbits);
+    }
+}
+
+/* Runs in a worker thread. */
+static int virtio_mem_async_request_worker(void *opaque)
+{
+    VirtIOMEMAsyncRequest *req = opaque;
+    VirtIOMEM *vmem = req->vmem;
+
+    return virtio_mem_prepare_block_state(vmem, req->gpa - vmem->addr,
+                                          req->size, req->plug,
+                                          req->prealloc_threads,
+                                          req->prealloc_context, &req->err);
+}
+
+static void virtio_mem_async_request_done(void *opaque, int ret)
+{
+    VirtIOMEMAsyncRequest *req = opaque;
+    VirtIOMEM *vmem = req->vmem;
+    uint16_t type = VIRTIO_MEM_RESP_ACK;
+
+    virtio_mem_set_range_inflight(vmem, req->gpa, req->size, false);
+    if (req->plug) {
+        vmem->inflight_plug_size -= req->size;
+    }
+    vmem->inflight_requests--;
+
+    if (ret) {
+        if (req->plug) {
+            virtio_mem_report_prealloc_error(req->err);
+            ram_block_discard_range(vmem->memdev->mr.ram_block,
+                                    req->gpa - vmem->addr, req->size);
+        }
+        type = VIRTIO_MEM_RESP_BUSY;
+    } else if (virtio_mem_commit_block_state(vmem, req->gpa, req->size,
+                                             req->plug)) {
+        type = VIRTIO_MEM_RESP_BUSY;
+    } else {
+        virtio_mem_update_size(vmem, req->size, req->plug);
+    }
+
+    trace_virtio_mem_async_request_done(req->gpa, req->size, req->plug, type);
+    virtio_mem_send_response_simple(vmem, req->elem, type);
+    g_free(req->elem);
+    g_free(req);
+}
+
+/*
+ * Hand the expensive part of a plug/unplug request to a worker thread. The
+ * response is sent once the device state was updated from the main loop.
+ */
+static void virtio_mem_submit_async_request(VirtIOMEM *vmem,
+                                            VirtQueueElement *elem,
+                                            uint64_t gpa, uint64_t size,
+                                            bool plug)
+{
+    VirtIOMEMAsyncRequest *req = g_new0(VirtIOMEMAsyncRequest, 1);
+
+    req->vmem = vmem;
+    req->elem = elem;
+    req->gpa = gpa;
+    req->size = size;
+    req->plug = plug;
+    /*
+     * The main loop is not blocked, so we can afford to preallocate like the
+     * memory backend does.
+     */
+    req->prealloc_threads = vmem->memdev->prealloc_threads;
+    req->prealloc_context = vmem->memdev->prealloc_context;
+
+    virtio_mem_set_range_inflight(vmem, gpa, size, true);
+    if (plug) {
+        vmem->inflight_plug_size += size;
+    }
+    vmem->inflight_requests++;
+
+    trace_virtio_mem_async_request_submit(gpa, size, plug);
+    thread_pool_submit_aio(virtio_mem_async_request_worker, req,
+                           virtio_mem_async_request_done, req);
+}
+
+/* Wait until all plug/unplug requests processed in worker threads finished. */
+static void virtio_mem_drain_async_requests(VirtIOMEM *vmem)
+{
+    AIO_WAIT_WHILE(NULL, vmem->inflight_requests);
+}
+
+/*
+ * Returns VIRTIO_MEM_RESP_* or -EINPROGRESS if the response will be sent
+ * once a worker thread processed the request.
+ */
+static int virtio_mem_state_change_request(VirtIOMEM *vmem,
+                                           VirtQueueElement *elem,
+                                           uint64_t gpa, uint16_t nb_blocks,
+                                           bool plug)
 {
     const uint64_t size = nb_blocks * vmem->block_size;
     int ret;
@@ -661,51 +840,72 @@ static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
         return VIRTIO_MEM_RESP_ERROR;
     }
 
-    if (plug && (vmem->size + size > vmem->requested_size)) {
+    if (plug && (vmem->size + vmem->inflight_plug_size + size >
+                 vmem->requested_size)) {
         return VIRTIO_MEM_RESP_NACK;
     }
 
+    /* Let the guest retry once conflicting requests were processed. */
+    if (vmem->inflight_requests &&
+        virtio_mem_is_range_inflight(vmem, gpa, size)) {
+        return VIRTIO_MEM_RESP_BUSY;
+    }
+
     /* test if really all blocks are in the opposite state */
     if ((plug && !virtio_mem_is_range_unplugged(vmem, gpa, size)) ||
         (!plug && !virtio_mem_is_range_plugged(vmem, gpa, size))) {
         return VIRTIO_MEM_RESP_ERROR;
     }
 
+    /* Plugging without preallocation is cheap, no need for a worker. */
+    if (vmem->async_requests && (!plug || vmem->prealloc)) {
+        if (virtio_mem_is_busy()) {
+            return VIRTIO_MEM_RESP_BUSY;
+        }
+        virtio_mem_submit_async_request(vmem, elem, gpa, size, plug);
+        return -EINPROGRESS;
+    }
+
     ret = virtio_mem_set_block_state(vmem, gpa, size, plug);
     if (ret) {
         return VIRTIO_MEM_RESP_BUSY;
     }
-    if (plug) {
-        vmem->size += size;
-    } else {
-        vmem->size -= size;
-    }
-    notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
+    virtio_mem_update_size(vmem, size, plug);
     return VIRTIO_MEM_RESP_ACK;
 }
 
-static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
+/* Returns whether the element was consumed. */
+static bool virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
                                     struct virtio_mem_req *req)
 {
     const uint64_t gpa = le64_to_cpu(req->u.plug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.plug.nb_blocks);
-    uint16_t type;
+    int type;
 
     trace_virtio_mem_plug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, true);
+    type = virtio_mem_state_change_request(vmem, elem, gpa, nb_blocks, true);
+    if (type == -EINPROGRESS) {
+        return true;
+    }
     virtio_mem_send_response_simple(vmem, elem, type);
+    return false;
 }
 
-static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
+/* Returns whether the element was consumed. */
+static bool virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
                                       struct virtio_mem_req *req)
 {
     const uint64_t gpa = le64_to_cpu(req->u.unplug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.unplug.nb_blocks);
-    uint16_t type;
+    int type;
 
     trace_virtio_mem_unplug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, false);
+    type = virtio_mem_state_change_request(vmem, elem, gpa, nb_blocks, false);
+    if (type == -EINPROGRESS) {
+        return true;
+    }
     virtio_mem_send_response_simple(vmem, elem, type);
+    return false;
 }
 
 static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
@@ -736,7 +936,7 @@ static int virtio_mem_unplug_all(VirtIOMEM *vmem)
     RAMBlock *rb = vmem->memdev->mr.ram_block;
 
     if (vmem->size) {
-        if (virtio_mem_is_busy()) {
+        if (virtio_mem_is_busy() || vmem->inflight_requests) {
             return -EBUSY;
         }
         if (ram_block_discard_range(rb, 0, qemu_ram_get_used_length(rb))) {
@@ -832,10 +1032,14 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
         type = le16_to_cpu(req.type);
         switch (type) {
         case VIRTIO_MEM_REQ_PLUG:
-            virtio_mem_plug_request(vmem, elem, &req);
+            if (virtio_mem_plug_request(vmem, elem, &req)) {
+                continue;
+            }
             break;
         case VIRTIO_MEM_REQ_UNPLUG:
-            virtio_mem_unplug_request(vmem, elem, &req);
+            if (virtio_mem_unplug_request(vmem, elem, &req)) {
+                continue;
+            }
             break;
         case VIRTIO_MEM_REQ_UNPLUG_ALL:
             virtio_mem_unplug_all_request(vmem, elem);
@@ -1097,6 +1301,9 @@ static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
     vmem->bitmap_size = memory_region_size(&vmem->memdev->mr) /
                         vmem->block_size;
     vmem->bitmap = bitmap_new(vmem->bitmap_size);
+    if (vmem->async_requests) {
+        vmem->inflight_bitmap = bitmap_new(vmem->bitmap_size);
+    }
 
     virtio_init(vdev, VIRTIO_ID_MEM, sizeof(struct virtio_mem_config));
     vmem->vq = virtio_add_queue(vdev, 128, virtio_mem_handle_request);
@@ -1155,6 +1362,7 @@ static void virtio_mem_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOMEM *vmem = VIRTIO_MEM(dev);
 
+    virtio_mem_drain_async_requests(vmem);
     qemu_unregister_resettable(OBJECT(vmem->system_reset));
     object_unref(OBJECT(vmem->system_reset));
 
@@ -1167,6 +1375,7 @@ static void virtio_mem_device_unrealize(DeviceState *dev)
     virtio_del_queue(vdev, 0);
     virtio_cleanup(vdev);
     g_free(vmem->bitmap);
+    g_free(vmem->inflight_bitmap);
     /*
      * The unplug handler unmapped the memory region, it cannot be
      * found via an address space anymore. Unset ourselves.
@@ -1175,6 +1384,12 @@ static void virtio_mem_device_unrealize(DeviceState *dev)
     ram_block_coordinated_discard_require(false);
 }
 
+static void virtio_mem_device_reset(VirtIODevice *vdev)
+{
+    /* Elements of in-flight requests must not be pushed after a reset. */
+    virtio_mem_drain_async_requests(VIRTIO_MEM(vdev));
+}
+
 static int virtio_mem_discard_range_cb(VirtIOMEM *vmem, void *arg,
                                        uint64_t offset, uint64_t size)
 {
@@ -1229,6 +1444,19 @@ static int virtio_mem_post_load_bitmap(VirtIOMEM *vmem)
     return 0;
 }
 
+static int virtio_mem_pre_save(void *opaque)
+{
+    VirtIOMEM *vmem = VIRTIO_MEM(opaque);
+
+    /*
+     * Requests still in flight would change the bitmap and discard or
+     * populate memory after we saved it. virtio_mem_is_busy() rejects new
+     * requests during migration, and snapshots are taken with the VM stopped.
+     */
+    virtio_mem_drain_async_requests(vmem);
+    return 0;
+}
+
 static int virtio_mem_post_load(void *opaque, int version_id)
 {
     VirtIOMEM *vmem = VIRTIO_MEM(opaque);
@@ -1409,6 +1637,7 @@ static const VMStateDescription vmstate_virtio_mem_device = {
     .minimum_version_id = 1,
     .version_id = 1,
     .priority = MIG_PRI_VIRTIO_MEM,
+    .pre_save = virtio_mem_pre_save,
     .post_load = virtio_mem_post_load,
     .fields = (const VMStateField[]) {
         VMSTATE_WITH_TMP_TEST(VirtIOMEM, virtio_mem_vmstate_field_exists,
@@ -1439,6 +1668,7 @@ static const VMStateDescription vmstate_virtio_mem_device_early = {
     .minimum_version_id = 1,
     .version_id = 1,
     .early_setup = true,
+    .pre_save = virtio_mem_pre_save,
     .post_load = virtio_mem_post_load_early,
     .fields = (const VMStateField[]) {
         VMSTATE_WITH_TMP(VirtIOMEM, VirtIOMEMMigSanityChecks,
@@ -1711,6 +1941,8 @@ static const Property virtio_mem_properties[] = {
                      early_migration, true),
     DEFINE_PROP_BOOL(VIRTIO_MEM_DYNAMIC_MEMSLOTS_PROP, VirtIOMEM,
                      dynamic_memslots, false),
+    DEFINE_PROP_BOOL(VIRTIO_MEM_ASYNC_REQUESTS_PROP, VirtIOMEM,
+                     async_requests, false),
 };
 
 static const Property virtio_mem_legacy_guests_properties[] = {
@@ -1877,6 +2109,7 @@ static void virtio_mem_class_init(ObjectClass *klass, const void *data)
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
     vdc->realize = virtio_mem_device_realize;
     vdc->unrealize = virtio_mem_device_unrealize;
+    vdc->reset = virtio_mem_device_reset;
     vdc->get_config = virtio_mem_get_config;
     vdc->get_features = virtio_mem_get_features;
     vdc->validate_features = virtio_mem_validate_features;
@@ -1953,6 +2186,7 @@ static void virtio_mem_system_reset_hold(Object *obj, ResetType type)
      * region size. This is, however, not possible in all scenarios. Then,
      * the guest has to deal with this manually (VIRTIO_MEM_REQ_UNPLUG_ALL).
      */
+    virtio_mem_drain_async_requests(vmem);
     virtio_mem_unplug_all(vmem);
 }
 
@@ -1107,7 +1107,8 @@ static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
     /*
      * For indirect element's 'ndescs' is 1.
      * For all other elemment's 'ndescs' is the
-     * number of descriptors chained by NEXT (as set in virtqueue_packed_pop).
+     * number of descriptors chained by NEXT (as set in
+     * virtqueue_packed_pop_rcu).
      * So When the 'elem' be filled into the descriptor ring,
      * The 'idx' of this 'elem' shall be
      * the value of 'vq->used_idx' plus the 'ndescs'.
@@ -1722,10 +1723,33 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_pop_get_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+
+    return caches;
+}
+
+/*
+ * Called within rcu_read_lock(), after virtqueue_num_heads() or
+ * virtio_queue_empty_rcu() has found at least one available head.
+ */
+static VirtQueueElement *
+virtqueue_split_pop_rcu(VirtQueue *vq, size_t sz,
+                        VRingMemoryRegionCaches *caches)
 {
     unsigned int i, head, max, idx;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1739,14 +1763,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1761,23 +1777,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1869,10 +1870,15 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+/*
+ * Called within rcu_read_lock(), after virtio_queue_packed_empty_rcu()
+ * has found the descriptor at last_avail_idx available.
+ */
+static VirtQueueElement *
+virtqueue_packed_pop_rcu(VirtQueue *vq, size_t sz,
+                         VRingMemoryRegionCaches *caches)
 {
     unsigned int i, max;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1887,11 +1893,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     address_space_cache_init_empty(&indirect_desc_cache);
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1904,17 +1905,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     i = vq->last_avail_idx;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
     id = desc.id;
@@ -2019,19 +2009,117 @@ err_undo_map:
     goto done;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
 {
-    if (virtio_device_disabled(vq->vdev)) {
-        return NULL;
+    VRingMemoryRegionCaches *caches;
+    uint16_t last_avail_idx = vq->last_avail_idx;
+    unsigned int n = 0;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return 0;
+    }
+
+    /*
+     * virtio_queue_empty_rcu() refreshed shadow_avail_idx, so this does not
+     * touch guest memory again; it also provides the smp_rmb() that must
+     * separate the avail index read from the descriptor reads.
+     */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    caches = virtqueue_pop_get_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    while (n < max) {
+        elems[n] = virtqueue_split_pop_rcu(vq, sz, caches);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+
+    /* Publish the new avail event once for the whole batch */
+    if (vq->last_avail_idx != last_avail_idx &&
+        virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return n;
+}
+
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches = NULL;
+    unsigned int n = 0;
+
+    RCU_READ_LOCK_GUARD();
+    while (n < max && !virtio_queue_packed_empty_rcu(vq)) {
+        if (!caches) {
+            caches = virtqueue_pop_get_caches(vq);
+            if (!caches) {
+                break;
+            }
+        }
+        elems[n] = virtqueue_packed_pop_rcu(vq, sz, caches);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * virtqueue_pop_batch:
+ * @vq: the virtqueue
+ * @sz: size of each element, as for virtqueue_pop()
+ * @elems: array receiving at most @max elements
+ * @max: capacity of @elems
+ *
+ * Pop up to @max available elements in one go.  Unlike calling
+ * virtqueue_pop() in a loop, the RCU read-side critical section, the
+ * region cache lookup, the avail index read and (for split rings) the
+ * avail event update are done once for the whole batch.
+ *
+ * Each returned element is independent, and must be completed and freed
+ * exactly like one returned by virtqueue_pop().
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    if (virtio_device_disabled(vq->vdev) || !max) {
+        return 0;
     }
 
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
-        return virtqueue_packed_pop(vq, sz);
+        return virtqueue_packed_pop_batch(vq, sz, elems, max);
     } else {
-        return virtqueue_split_pop(vq, sz);
+        return virtqueue_split_pop_batch(vq, sz, elems, max);
     }
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem;
+
+    if (!virtqueue_pop_batch(vq, sz, &elem, 1)) {
+        return NULL;
+    }
+    return elem;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -4125,7 +4213,7 @@ static const Property virtio_properties[] = {
                      disable_legacy_check, false),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -4195,7 +4283,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
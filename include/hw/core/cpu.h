@@ -465,6 +465,8 @@ struct qemu_work_item;
  *    ring is enabled.
  * @kvm_fetch_index: Keeps the index that we last fetched from the per-vCPU
  *    dirty ring structure.
+ * @kvm_exit_profile: Per-vCPU MMIO/PIO exit counters, allocated on the
+ *    first exit when the KVM exit profiler is enabled.
  *
  * @neg_align: The CPUState is the common part of a concrete ArchCPU
  * which is allocated when an individual CPU instance is created. As
@@ -546,6 +548,7 @@ struct CPUState {
     struct kvm_run *kvm_run;
     struct kvm_dirty_gfn *kvm_dirty_gfns;
     uint32_t kvm_fetch_index;
+    struct KVMExitProfile *kvm_exit_profile;
     uint64_t dirty_pages;
     int kvm_vcpu_stats_fd;
 
@@ -182,6 +182,8 @@ struct PCIDevice {
      * realizing the device.
      */
     uint32_t max_bounce_buffer_size;
+    /* Number of idle bounce buffers bus_master_as keeps for reuse */
+    uint32_t bounce_buffer_pool_depth;
 
     char *sriov_pf;
 };
@@ -27,6 +27,7 @@ OBJECT_DECLARE_SIMPLE_TYPE(VirtIOBalloon, VIRTIO_BALLOON)
 #define VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN 0x80000000
 
 typedef struct virtio_balloon_stat VirtIOBalloonStat;
+typedef struct BalloonReportBatch BalloonReportBatch;
 
 typedef struct virtio_balloon_stat_modern {
        uint16_t tag;
@@ -54,6 +55,13 @@ struct VirtIOBalloon {
     QEMUTimer *stats_timer;
     IOThread *iothread;
     QEMUBH *free_page_bh;
+    /*
+     * With an iothread, free page reports are popped in reporting_bh and
+     * completed in reporting_discard_bh in the main loop.
+     */
+    QEMUBH *reporting_bh;
+    QEMUBH *reporting_discard_bh;
+    BalloonReportBatch *reporting_batch;
     /*
      * Lock to synchronize threads to access the free page reporting related
      * fields (e.g. free_page_hint_status).
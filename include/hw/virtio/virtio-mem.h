@@ -39,6 +39,7 @@ OBJECT_DECLARE_SIMPLE_TYPE(VirtioMemSystemReset, VIRTIO_MEM_SYSTEM_RESET)
 #define VIRTIO_MEM_EARLY_MIGRATION_PROP "x-early-migration"
 #define VIRTIO_MEM_PREALLOC_PROP "prealloc"
 #define VIRTIO_MEM_DYNAMIC_MEMSLOTS_PROP "dynamic-memslots"
+#define VIRTIO_MEM_ASYNC_REQUESTS_PROP "x-async-requests"
 
 struct VirtIOMEM {
     VirtIODevice parent_obj;
@@ -115,6 +116,21 @@ struct VirtIOMEM {
      */
     bool dynamic_memslots;
 
+    /*
+     * Whether we discard and preallocate memory for plug/unplug requests
+     * in worker threads instead of blocking the main loop.
+     */
+    bool async_requests;
+
+    /* With "x-async-requests=on": Number of requests being processed. */
+    unsigned int inflight_requests;
+
+    /* With "x-async-requests=on": Size being plugged by these requests. */
+    uint64_t inflight_plug_size;
+
+    /* With "x-async-requests=on": Blocks affected by these requests. */
+    unsigned long *inflight_bitmap;
+
     /* notifiers to notify when "size" changes */
     NotifierList size_change_notifiers;
 
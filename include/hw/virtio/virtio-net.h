@@ -20,6 +20,8 @@
 #include "net/announce.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
+#include "system/iothread.h"
+#include "qapi/qapi-types-virtio.h"
 
 #include "ebpf/ebpf_rss.h"
 
@@ -56,6 +58,8 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    IOThread *iothread;
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -96,6 +100,9 @@ typedef struct VirtioNetRscStat {
     uint32_t purge_failed;
     uint32_t drain_failed;
     uint32_t final_failed;
+    uint32_t gro_bypass;
+    uint32_t gro_csum_bad;
+    uint32_t gro_final;
     int64_t  timer;
 } VirtioNetRscStat;
 
@@ -115,6 +122,7 @@ typedef struct VirtioNetRscSeg {
     size_t size;
     uint16_t packets;
     uint16_t dup_ack;
+    uint16_t mss;           /* payload size of the first packet, for gro */
     bool is_coalesced;      /* need recall ipv4 header checksum, mark here */
     VirtioNetRscUnit unit;
     NetClientState *nc;
@@ -163,8 +171,19 @@ typedef struct VirtIONetQueue {
     uint32_t tx_waiting;
     struct {
         VirtQueueElement *elem;
+        /* Segments of elem queued by software GSO, not yet sent */
+        unsigned int segments;
     } async_tx;
     struct VirtIONet *n;
+    /* Rx used entries filled but not flushed yet by virtio_net_receive_batch */
+    bool rx_batching;
+    unsigned int rx_pending;
+    /* Software segmentation/checksum of guest packets, with tx-gso=on */
+    struct NetTxPkt *tx_pkt;
+    /* Runs the rx/tx virtqueues and the peer of this queue pair */
+    AioContext *ctx;
+    /* Where the host notifiers are attached while ioeventfd is started */
+    AioContext *notifier_ctx;
 } VirtIONetQueue;
 
 struct VirtIONet {
@@ -186,6 +205,11 @@ struct VirtIONet {
     uint32_t rsc_timeout;
     uint8_t rsc4_enabled;
     uint8_t rsc6_enabled;
+    /* Coalesce on the host and hand GSO packets to the guest (rx-gro) */
+    bool rx_gro;
+    bool rsc_gro;
+    /* Offer TSO/CSUM to the guest without a vnet header peer (tx-gso) */
+    bool tx_gso;
     uint8_t has_ufo;
     uint32_t mergeable_rx_bufs;
     uint8_t promisc;
@@ -231,6 +255,12 @@ struct VirtIONet {
     struct EBPFRSSContext ebpf_rss;
     uint32_t nr_ebpf_rss_fds;
     char **ebpf_rss_fds;
+    /* Only used with iothread or iothread-vq-mapping */
+    bool ioeventfd_starting;
+    bool ioeventfd_started;
+    bool ioeventfd_stopping;
+    int ioeventfd_nvqs;
+    unsigned int dataplane_pause_count;
 };
 
 size_t virtio_net_handle_ctrl_iov(VirtIODevice *vdev,
@@ -281,4 +281,32 @@ int qio_channel_socket_set_send_buffer(QIOChannelSocket *ioc,
                                        size_t size,
                                        Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Try to enable MSG_ZEROCOPY on the underlying socket.  Connected
+ * client sockets do this automatically; this function allows doing
+ * the same for sockets obtained via qio_channel_socket_accept().
+ * On success the channel gains QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY.
+ *
+ * Returns: true if zero copy writes are available, false otherwise
+ */
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
+/**
+ * qio_channel_socket_reap_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Process the zero copy completion notifications that the kernel
+ * has already queued, without waiting for more.  Afterwards, the
+ * first @ioc->zero_copy_sent zero copy writes have completed and
+ * their buffers may be reused.  Unlike qio_channel_flush(), this
+ * never blocks and can be used from coroutines.
+ *
+ * Returns: 0 on success, or -1 on error.
+ */
+int qio_channel_socket_reap_zero_copy(QIOChannelSocket *ioc, Error **errp);
+
 #endif /* QIO_CHANNEL_SOCKET_H */
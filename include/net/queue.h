@@ -30,6 +30,12 @@ typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+/* One packet of a batch handed to qemu_sendv_packet_batch_async() */
+typedef struct NetPacketVec {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketVec;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
@@ -44,7 +50,18 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* Returns the number of packets, from the start of @pkts, that were
+ * delivered or dropped.  The first packet that is not consumed, and all
+ * packets after it, are queued for future redelivery.
+ */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       const NetPacketVec *pkts,
+                                       int count,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
                                NetClientState *sender,
@@ -73,6 +90,12 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              const NetPacketVec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -749,6 +749,45 @@ typedef struct ThreadContext ThreadContext;
 bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
                        ThreadContext *tc, bool async, Error **errp);
 
+typedef void QemuPreallocDoneFn(void *opaque, int ret);
+
+/**
+ * qemu_prealloc_mem_background:
+ * @fd: the fd mapped into the area, -1 for anonymous memory
+ * @area: start address of the area to preallocate
+ * @sz: the size of the area to preallocate
+ * @max_threads: maximum number of threads to use
+ * @tc: prealloc context threads pointer, NULL if not in use
+ * @done: updated atomically with the number of bytes preallocated so far
+ * @cb: called from the main loop once preallocation has finished, with 0
+ *      or a negative errno value
+ * @opaque: argument for @cb
+ * @errp: returns an error if preallocation cannot be started
+ *
+ * Like qemu_prealloc_mem(), but return as soon as the preallocation
+ * threads are running.  They are neither waited for by the caller nor by
+ * qemu_finish_async_prealloc_mem(), so the area may be in use while it is
+ * being populated; pages touched before their turn simply fault in on
+ * demand.  Requires MADV_POPULATE_WRITE.
+ *
+ * Return: true if preallocation was started, else false setting @errp.
+ */
+bool qemu_prealloc_mem_background(int fd, char *area, size_t sz,
+                                  int max_threads, ThreadContext *tc,
+                                  size_t *done, QemuPreallocDoneFn *cb,
+                                  void *opaque, Error **errp);
+
+/**
+ * qemu_cancel_background_prealloc_mem:
+ *
+ * Stop all preallocation started by qemu_prealloc_mem_background() and
+ * wait for its threads to exit.  The callbacks of preallocation that was
+ * still running are called with -ECANCELED before this returns.
+ *
+ * Must be called with the BQL held.
+ */
+void qemu_cancel_background_prealloc_mem(void);
+
 /**
  * qemu_finish_async_prealloc_mem:
  * @errp: returns an error if this function fails
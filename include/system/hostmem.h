@@ -67,6 +67,9 @@ struct HostMemoryBackendClass {
  * @size: amount of memory backend provides
  * @mr: MemoryRegion representing host memory belonging to backend
  * @prealloc_threads: number of threads to be used for preallocatining RAM
+ * @prealloc_running: background preallocation is in progress
+ * @prealloc_status: state of background preallocation
+ * @prealloc_done: bytes populated so far by background preallocation
  */
 struct HostMemoryBackend {
     /* private */
@@ -76,9 +79,12 @@ struct HostMemoryBackend {
     uint64_t size;
     bool merge, dump, use_canonical_path;
     bool prealloc, is_mapped, share, reserve;
+    bool prealloc_background, prealloc_running;
     bool guest_memfd, aligned;
     uint32_t prealloc_threads;
     ThreadContext *prealloc_context;
+    MemdevPreallocStatus prealloc_status;
+    size_t prealloc_done;
     DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
     HostMemPolicy policy;
 
@@ -92,6 +98,9 @@ void host_memory_backend_set_mapped(HostMemoryBackend *backend, bool mapped);
 bool host_memory_backend_is_mapped(HostMemoryBackend *backend);
 size_t host_memory_backend_pagesize(HostMemoryBackend *memdev);
 char *host_memory_backend_get_name(HostMemoryBackend *backend);
+bool host_memory_backend_prealloc_status(HostMemoryBackend *backend,
+                                         MemdevPreallocStatus *status,
+                                         uint64_t *done);
 
 long qemu_minrampagesize(void);
 long qemu_maxrampagesize(void);
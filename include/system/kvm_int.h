@@ -51,6 +51,8 @@ typedef struct KVMMemoryListener {
     int as_id;
     QSIMPLEQ_HEAD(, KVMMemoryUpdate) transaction_add;
     QSIMPLEQ_HEAD(, KVMMemoryUpdate) transaction_del;
+    /* Sections whose dirty logging changed, applied after add/del */
+    QSIMPLEQ_HEAD(, KVMMemoryUpdate) transaction_flags;
 } KVMMemoryListener;
 
 #define KVM_MSI_HASHTAB_SIZE    256
@@ -91,6 +93,20 @@ enum KVMDirtyRingReaperState {
     KVM_DIRTY_RING_REAPER_REAPING,
 };
 
+/*
+ * Helper thread of the reaper, collecting the rings of a subset of the
+ * vCPUs whenever all rings are reaped.
+ */
+struct KVMDirtyRingReapWorker {
+    QemuThread thread;
+    /* Posted to start reaping */
+    QemuSemaphore sem;
+    /* Share of the vCPUs, see kvm_dirty_ring_reap_share() */
+    unsigned int share;
+    /* Pages collected by the last round */
+    uint64_t total;
+};
+
 /*
  * KVM reaper instance, responsible for collecting the KVM dirty bits
  * via the dirty ring.
@@ -100,6 +116,11 @@ struct KVMDirtyRingReaper {
     QemuThread reaper_thr;
     volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
     volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
+    /* Helper threads, one less than the number of reaping threads */
+    unsigned int nr_workers;
+    struct KVMDirtyRingReapWorker *workers;
+    /* Posted by each worker when done with its share */
+    QemuSemaphore workers_done;
 };
 struct KVMState
 {
@@ -156,12 +177,14 @@ struct KVMState
     } *as;
     uint64_t kvm_dirty_ring_bytes;  /* Size of the per-vcpu dirty ring */
     uint32_t kvm_dirty_ring_size;   /* Number of dirty GFNs per ring */
+    uint32_t kvm_dirty_ring_reapers; /* Threads reaping the rings */
     bool kvm_dirty_ring_with_bitmap;
     uint64_t kvm_eager_split_size;  /* Eager Page Splitting chunk size */
     struct KVMDirtyRingReaper reaper;
     struct KVMMsrEnergy msr_energy;
     NotifyVmexitOption notify_vmexit;
     uint32_t notify_window;
+    bool exit_profile;              /* Count userspace MMIO/PIO exits */
     uint32_t xen_version;
     uint32_t xen_caps;
     uint16_t xen_gnttab_max_frames;
@@ -1158,6 +1158,7 @@ typedef struct AddressSpaceMapClient {
 } AddressSpaceMapClient;
 
 #define DEFAULT_MAX_BOUNCE_BUFFER_SIZE (4096)
+#define DEFAULT_BOUNCE_BUFFER_POOL_DEPTH 16
 
 /**
  * struct AddressSpace: describes a mapping of addresses to #MemoryRegion objects
@@ -1188,6 +1189,17 @@ struct AddressSpace {
     size_t max_bounce_buffer_size;
     /* Total size of bounce buffers currently allocated, atomically accessed */
     size_t bounce_buffer_size;
+    /*
+     * Maximum number of idle bounce buffers kept around for reuse, so that
+     * concurrent DMA to indirect memory does not allocate and free a buffer
+     * for every request.  Idle buffers do not count against
+     * max_bounce_buffer_size.
+     */
+    uint32_t bounce_buffer_pool_depth;
+    /* Idle bounce buffers, protected by bounce_buffer_pool_lock */
+    QemuMutex bounce_buffer_pool_lock;
+    QSLIST_HEAD(, BounceBuffer) bounce_buffer_pool;
+    uint32_t bounce_buffer_pool_len;
     /* List of callbacks to invoke when buffers free up */
     QemuMutex map_client_list_lock;
     QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
@@ -98,6 +98,22 @@ int qio_channel_socket_set_send_buffer(QIOChannelSocket *ioc,
     return 0;
 }
 
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
+        /* Zero copy available on host */
+        qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
 static int
 qio_channel_socket_set_fd(QIOChannelSocket *sioc,
                           int fd,
@@ -183,15 +199,7 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    qio_channel_socket_enable_zero_copy(ioc);
 
     qio_channel_set_feature(QIO_CHANNEL(ioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
@@ -910,6 +918,15 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
 
 #endif /* QEMU_MSG_ZEROCOPY */
 
+int qio_channel_socket_reap_zero_copy(QIOChannelSocket *ioc, Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    return qio_channel_socket_flush_internal(QIO_CHANNEL(ioc), false, errp);
+#else
+    return 0;
+#endif
+}
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
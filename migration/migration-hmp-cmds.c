@@ -244,6 +244,11 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                            info->ram->dirty_sync_missed_zero_copy);
         }
         monitor_printf(mon, "\n");
+
+        monitor_printf(mon, "  Dirty Sync (us): \tlog=%" PRIu64
+                       ", bitmap=%" PRIu64 "\n",
+                       info->ram->dirty_sync_log_time,
+                       info->ram->dirty_sync_bitmap_time);
     }
 
     if (!show_all) {
@@ -453,6 +458,11 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
 
         assert(params->has_cpr_exec_command);
         monitor_print_cpr_exec_command(mon, params->cpr_exec_command);
+
+        assert(params->has_dirty_sync_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
     }
 
     qapi_free_MigrationParameters(params);
@@ -755,6 +765,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_cpr_exec_command = true;
         break;
     }
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
     default:
         g_assert_not_reached();
     }
@@ -55,6 +55,16 @@ typedef struct {
      * copy.
      */
     Stat64 dirty_sync_missed_zero_copy;
+    /*
+     * Time spent collecting the dirty log during the last bitmap
+     * synchronization, in microseconds.
+     */
+    Stat64 dirty_sync_log_time;
+    /*
+     * Time spent merging the dirty log into the migration bitmap
+     * during the last bitmap synchronization, in microseconds.
+     */
+    Stat64 dirty_sync_bitmap_time;
     /*
      * Number of bytes sent at migration completion stage while the
      * guest is stopped.
@@ -28,10 +28,12 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "block/thread-pool.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -434,6 +436,12 @@ struct RAMState {
      * Protected by @bitmap_mutex.
      */
     PageLocationHint page_hint;
+    /*
+     * Workers merging the dirty log into the migration bitmap when
+     * dirty-sync-threads > 1.  Created on first use, only touched by
+     * the migration thread.
+     */
+    ThreadPool *sync_pool;
 };
 typedef struct RAMState RAMState;
 
@@ -936,67 +944,119 @@ bool ramblock_page_is_discarded(RAMBlock *rb, ram_addr_t start)
     return false;
 }
 
-/* Called with RCU critical section */
-static uint64_t physical_memory_sync_dirty_bitmap(RAMBlock *rb,
-                                                  ram_addr_t start,
-                                                  ram_addr_t length)
+/*
+ * Size of the chunks that large RAMBlocks are split into when their
+ * dirty bitmaps are synchronized by several threads.
+ */
+#define RAM_SYNC_CHUNK_SIZE (1 * GiB)
+
+typedef struct RAMSyncChunk {
+    RAMBlock *rb;
+    ram_addr_t start;
+    ram_addr_t length;
+    uint64_t num_dirty;
+} RAMSyncChunk;
+
+/* Can @start/@length of @rb be merged a whole word at a time? */
+static bool physical_memory_sync_is_aligned(RAMBlock *rb, ram_addr_t start,
+                                            ram_addr_t length)
 {
     unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
-    uint64_t num_dirty = 0;
-    unsigned long *dest = rb->bmap;
 
-    /* start address and length is aligned at the start of a word? */
-    if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
-         (start + rb->offset) &&
-        !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long * const *src;
-        unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
-        unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
-                                        DIRTY_MEMORY_BLOCK_SIZE);
-        unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-        src = qatomic_rcu_read(
-                &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
-
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
+    return ((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
+           (start + rb->offset) &&
+           !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1));
+}
 
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                offset = 0;
-                idx++;
-            }
-        }
-        if (num_dirty) {
-            physical_memory_dirty_bits_cleared(start, length);
+/*
+ * Move the dirty bits of a word aligned range from the global migration
+ * dirty log into rb->bmap.  Only touches the words of the range, so
+ * disjoint ranges may be merged concurrently.
+ *
+ * Called with RCU critical section
+ */
+static uint64_t physical_memory_merge_dirty_bitmap(RAMBlock *rb,
+                                                   ram_addr_t start,
+                                                   ram_addr_t length)
+{
+    unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
+    uint64_t num_dirty = 0;
+    unsigned long *dest = rb->bmap;
+    int k;
+    int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+    unsigned long * const *src;
+    unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
+    unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
+                                    DIRTY_MEMORY_BLOCK_SIZE);
+    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+
+    src = qatomic_rcu_read(
+            &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
+
+    for (k = page; k < page + nr; k++) {
+        if (src[idx][offset]) {
+            unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
+            unsigned long new_dirty;
+            new_dirty = ~dest[k];
+            dest[k] |= bits;
+            new_dirty &= bits;
+            num_dirty += ctpopl(new_dirty);
         }
 
-        if (rb->clear_bmap) {
-            /*
-             * Postpone the dirty bitmap clear to the point before we
-             * really send the pages, also we will split the clear
-             * dirty procedure into smaller chunks.
-             */
-            clear_bmap_set(rb, start >> TARGET_PAGE_BITS,
-                           length >> TARGET_PAGE_BITS);
-        } else {
-            /* Slow path - still do that in a huge chunk */
-            memory_region_clear_dirty_bitmap(rb->mr, start, length);
+        if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            offset = 0;
+            idx++;
         }
+    }
+
+    return num_dirty;
+}
+
+/*
+ * Finish the synchronization of a range merged with
+ * physical_memory_merge_dirty_bitmap() by clearing the dirty log below.
+ *
+ * Called with RCU critical section and bitmap_mutex
+ */
+static void physical_memory_sync_clear_dirty(RAMBlock *rb, ram_addr_t start,
+                                             ram_addr_t length,
+                                             uint64_t num_dirty)
+{
+    if (num_dirty) {
+        physical_memory_dirty_bits_cleared(start, length);
+    }
+
+    if (rb->clear_bmap) {
+        /*
+         * Postpone the dirty bitmap clear to the point before we
+         * really send the pages, also we will split the clear
+         * dirty procedure into smaller chunks.
+         */
+        clear_bmap_set(rb, start >> TARGET_PAGE_BITS,
+                       length >> TARGET_PAGE_BITS);
+    } else {
+        /* Slow path - still do that in a huge chunk */
+        memory_region_clear_dirty_bitmap(rb->mr, start, length);
+    }
+}
+
+/* Called with RCU critical section */
+static uint64_t physical_memory_sync_dirty_bitmap(RAMBlock *rb,
+                                                  ram_addr_t start,
+                                                  ram_addr_t length)
+{
+    uint64_t num_dirty;
+
+    /* start address and length is aligned at the start of a word? */
+    if (physical_memory_sync_is_aligned(rb, start, length)) {
+        num_dirty = physical_memory_merge_dirty_bitmap(rb, start, length);
+        physical_memory_sync_clear_dirty(rb, start, length, num_dirty);
     } else {
         num_dirty = physical_memory_test_and_clear_dirty(
                         start + rb->offset,
                         length,
                         DIRTY_MEMORY_MIGRATION,
-                        dest);
+                        rb->bmap);
     }
 
     return num_dirty;
@@ -1012,6 +1072,104 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+static int ramblock_sync_chunk(void *opaque)
+{
+    RAMSyncChunk *chunk = opaque;
+
+    /*
+     * Pool threads are not RCU readers themselves; the RAMBlocks and the
+     * dirty log are kept alive by the migration thread, which stays in
+     * its RCU critical section until all chunks have been merged.
+     */
+    chunk->num_dirty = physical_memory_merge_dirty_bitmap(chunk->rb,
+                                                          chunk->start,
+                                                          chunk->length);
+    return 0;
+}
+
+/*
+ * Synchronize the dirty bitmaps of all RAMBlocks, merging word aligned
+ * blocks in chunks of RAM_SYNC_CHUNK_SIZE on up to dirty-sync-threads
+ * threads.  Only the merge runs concurrently; clearing the dirty log
+ * and the page accounting are done by the caller once the chunks of a
+ * block are finished, exactly as in the single threaded case.
+ *
+ * Called with RCU critical section and bitmap_mutex
+ */
+static void ramblock_sync_dirty_bitmaps(RAMState *rs)
+{
+    unsigned int threads = migrate_dirty_sync_threads();
+    g_autofree RAMSyncChunk *chunks = NULL;
+    size_t nr_chunks = 0, i = 0;
+    RAMBlock *block;
+
+    if (threads > 1) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            if (physical_memory_sync_is_aligned(block, 0,
+                                                block->used_length)) {
+                nr_chunks += DIV_ROUND_UP(block->used_length,
+                                          RAM_SYNC_CHUNK_SIZE);
+            }
+        }
+    }
+
+    if (nr_chunks <= 1) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return;
+    }
+
+    if (!rs->sync_pool) {
+        rs->sync_pool = thread_pool_new();
+    }
+    thread_pool_set_max_threads(rs->sync_pool, threads);
+
+    chunks = g_new(RAMSyncChunk, nr_chunks);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        if (!physical_memory_sync_is_aligned(block, 0, block->used_length)) {
+            continue;
+        }
+        for (start = 0; start < block->used_length;
+             start += RAM_SYNC_CHUNK_SIZE) {
+            RAMSyncChunk *chunk = &chunks[i++];
+
+            chunk->rb = block;
+            chunk->start = start;
+            chunk->length = MIN(RAM_SYNC_CHUNK_SIZE,
+                                block->used_length - start);
+            thread_pool_submit(rs->sync_pool, ramblock_sync_chunk, chunk,
+                               NULL);
+        }
+    }
+    assert(i == nr_chunks);
+
+    /* Unaligned blocks take the slow path here while the pool works */
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!physical_memory_sync_is_aligned(block, 0, block->used_length)) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+    }
+
+    thread_pool_wait(rs->sync_pool);
+
+    for (i = 0; i < nr_chunks;) {
+        RAMBlock *rb = chunks[i].rb;
+        uint64_t new_dirty_pages = 0;
+
+        for (; i < nr_chunks && chunks[i].rb == rb; i++) {
+            new_dirty_pages += chunks[i].num_dirty;
+        }
+        physical_memory_sync_clear_dirty(rb, 0, rb->used_length,
+                                         new_dirty_pages);
+
+        rs->migration_dirty_pages += new_dirty_pages;
+        rs->num_dirty_pages_period += new_dirty_pages;
+    }
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1133,8 +1291,7 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 {
-    RAMBlock *block;
-    int64_t end_time;
+    int64_t start_us, end_time;
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
 
@@ -1143,13 +1300,17 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
     }
 
     trace_migration_bitmap_sync_start();
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync(last_stage);
+    stat64_set(&mig_stats.dirty_sync_log_time,
+               qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us);
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
-            }
+            start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            ramblock_sync_dirty_bitmaps(rs);
+            stat64_set(&mig_stats.dirty_sync_bitmap_time,
+                       qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us);
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
     }
@@ -2422,6 +2583,9 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        if ((*rsp)->sync_pool) {
+            thread_pool_free((*rsp)->sync_pool);
+        }
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -1955,6 +1955,13 @@ static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
         return -1;
     }
 
+    /*
+     * Postcopy discards guest memory and relies on missing pages faulting
+     * into userfaultfd.  Background preallocation would populate them
+     * behind its back, and the memory is overwritten anyway.
+     */
+    qemu_cancel_background_prealloc_mem();
+
     remote_pagesize_summary = qemu_get_be64(mis->from_src_file);
     local_pagesize_summary = ram_pagesize_summary();
 
@@ -24,10 +24,14 @@
 #include "block/dirty-bitmap.h"
 #include "qapi/error.h"
 #include "qemu/queue.h"
+#include "system/iothread.h"
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#ifdef CONFIG_LINUX
+#include <sys/resource.h>
+#endif
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
@@ -42,6 +46,25 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * MSG_ZEROCOPY has a fixed setup and completion cost, so it only pays off
+ * for large read payloads.  Buffers that were sent this way are kept until
+ * the kernel reports that their send has completed.  Completions are never
+ * waited for, only collected when sending or releasing a payload; if a
+ * client would have more than NBD_ZERO_COPY_MAX_PENDING bytes outstanding,
+ * the payload is sent with a copy instead.
+ *
+ * The pages of a zero copy send also count against RLIMIT_MEMLOCK until it
+ * completes, and sendmsg() fails with ENOBUFS beyond the limit.  The limit
+ * applies to all locked memory of the user, so zero copy sends of all
+ * clients together lock at most half of it.
+ */
+#define NBD_ZERO_COPY_MIN_SIZE (32 * KiB)
+#define NBD_ZERO_COPY_MAX_PENDING (32 * MiB)
+
+static size_t nbd_zero_copy_max_locked = SIZE_MAX;
+static size_t nbd_zero_copy_locked;
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -101,6 +124,13 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    bool zero_copy; /* Send read payloads with MSG_ZEROCOPY if possible */
+
+    /* IOThreads that client connections are distributed across */
+    IOThread **iothreads;
+    size_t nr_iothreads;
+    size_t next_iothread; /* round-robin index, main loop thread only */
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -121,6 +151,13 @@ struct NBDMetaContexts {
                     */
 };
 
+typedef struct NBDZeroCopyBuf {
+    void *data; /* read buffer to free, or NULL */
+    uint64_t len; /* bytes locked by zero copy sends */
+    ssize_t seq; /* number of zero copy writes to wait for before freeing */
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuf) next;
+} NBDZeroCopyBuf;
+
 struct NBDClient {
     int refcount; /* atomic */
     void (*close_fn)(NBDClient *client, bool negotiated);
@@ -129,6 +166,7 @@ struct NBDClient {
     QemuMutex lock;
 
     NBDExport *exp;
+    AioContext *ctx; /* If non-NULL, overrides the export AioContext */
     QCryptoTLSCreds *tlscreds;
     char *tlsauthz;
     uint32_t handshake_max_secs;
@@ -140,6 +178,17 @@ struct NBDClient {
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    /*
+     * If zero_copy is true, read payloads may be sent with MSG_ZEROCOPY.
+     * zero_copy_bufs holds read buffers that the kernel may still reference
+     * and the memory that it locked for sending them, oldest first, and
+     * zero_copy_pending the total size of that memory; both are protected
+     * by send_lock.
+     */
+    bool zero_copy;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuf) zero_copy_bufs;
+    uint64_t zero_copy_pending;
+
     bool read_yielding; /* protected by lock */
     bool quiescing; /* protected by lock */
 
@@ -158,6 +207,7 @@ struct NBDClient {
 };
 
 static void nbd_client_receive_next_request(NBDClient *client);
+static void nbd_export_attach_client(NBDExport *exp, NBDClient *client);
 
 /* Basic flow for negotiation
 
@@ -536,8 +586,7 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
         return ret;
     }
 
-    QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-    blk_exp_ref(&client->exp->common);
+    nbd_export_attach_client(client->exp, client);
 
     return 0;
 }
@@ -752,8 +801,7 @@ nbd_negotiate_handle_info(NBDClient *client, Error **errp)
     if (client->opt == NBD_OPT_GO) {
         client->exp = exp;
         client->check_align = check_align;
-        QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-        blk_exp_ref(&client->exp->common);
+        nbd_export_attach_client(exp, client);
         rc = 1;
     }
     return rc;
@@ -1556,6 +1604,31 @@ static int coroutine_fn nbd_receive_request(NBDClient *client, NBDRequest *reque
 
 #define MAX_NBD_REQUESTS 16
 
+/*
+ * Returns the AioContext in which requests of @client are processed.  This
+ * is the export AioContext unless the export distributes its clients across
+ * multiple IOThreads.
+ */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    return client->ctx ?: nbd_export_aio_context(client->exp);
+}
+
+/* Free the buffers that wait for at most @seq zero copy writes */
+static void nbd_zero_copy_free_bufs(NBDClient *client, ssize_t seq)
+{
+    NBDZeroCopyBuf *buf;
+
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_bufs)) &&
+           buf->seq <= seq) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_bufs, next);
+        client->zero_copy_pending -= buf->len;
+        qatomic_sub(&nbd_zero_copy_locked, buf->len);
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
 /* Runs in export AioContext and main loop thread */
 void nbd_client_get(NBDClient *client)
 {
@@ -1582,6 +1655,8 @@ void nbd_client_put(NBDClient *client)
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             blk_exp_unref(&client->exp->common);
         }
+        /* The socket is closed, so the kernel is done with these buffers */
+        nbd_zero_copy_free_bufs(client, SSIZE_MAX);
         g_free(client->contexts.bitmaps);
         qemu_mutex_destroy(&client->lock);
         g_free(client);
@@ -1755,7 +1830,7 @@ static bool nbd_drained_poll(void *opaque)
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -1794,6 +1869,32 @@ static const BlockDevOps nbd_block_ops = {
     .drained_poll = nbd_drained_poll,
 };
 
+/* Derive the memory that zero copy sends may lock from RLIMIT_MEMLOCK */
+static bool nbd_zero_copy_set_limit(Error **errp)
+{
+#ifdef CONFIG_LINUX
+    struct rlimit rlim;
+
+    if (getrlimit(RLIMIT_MEMLOCK, &rlim) < 0) {
+        error_setg_errno(errp, errno, "Failed to get RLIMIT_MEMLOCK");
+        return false;
+    }
+    if (rlim.rlim_cur == RLIM_INFINITY) {
+        qatomic_set(&nbd_zero_copy_max_locked, SIZE_MAX);
+        return true;
+    }
+    if (rlim.rlim_cur / 2 < NBD_ZERO_COPY_MIN_SIZE) {
+        error_setg(errp, "zero-copy requires a locked memory limit "
+                   "(RLIMIT_MEMLOCK) of at least %d KiB",
+                   (int)(2 * NBD_ZERO_COPY_MIN_SIZE / KiB));
+        return false;
+    }
+    qatomic_set(&nbd_zero_copy_max_locked,
+                MIN(rlim.rlim_cur / 2, SIZE_MAX));
+#endif
+    return true;
+}
+
 static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
                              Error **errp)
 {
@@ -1826,6 +1927,10 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
         return -EINVAL;
     }
 
+    if (arg->zero_copy && !nbd_zero_copy_set_limit(errp)) {
+        return -EINVAL;
+    }
+
     if (nbd_export_find(name)) {
         error_setg(errp, "NBD server already has export named '%s'", name);
         return -EEXIST;
@@ -1933,6 +2038,24 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
+
+    for (strList *iothreads = arg->iothreads; iothreads;
+         iothreads = iothreads->next) {
+        IOThread *iothread = iothread_by_id(iothreads->value);
+
+        if (!iothread) {
+            ret = -EINVAL;
+            error_setg(errp, "iothread \"%s\" not found", iothreads->value);
+            goto fail_iothreads;
+        }
+
+        /* Released in nbd_export_delete() */
+        object_ref(OBJECT(iothread));
+        exp->iothreads = g_renew(IOThread *, exp->iothreads,
+                                 exp->nr_iothreads + 1);
+        exp->iothreads[exp->nr_iothreads++] = iothread;
+    }
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1951,6 +2074,14 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
 
     return 0;
 
+fail_iothreads:
+    for (i = 0; i < exp->nr_iothreads; i++) {
+        object_unref(OBJECT(exp->iothreads[i]));
+    }
+    g_free(exp->iothreads);
+    for (i = 0; i < exp->nr_export_bitmaps; i++) {
+        bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
+    }
 fail:
     bdrv_graph_rdunlock_main_loop();
     g_free(exp->export_bitmaps);
@@ -1977,6 +2108,32 @@ nbd_export_aio_context(NBDExport *exp)
     return exp->common.ctx;
 }
 
+/*
+ * Add @client to the list of clients of @exp after successful negotiation.
+ * If the export has IOThreads configured, the client is bound to the next
+ * one in round-robin order for the rest of its lifetime.
+ */
+static void nbd_export_attach_client(NBDExport *exp, NBDClient *client)
+{
+    assert(qemu_in_main_thread());
+
+    QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+    blk_exp_ref(&exp->common);
+
+    if (exp->nr_iothreads) {
+        IOThread *iothread = exp->iothreads[exp->next_iothread];
+
+        exp->next_iothread = (exp->next_iothread + 1) % exp->nr_iothreads;
+        client->ctx = iothread_get_aio_context(iothread);
+        trace_nbd_export_attach_client(exp->name, client->ctx);
+    }
+
+    /* Zero copy is not possible if TLS has to encrypt the payload first */
+    if (exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy = qio_channel_socket_enable_zero_copy(client->sioc);
+    }
+}
+
 static void nbd_export_request_shutdown(BlockExport *blk_exp)
 {
     NBDExport *exp = container_of(blk_exp, NBDExport, common);
@@ -2023,6 +2180,11 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    for (i = 0; i < exp->nr_iothreads; i++) {
+        object_unref(OBJECT(exp->iothreads[i]));
+    }
+    g_free(exp->iothreads);
 }
 
 const BlockExportDriver blk_exp_nbd = {
@@ -2051,6 +2213,135 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Collect the zero copy completions that the kernel has already reported
+ * and free the buffers that are not referenced any more.  This never waits,
+ * so that the send_lock holder does not block the AioContext.
+ *
+ * Called with send_lock held.
+ */
+static int nbd_zero_copy_reap(NBDClient *client, Error **errp)
+{
+    if (qio_channel_socket_reap_zero_copy(client->sioc, errp) < 0) {
+        return -EIO;
+    }
+    nbd_zero_copy_free_bufs(client, client->sioc->zero_copy_sent);
+    return 0;
+}
+
+/*
+ * Reserve the memory that a zero copy send of @payload locks, which is
+ * whole pages.  Returns the number of bytes reserved, or 0 if the limit for
+ * the client or for the process would be exceeded.
+ *
+ * Called with send_lock held.
+ */
+static size_t nbd_zero_copy_lock(NBDClient *client, struct iovec *payload)
+{
+    uintptr_t start = (uintptr_t)payload->iov_base;
+    size_t page_size = qemu_real_host_page_size();
+    size_t len = ROUND_UP(start + payload->iov_len, page_size) -
+                 ROUND_DOWN(start, page_size);
+
+    if (client->zero_copy_pending + len > NBD_ZERO_COPY_MAX_PENDING) {
+        return 0;
+    }
+    if (qatomic_fetch_add(&nbd_zero_copy_locked, len) + len >
+        qatomic_read(&nbd_zero_copy_max_locked)) {
+        qatomic_sub(&nbd_zero_copy_locked, len);
+        return 0;
+    }
+
+    client->zero_copy_pending += len;
+    return len;
+}
+
+/*
+ * Keep @data (may be NULL) and the @locked bytes reserved with
+ * nbd_zero_copy_lock() until all zero copy sends queued so far completed.
+ *
+ * Called with send_lock held.
+ */
+static void nbd_zero_copy_queue_buf(NBDClient *client, void *data,
+                                    size_t locked)
+{
+    NBDZeroCopyBuf *buf = g_new(NBDZeroCopyBuf, 1);
+
+    buf->data = data;
+    buf->len = locked;
+    buf->seq = client->sioc->zero_copy_queued;
+    QSIMPLEQ_INSERT_TAIL(&client->zero_copy_bufs, buf, next);
+}
+
+/*
+ * Like nbd_co_send_iov(), but the last element of @iov is a read payload
+ * that is sent with MSG_ZEROCOPY if the client supports it.  The caller must
+ * then hand the buffer over to nbd_co_zero_copy_release() instead of freeing
+ * it.
+ */
+static int coroutine_fn nbd_co_send_iov_payload(NBDClient *client,
+                                                struct iovec *iov,
+                                                unsigned niov, Error **errp)
+{
+    struct iovec *payload = &iov[niov - 1];
+    int flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+    size_t locked = 0;
+    int ret;
+
+    if (!client->zero_copy || payload->iov_len < NBD_ZERO_COPY_MIN_SIZE) {
+        return nbd_co_send_iov(client, iov, niov, errp);
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    ret = nbd_zero_copy_reap(client, errp);
+    if (ret == 0) {
+        locked = nbd_zero_copy_lock(client, payload);
+        if (!locked) {
+            trace_nbd_co_zero_copy_throttle(client->zero_copy_pending);
+            flags = 0;
+        }
+    }
+
+    /* Reply headers live on the stack, so they are always copied */
+    if (ret == 0) {
+        ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+    }
+    if (ret == 0) {
+        ret = qio_channel_writev_full_all(client->ioc, payload, 1, NULL, 0,
+                                          flags, errp);
+    }
+    if (locked) {
+        nbd_zero_copy_queue_buf(client, NULL, locked);
+    }
+    ret = ret < 0 ? -EIO : 0;
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
+/*
+ * Take ownership of the read buffer @data after its reply has been sent.
+ * The buffer is freed once the kernel has reported completion of all zero
+ * copy sends up to this point.
+ */
+static int coroutine_fn nbd_co_zero_copy_release(NBDClient *client,
+                                                 void *data, Error **errp)
+{
+    int ret;
+
+    qemu_co_mutex_lock(&client->send_lock);
+    nbd_zero_copy_queue_buf(client, data, 0);
+    ret = nbd_zero_copy_reap(client, errp);
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2082,7 +2373,7 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_payload(client, iov, 2, errp);
 }
 
 /*
@@ -2163,7 +2454,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_iov_payload(client, iov, 3, errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -3154,6 +3445,12 @@ static coroutine_fn void nbd_trip(void *opaque)
         g_free(request.contexts->bitmaps);
         g_free(request.contexts);
     }
+    if (ret == 0 && client->zero_copy && request.type == NBD_CMD_READ &&
+        req->data && request.len >= NBD_ZERO_COPY_MIN_SIZE) {
+        /* The payload may have been sent with MSG_ZEROCOPY */
+        ret = nbd_co_zero_copy_release(client, req->data, &local_err);
+        req->data = NULL;
+    }
 
     qio_channel_set_cork(client->ioc, false);
     qemu_mutex_lock(&client->lock);
@@ -3209,7 +3506,7 @@ static void nbd_client_receive_next_request(NBDClient *client)
         nbd_client_get(client);
         req = nbd_request_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, req);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client), client->recv_coroutine);
     }
 }
 
@@ -3278,6 +3575,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
 
     client = g_new0(NBDClient, 1);
     qemu_mutex_init(&client->lock);
+    QSIMPLEQ_INIT(&client->zero_copy_bufs);
     client->refcount = 1;
     client->tlscreds = tlscreds;
     if (tlscreds) {
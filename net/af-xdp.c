@@ -55,6 +55,9 @@ typedef struct AFXDPState {
     char                 *map_path;
     int                  map_fd;
     uint32_t             map_start_index;
+
+    /* NULL while the queue is handled by the main loop. */
+    AioContext           *ctx;
 } AFXDPState;
 
 #define AF_XDP_BATCH_SIZE 64
@@ -62,9 +65,30 @@ typedef struct AFXDPState {
 static void af_xdp_send(void *opaque);
 static void af_xdp_writable(void *opaque);
 
+/*
+ * Busy-poll callback for IOThreads: the Rx ring lives in shared memory,
+ * so new frames can be noticed without a syscall.
+ */
+static bool af_xdp_rx_poll(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    return xsk_cons_nb_avail(&s->rx, 1) > 0;
+}
+
 /* Set the event-loop handlers for the af-xdp backend. */
 static void af_xdp_update_fd_handler(AFXDPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, xsk_socket__fd(s->xsk),
+                           s->read_poll ? af_xdp_send : NULL,
+                           s->write_poll ? af_xdp_writable : NULL,
+                           s->read_poll ? af_xdp_rx_poll : NULL,
+                           s->read_poll ? af_xdp_send : NULL,
+                           s);
+        return;
+    }
+
     qemu_set_fd_handler(xsk_socket__fd(s->xsk),
                         s->read_poll ? af_xdp_send : NULL,
                         s->write_poll ? af_xdp_writable : NULL,
@@ -142,10 +166,15 @@ static void af_xdp_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t af_xdp_receive(NetClientState *nc,
-                              const uint8_t *buf, size_t size)
+/*
+ * Copy the packet straight from the sender's iovec (guest memory for
+ * virtio-net) into the UMEM frame, without linearizing it first.
+ */
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
 {
     AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     struct xdp_desc *desc;
     uint32_t idx;
     void *data;
@@ -172,7 +201,7 @@ static ssize_t af_xdp_receive(NetClientState *nc,
     desc->len = size;
 
     data = xsk_umem__get_data(s->buffer, desc->addr);
-    memcpy(data, buf, size);
+    iov_to_buf(iov, iovcnt, 0, data, size);
 
     xsk_ring_prod__submit(&s->tx, 1);
     s->outstanding_tx++;
@@ -184,6 +213,17 @@ static ssize_t af_xdp_receive(NetClientState *nc,
     return size;
 }
 
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
 /*
  * Complete a previous send (backend --> guest) and enable the
  * fd_read callback.
@@ -221,6 +261,8 @@ static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
 
 static void af_xdp_send(void *opaque)
 {
+    struct iovec iov[AF_XDP_BATCH_SIZE];
+    NetPacketVec pkts[AF_XDP_BATCH_SIZE];
     uint32_t i, n_rx, idx = 0;
     AFXDPState *s = opaque;
 
@@ -231,31 +273,28 @@ static void af_xdp_send(void *opaque)
 
     for (i = 0; i < n_rx; i++) {
         const struct xdp_desc *desc;
-        struct iovec iov;
 
         desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
 
-        iov.iov_base = xsk_umem__get_data(s->buffer, desc->addr);
-        iov.iov_len = desc->len;
+        iov[i].iov_base = xsk_umem__get_data(s->buffer, desc->addr);
+        iov[i].iov_len = desc->len;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
 
         s->pool[s->n_pool++] = desc->addr;
+    }
 
-        if (!qemu_sendv_packet_async(&s->nc, &iov, 1,
-                                     af_xdp_send_completed)) {
-            /*
-             * The peer does not receive anymore.  Packet is queued, stop
-             * reading from the backend until af_xdp_send_completed().
-             */
-            af_xdp_read_poll(s, false);
-
-            /* Return unused descriptors to not break the ring cache. */
-            xsk_ring_cons__cancel(&s->rx, n_rx - i - 1);
-            n_rx = i + 1;
-            break;
-        }
+    if (qemu_sendv_packet_batch_async(&s->nc, pkts, n_rx,
+                                      af_xdp_send_completed) < n_rx) {
+        /*
+         * The peer does not receive anymore.  The remaining packets are
+         * queued, stop reading from the backend until
+         * af_xdp_send_completed().
+         */
+        af_xdp_read_poll(s, false);
     }
 
-    /* Release actually sent descriptors and try to re-fill. */
+    /* All frames were copied out of the UMEM, release them and re-fill. */
     xsk_ring_cons__release(&s->rx, n_rx);
     af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
 }
@@ -432,13 +471,37 @@ static int af_xdp_update_xsk_map(AFXDPState *s, Error **errp)
     return 0;
 }
 
+/*
+ * Move the queue to another AioContext, e.g. the IOThread that runs the
+ * matching virtio-net queue pair.
+ */
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->ctx == ctx || !s->xsk) {
+        return;
+    }
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, xsk_socket__fd(s->xsk),
+                           NULL, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(xsk_socket__fd(s->xsk), NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    af_xdp_update_fd_handler(s);
+}
+
 /* NetClientInfo methods. */
 static NetClientInfo net_af_xdp_info = {
     .type = NET_CLIENT_DRIVER_AF_XDP,
     .size = sizeof(AFXDPState),
     .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
     .poll = af_xdp_poll,
     .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
 };
 
 static int *parse_socket_fds(const char *sock_fds_str,
@@ -559,6 +622,8 @@ int net_init_af_xdp(const Netdev *netdev,
             af_xdp_update_xsk_map(s, &err)) {
             goto err;
         }
+
+        af_xdp_read_poll(s, true); /* Initially only poll for reads. */
     }
 
     if (nc0 && !inhibit) {
@@ -571,8 +636,6 @@ int net_init_af_xdp(const Netdev *netdev,
         }
     }
 
-    af_xdp_read_poll(s, true); /* Initially only poll for reads. */
-
     return 0;
 
 err:
@@ -7,6 +7,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/aio-wait.h"
 #include "qemu/cutils.h"
 #include "net/announce.h"
 #include "net/net.h"
@@ -133,11 +134,40 @@ static const char *qemu_ether_ntoa(const MACAddr *mac)
     return ret;
 }
 
+typedef struct AnnounceSendData {
+    NetClientState *nc;
+    uint8_t buf[60];
+    int len;
+} AnnounceSendData;
+
+static void qemu_announce_send_bh(void *opaque)
+{
+    AnnounceSendData *data = opaque;
+
+    qemu_send_packet_raw(data->nc, data->buf, data->len);
+}
+
+/*
+ * The peer may be serviced by an IOThread (e.g. virtio-net with iothread=),
+ * in which case the packet must be sent from there.
+ */
+static void qemu_announce_send(NetClientState *nc, uint8_t *macaddr)
+{
+    AnnounceSendData data = { .nc = nc };
+
+    data.len = announce_self_create(data.buf, macaddr);
+
+    if (nc->peer && nc->peer->aio_context) {
+        aio_wait_bh_oneshot(nc->peer->aio_context, qemu_announce_send_bh,
+                            &data);
+    } else {
+        qemu_announce_send_bh(&data);
+    }
+}
+
 static void qemu_announce_self_iter(NICState *nic, void *opaque)
 {
     AnnounceTimer *timer = opaque;
-    uint8_t buf[60];
-    int len;
     bool skip;
 
     if (timer->params.has_interfaces) {
@@ -162,9 +192,7 @@ static void qemu_announce_self_iter(NICState *nic, void *opaque)
                                   qemu_ether_ntoa(&nic->conf->macaddr), skip);
 
     if (!skip) {
-        len = announce_self_create(buf, nic->conf->macaddr.a);
-
-        qemu_send_packet_raw(qemu_get_queue(nic), buf, len);
+        qemu_announce_send(qemu_get_queue(nic), nic->conf->macaddr.a);
 
         /* if the NIC provides it's own announcement support, use it as well */
         if (nic->ncs->info->announce) {
@@ -16,27 +16,82 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "net/checksum.h"
 #include "net/eth.h"
+#include "host/cpuinfo.h"
+
+/*
+ * The Internet checksum does not depend on byte order (RFC 1071), so the
+ * bulk of the buffer is summed as native-endian 32-bit words into 64-bit
+ * accumulators, possibly with SIMD, and only the folded result is swapped.
+ */
+typedef uint64_t (*csum_accel_fn)(const uint8_t *, size_t);
+
+/* Sum @len bytes as native-endian 32-bit words; @len is a multiple of 8. */
+static uint64_t net_checksum_words_int(const uint8_t *buf, size_t len)
+{
+    uint64_t s0 = 0, s1 = 0;
+
+    for (; len; len -= 8, buf += 8) {
+        uint64_t x = ldq_he_p(buf);
+
+        s0 += (uint32_t)x;
+        s1 += x >> 32;
+    }
+    return s0 + s1;
+}
+
+#include "host/net-checksum.c.inc"
+
+static unsigned accel_index;
+static csum_accel_fn net_checksum_words;
+
+bool test_net_checksum_next_accel(void)
+{
+    if (accel_index != 0) {
+        net_checksum_words = accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    net_checksum_words = accel_table[accel_index];
+}
 
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    uint64_t sum;
+    size_t bulk;
+
+    if (len <= 0) {
+        return 0;
+    }
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+    bulk = len & ~7;
+    sum = bulk ? net_checksum_words(buf, bulk) : 0;
+    for (; bulk + 1 < len; bulk += 2) {
+        sum += lduw_he_p(buf + bulk);
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+    if (bulk < len) {
+        /* A trailing odd byte is the high half of a zero-padded word */
+        uint8_t last[2] = { buf[bulk], 0 };
+        sum += lduw_he_p(last);
+    }
+
+    /* End-around carry keeps non-zero data from folding to zero */
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
     }
 
-    if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+    /* Return the sum of big-endian words, byte-swapped if @seq is odd */
+    if (HOST_BIG_ENDIAN == !(seq & 1)) {
+        return sum;
     }
+    return bswap16(sum);
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
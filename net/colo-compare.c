@@ -52,6 +52,7 @@ static NotifierList colo_compare_notifiers =
 
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
+#define MAX_COMPARE_THREADS 64
 
 /* #define DEBUG_COLO_PACKETS */
 
@@ -101,6 +102,38 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/*
+ * Connections are spread over compare_threads shards by the hash of
+ * their key, so that each connection is only ever compared by one
+ * shard.  Shard 0 runs in the compare iothread, which also reads the
+ * input chardevs and owns the output ones; every other shard has an
+ * internal iothread of its own and hands primary packets it releases
+ * back to the compare iothread for sending.
+ */
+typedef struct CompareShard {
+    struct CompareState *s;
+    /* NULL for shard 0, which runs in the compare iothread */
+    IOThread *iothread;
+    AioContext *ctx;
+
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+    QEMUTimer *packet_check_timer;
+    QEMUBH *event_bh;
+
+    /* Packets parsed by the compare iothread, element type: Packet */
+    QemuMutex in_lock;
+    GQueue pri_in;
+    GQueue sec_in;
+    QEMUBH *in_bh;
+    QEMUBH *flush_bh;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -120,20 +153,19 @@ struct CompareState {
     bool vnet_hdr;
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
+    uint32_t compare_threads;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    CompareShard *shards;
+
+    /* Primary packets released by shards other than 0, type: Packet */
+    QemuMutex out_lock;
+    GQueue out_list;
+    bool out_notify;
+    QEMUBH *out_bh;
 
     IOThread *iothread;
     GMainContext *worker_context;
-    QEMUTimer *packet_check_timer;
 
-    QEMUBH *event_bh;
     enum colo_event event;
 
     QTAILQ_ENTRY(CompareState) next;
@@ -182,13 +214,20 @@ static void notify_remote_frame(CompareState *s)
     }
 }
 
-static void colo_compare_inconsistency_notify(CompareState *s)
+static void colo_compare_inconsistency_notify(CompareShard *sh)
 {
-    if (s->notify_dev) {
-        notify_remote_frame(s);
-    } else {
+    CompareState *s = sh->s;
+
+    if (!s->notify_dev) {
         notifier_list_notify(&colo_compare_notifiers,
                              NULL);
+    } else if (!sh->iothread) {
+        notify_remote_frame(s);
+    } else {
+        qemu_mutex_lock(&s->out_lock);
+        s->out_notify = true;
+        qemu_mutex_unlock(&s->out_lock);
+        qemu_bh_schedule(s->out_bh);
     }
 }
 
@@ -237,40 +276,22 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
-/*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
- */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+/* Queue a parsed packet on its connection in shard @sh */
+static void packet_enqueue(CompareShard *sh, Packet *pkt, int mode,
+                           Connection **con)
 {
     ConnectionKey key;
-    Packet *pkt = NULL;
     Connection *conn;
     int ret;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
-
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
-    }
     fill_connection_key(pkt, &key, false);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(sh->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &sh->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&sh->conn_list, conn);
         conn->processing = true;
     }
 
@@ -288,8 +309,6 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     }
 
     *con = conn;
-
-    return 0;
 }
 
 static inline bool after(uint32_t seq1, uint32_t seq2)
@@ -297,9 +316,20 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+/* Send a primary packet to outdev, from whichever shard it was queued on */
+static void colo_output_primary_pkt(CompareShard *sh, Packet *pkt)
 {
+    CompareState *s = sh->s;
     int ret;
+
+    if (sh->iothread) {
+        qemu_mutex_lock(&s->out_lock);
+        g_queue_push_tail(&s->out_list, pkt);
+        qemu_mutex_unlock(&s->out_lock);
+        qemu_bh_schedule(s->out_bh);
+        return;
+    }
+
     ret = compare_chr_send(s,
                            pkt->data,
                            pkt->size,
@@ -309,10 +339,15 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+static void colo_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    trace_colo_compare_main("packet same and release packet");
+    colo_output_primary_pkt(sh, pkt);
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -396,7 +431,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *sh, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -427,13 +462,13 @@ sec:
     spkt = g_queue_pop_tail(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
@@ -473,7 +508,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             g_queue_push_tail(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -482,7 +517,7 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -495,7 +530,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_inconsistency_notify(sh);
     }
 }
 
@@ -620,8 +655,10 @@ void colo_compare_unregister_notifier(Notifier *notify)
 }
 
 static int colo_old_packet_check_one_conn(Connection *conn,
-                                          CompareState *s)
+                                          CompareShard *sh)
 {
+    CompareState *s = sh->s;
+
     if (!g_queue_is_empty(&conn->primary_list)) {
         if (g_queue_find_custom(&conn->primary_list,
                                 &s->compare_timeout,
@@ -640,7 +677,7 @@ static int colo_old_packet_check_one_conn(Connection *conn,
 
 out:
     /* Do checkpoint will flush old packet */
-    colo_compare_inconsistency_notify(s);
+    colo_compare_inconsistency_notify(sh);
     return 0;
 }
 
@@ -651,17 +688,17 @@ out:
  */
 static void colo_old_packet_check(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
+    g_queue_find_custom(&sh->conn_list, sh,
                         (GCompareFunc)colo_old_packet_check_one_conn);
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *sh, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -675,7 +712,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
                  pkt, (GCompareFunc)HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(sh, pkt);
             packet_destroy(result->data, NULL);
             g_queue_delete_link(&conn->secondary_list, result);
         } else {
@@ -688,7 +725,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_tail(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_inconsistency_notify(sh);
             break;
         }
     }
@@ -702,25 +739,132 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(sh, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(sh, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(sh, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(sh, conn, colo_packet_compare_other);
         break;
     }
 }
 
+static void colo_flush_packets(void *opaque, void *user_data);
+
+/* Compare the packets the compare iothread queued for shard @sh */
+static void colo_compare_shard_input(CompareShard *sh)
+{
+    GQueue pri_in, sec_in;
+    Connection *conn;
+    Packet *pkt;
+
+    qemu_mutex_lock(&sh->in_lock);
+    pri_in = sh->pri_in;
+    sec_in = sh->sec_in;
+    g_queue_init(&sh->pri_in);
+    g_queue_init(&sh->sec_in);
+    qemu_mutex_unlock(&sh->in_lock);
+
+    while ((pkt = g_queue_pop_head(&pri_in))) {
+        packet_enqueue(sh, pkt, PRIMARY_IN, &conn);
+        colo_compare_connection(conn, sh);
+    }
+    while ((pkt = g_queue_pop_head(&sec_in))) {
+        packet_enqueue(sh, pkt, SECONDARY_IN, &conn);
+        colo_compare_connection(conn, sh);
+    }
+}
+
+static void colo_compare_shard_bh(void *opaque)
+{
+    colo_compare_shard_input(opaque);
+}
+
+/* Checkpoint: release primary packets and drop secondary ones */
+static void colo_compare_shard_flush(CompareShard *sh)
+{
+    colo_compare_shard_input(sh);
+    g_queue_foreach(&sh->conn_list, colo_flush_packets, sh);
+}
+
+static void colo_compare_shard_flush_bh(void *opaque)
+{
+    colo_compare_shard_flush(opaque);
+}
+
+/* Runs in the compare iothread to send what the other shards released */
+static void colo_compare_out_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    GQueue out_list;
+    bool notify;
+    Packet *pkt;
+
+    qemu_mutex_lock(&s->out_lock);
+    out_list = s->out_list;
+    g_queue_init(&s->out_list);
+    notify = s->out_notify;
+    s->out_notify = false;
+    qemu_mutex_unlock(&s->out_lock);
+
+    while ((pkt = g_queue_pop_head(&out_list))) {
+        colo_output_primary_pkt(&s->shards[0], pkt);
+    }
+    if (notify) {
+        notify_remote_frame(s);
+    }
+}
+
+/*
+ * Called from the compare thread on the primary for each packet read
+ * from primary_in or secondary_in.
+ */
+static void compare_rs_finalize(CompareState *s, SocketReadState *rs,
+                                int mode)
+{
+    ConnectionKey key;
+    CompareShard *sh;
+    Connection *conn;
+    Packet *pkt;
+
+    pkt = packet_new(rs->buf, rs->packet_len, rs->vnet_hdr_len);
+    if (parse_packet_early(pkt)) {
+        packet_destroy(pkt, NULL);
+        trace_colo_compare_main(mode == PRIMARY_IN ?
+                                "primary: unsupported packet in" :
+                                "secondary: unsupported packet in");
+        /* unsupported(arp and ipv6) primary packets are sent as they are */
+        if (mode == PRIMARY_IN) {
+            compare_chr_send(s, rs->buf, rs->packet_len, rs->vnet_hdr_len,
+                             false, false);
+        }
+        return;
+    }
+
+    fill_connection_key(pkt, &key, false);
+    sh = &s->shards[connection_key_hash(&key) % s->compare_threads];
+    if (!sh->iothread) {
+        /* compare packet in the specified connection */
+        packet_enqueue(sh, pkt, mode, &conn);
+        colo_compare_connection(conn, sh);
+        return;
+    }
+
+    qemu_mutex_lock(&sh->in_lock);
+    g_queue_push_tail(mode == PRIMARY_IN ? &sh->pri_in : &sh->sec_in, pkt);
+    qemu_mutex_unlock(&sh->in_lock);
+    qemu_bh_schedule(sh->in_bh);
+}
+
 static void coroutine_fn _compare_chr_send(void *opaque)
 {
     SendCo *sendco = opaque;
@@ -890,18 +1034,20 @@ static void compare_notify_chr(void *opaque, const uint8_t *buf, int size)
  */
 static void check_old_packet_regular(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+    colo_old_packet_check(sh);
+    timer_mod(sh->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+              sh->s->expired_scan_cycle);
 }
 
 /* Public API, Used for COLO frame to notify compare event */
 void colo_notify_compares_event(void *opaque, int event, Error **errp)
 {
     CompareState *s;
+    uint32_t i;
+
     qemu_mutex_lock(&colo_compare_mutex);
 
     if (!colo_compare_active) {
@@ -912,8 +1058,10 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
     qemu_mutex_lock(&event_mtx);
     QTAILQ_FOREACH(s, &net_compares, next) {
         s->event = event;
-        qemu_bh_schedule(s->event_bh);
-        event_unhandled_count++;
+        for (i = 0; i < s->compare_threads; i++) {
+            qemu_bh_schedule(s->shards[i].event_bh);
+            event_unhandled_count++;
+        }
     }
     /* Wait all compare threads to finish handling this event */
     while (event_unhandled_count > 0) {
@@ -924,34 +1072,30 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
     qemu_mutex_unlock(&colo_compare_mutex);
 }
 
-static void colo_compare_timer_init(CompareState *s)
+static void colo_compare_timer_init(CompareShard *sh)
 {
-    AioContext *ctx = iothread_get_aio_context(s->iothread);
-
-    s->packet_check_timer = aio_timer_new(ctx, QEMU_CLOCK_HOST,
+    sh->packet_check_timer = aio_timer_new(sh->ctx, QEMU_CLOCK_HOST,
                                 SCALE_MS, check_old_packet_regular,
-                                s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+                                sh);
+    timer_mod(sh->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+              sh->s->expired_scan_cycle);
 }
 
-static void colo_compare_timer_del(CompareState *s)
+static void colo_compare_timer_del(CompareShard *sh)
 {
-    if (s->packet_check_timer) {
-        timer_free(s->packet_check_timer);
-        s->packet_check_timer = NULL;
+    if (sh->packet_check_timer) {
+        timer_free(sh->packet_check_timer);
+        sh->packet_check_timer = NULL;
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
-
 static void colo_compare_handle_event(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
 
-    switch (s->event) {
+    switch (sh->s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_shard_flush(sh);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -966,12 +1110,80 @@ static void colo_compare_handle_event(void *opaque)
     qemu_mutex_unlock(&event_mtx);
 }
 
+static void colo_compare_shard_init(CompareState *s, CompareShard *sh,
+                                    AioContext *ctx)
+{
+    sh->s = s;
+    sh->ctx = ctx;
+    g_queue_init(&sh->conn_list);
+    sh->connection_track_table = g_hash_table_new_full(connection_key_hash,
+                                                       connection_key_equal,
+                                                       g_free,
+                                                       NULL);
+    qemu_mutex_init(&sh->in_lock);
+    g_queue_init(&sh->pri_in);
+    g_queue_init(&sh->sec_in);
+    sh->in_bh = aio_bh_new(ctx, colo_compare_shard_bh, sh);
+    sh->flush_bh = aio_bh_new(ctx, colo_compare_shard_flush_bh, sh);
+    sh->event_bh = aio_bh_new(ctx, colo_compare_handle_event, sh);
+    colo_compare_timer_init(sh);
+}
+
+/* Runs in the shard's own iothread before that is stopped */
+static void colo_compare_shard_stop_bh(void *opaque)
+{
+    CompareShard *sh = opaque;
+
+    colo_compare_timer_del(sh);
+    qemu_bh_delete(sh->in_bh);
+    qemu_bh_delete(sh->flush_bh);
+    qemu_bh_delete(sh->event_bh);
+}
+
+static bool colo_compare_shards_init(CompareState *s, Error **errp)
+{
+    const char *id = object_get_canonical_path_component(OBJECT(s));
+    uint32_t i;
+
+    s->shards = g_new0(CompareShard, s->compare_threads);
+    for (i = 1; i < s->compare_threads; i++) {
+        g_autofree char *name = g_strdup_printf("colo-compare-%s-%u", id, i);
+
+        s->shards[i].iothread = iothread_create(name, errp);
+        if (!s->shards[i].iothread) {
+            goto fail;
+        }
+    }
+    return true;
+
+fail:
+    while (i-- > 1) {
+        iothread_destroy(s->shards[i].iothread);
+    }
+    g_free(s->shards);
+    s->shards = NULL;
+    return false;
+}
+
 static void colo_compare_iothread(CompareState *s)
 {
     AioContext *ctx = iothread_get_aio_context(s->iothread);
+    uint32_t i;
+
     object_ref(OBJECT(s->iothread));
     s->worker_context = iothread_get_g_main_context(s->iothread);
 
+    qemu_mutex_init(&s->out_lock);
+    g_queue_init(&s->out_list);
+    s->out_bh = aio_bh_new(ctx, colo_compare_out_bh, s);
+
+    colo_compare_shard_init(s, &s->shards[0], ctx);
+    for (i = 1; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        colo_compare_shard_init(s, sh, iothread_get_aio_context(sh->iothread));
+    }
+
     qemu_chr_fe_set_handlers(&s->chr_pri_in, compare_chr_can_read,
                              compare_pri_chr_in, NULL, NULL,
                              s, s->worker_context, true);
@@ -983,9 +1195,6 @@ static void colo_compare_iothread(CompareState *s)
                                  compare_notify_chr, NULL, NULL,
                                  s, s->worker_context, true);
     }
-
-    colo_compare_timer_init(s);
-    s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1120,6 +1329,34 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v,
+                                const char *name, void *opaque,
+                                Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value || value > MAX_COMPARE_THREADS) {
+        error_setg(errp, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, MAX_COMPARE_THREADS);
+        return;
+    }
+    s->compare_threads = value;
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1149,33 +1386,15 @@ static void set_max_queue_size(Object *obj, Visitor *v,
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
-
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
-        trace_colo_compare_main("primary: unsupported packet in");
-        compare_chr_send(s,
-                         pri_rs->buf,
-                         pri_rs->packet_len,
-                         pri_rs->vnet_hdr_len,
-                         false,
-                         false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
-    }
+
+    compare_rs_finalize(s, pri_rs, PRIMARY_IN);
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
-        trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
-    }
+    compare_rs_finalize(s, sec_rs, SECONDARY_IN);
 }
 
 static void compare_notify_rs_finalize(SocketReadState *notify_rs)
@@ -1183,6 +1402,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
     CompareState *s = container_of(notify_rs, CompareState, notify_rs);
 
     const char msg[] = "COLO_COMPARE_GET_XEN_INIT";
+    uint32_t i;
     int ret;
 
     if (packet_matches_str("COLO_USERSPACE_PROXY_INIT",
@@ -1196,7 +1416,10 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_shard_flush(&s->shards[0]);
+        for (i = 1; i < s->compare_threads; i++) {
+            qemu_bh_schedule(s->shards[i].flush_bh);
+        }
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1268,6 +1491,10 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         max_queue_size = MAX_QUEUE_SIZE;
     }
 
+    if (!s->compare_threads) {
+        s->compare_threads = 1;
+    }
+
     if (find_and_check_chardev(&chr, s->pri_indev, errp) ||
         !qemu_chr_fe_init(&s->chr_pri_in, chr, errp)) {
         return;
@@ -1311,12 +1538,9 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
-
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      NULL);
+    if (!colo_compare_shards_init(s, errp)) {
+        return;
+    }
 
     colo_compare_iothread(s);
 
@@ -1332,19 +1556,13 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
 static void colo_flush_packets(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
     while (!g_queue_is_empty(&conn->primary_list)) {
         pkt = g_queue_pop_tail(&conn->primary_list);
-        compare_chr_send(s,
-                         pkt->data,
-                         pkt->size,
-                         pkt->vnet_hdr_len,
-                         false,
-                         true);
-        packet_destroy_partial(pkt, NULL);
+        colo_output_primary_pkt(sh, pkt);
     }
     while (!g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_tail(&conn->secondary_list);
@@ -1389,6 +1607,10 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads,
+                        compare_set_threads, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1408,6 +1630,8 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    Packet *pkt;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1430,9 +1654,19 @@ static void colo_compare_finalize(Object *obj)
         qemu_chr_fe_deinit(&s->chr_notify_dev, false);
     }
 
-    colo_compare_timer_del(s);
+    if (!s->shards) {
+        goto out;
+    }
 
-    qemu_bh_delete(s->event_bh);
+    for (i = 1; i < s->compare_threads; i++) {
+        aio_wait_bh_oneshot(s->shards[i].ctx, colo_compare_shard_stop_bh,
+                            &s->shards[i]);
+        iothread_destroy(s->shards[i].iothread);
+        /* From now on this shard sends from the main thread like shard 0 */
+        s->shards[i].iothread = NULL;
+    }
+    colo_compare_shard_stop_bh(&s->shards[0]);
+    qemu_bh_delete(s->out_bh);
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     AIO_WAIT_WHILE(ctx, !s->out_sendco.done);
@@ -1441,21 +1675,38 @@ static void colo_compare_finalize(Object *obj)
     }
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    while ((pkt = g_queue_pop_head(&s->out_list))) {
+        colo_output_primary_pkt(&s->shards[0], pkt);
+    }
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        while ((pkt = g_queue_pop_head(&sh->pri_in))) {
+            colo_output_primary_pkt(sh, pkt);
+        }
+        g_queue_foreach(&sh->sec_in, packet_destroy, NULL);
+        g_queue_clear(&sh->sec_in);
+        g_queue_foreach(&sh->conn_list, colo_flush_packets, sh);
+    }
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
+    for (i = 0; i < s->compare_threads; i++) {
+        g_queue_clear(&s->shards[i].conn_list);
+        g_hash_table_destroy(s->shards[i].connection_track_table);
+        qemu_mutex_destroy(&s->shards[i].in_lock);
+    }
+    g_free(s->shards);
+    qemu_mutex_destroy(&s->out_lock);
+
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
-    }
-
     object_unref(OBJECT(s->iothread));
 
+out:
+
     g_free(s->pri_indev);
     g_free(s->sec_indev);
     g_free(s->outdev);
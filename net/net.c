@@ -260,6 +260,10 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                        const struct iovec *iov,
                                        int iovcnt,
                                        void *opaque);
+static int qemu_deliver_packet_batch(NetClientState *sender,
+                                     const NetPacketVec *pkts,
+                                     int count,
+                                     void *opaque);
 
 static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientInfo *info,
@@ -285,6 +289,10 @@ static void qemu_net_client_setup(NetClientState *nc,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
+    if (info->receive_batch) {
+        qemu_net_queue_set_deliver_batch(nc->incoming_queue,
+                                         qemu_deliver_packet_batch);
+    }
     nc->destructor = destructor;
     nc->is_datapath = is_datapath;
     QTAILQ_INIT(&nc->filters);
@@ -618,6 +626,34 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+/*
+ * Returns true if @nc can have its I/O handlers moved out of the main loop
+ * with qemu_set_net_aio_context().  Filters assume they run under the BQL,
+ * so a filtered net client keeps its whole path in the main loop.
+ */
+bool qemu_can_set_net_aio_context(NetClientState *nc)
+{
+    if (!nc || !nc->info->set_aio_context) {
+        return false;
+    }
+
+    return QTAILQ_EMPTY(&nc->filters);
+}
+
+/*
+ * Move the I/O handlers of @nc to @ctx, or back to the main loop if @ctx is
+ * NULL.  Must be called from the AioContext that currently runs @nc, or
+ * with the BQL held while @nc is in the main loop, so that no handler is
+ * running concurrently.
+ */
+void qemu_set_net_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(qemu_can_set_net_aio_context(nc));
+
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+}
+
 int qemu_can_receive_packet(NetClientState *nc)
 {
     if (nc->receive_disabled) {
@@ -917,6 +953,97 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+static int qemu_deliver_packet_batch(NetClientState *sender,
+                                     const NetPacketVec *pkts,
+                                     int count,
+                                     void *opaque)
+{
+    MemReentrancyGuard *owned_reentrancy_guard;
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->info->type != NET_CLIENT_DRIVER_NIC ||
+        qemu_get_nic(nc)->reentrancy_guard->engaged_in_io) {
+        owned_reentrancy_guard = NULL;
+    } else {
+        owned_reentrancy_guard = qemu_get_nic(nc)->reentrancy_guard;
+        owned_reentrancy_guard->engaged_in_io = true;
+    }
+
+    ret = nc->info->receive_batch(nc, pkts, count);
+
+    if (owned_reentrancy_guard) {
+        owned_reentrancy_guard->engaged_in_io = false;
+    }
+
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
+static bool qemu_net_batch_has_oversized(const NetPacketVec *pkts, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > NET_BUFSIZE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Send @count packets to the peer of @sender.  If the peer implements
+ * receive_batch and no filter is attached on either side, the whole batch
+ * is handed over in one call, which lets the receiver amortize per-packet
+ * costs such as guest notifications.  Otherwise the packets go through
+ * qemu_sendv_packet_async() one by one.  That is also the case if a packet
+ * is larger than NET_BUFSIZE, so that it is dropped in the same way.
+ *
+ * Packets the peer cannot take are queued, so @pkts can be reused as soon
+ * as this returns.  Returns the number of packets that were not queued; if
+ * it is less than @count, the caller must stop sending until @sent_cb has
+ * been called.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender,
+                                  const NetPacketVec *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int done = 0;
+    int i;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    if (!peer->info->receive_batch ||
+        !QTAILQ_EMPTY(&sender->filters) || !QTAILQ_EMPTY(&peer->filters) ||
+        qemu_net_batch_has_oversized(pkts, count)) {
+        for (i = 0; i < count; i++) {
+            if (qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                        sent_cb)) {
+                done++;
+            }
+        }
+        return done;
+    }
+
+    return qemu_net_queue_send_batch(peer->incoming_queue, sender,
+                                     pkts, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
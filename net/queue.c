@@ -54,6 +54,7 @@ struct NetQueue {
     uint32_t nq_maxlen;
     uint32_t nq_count;
     NetQueueDeliverFunc *deliver;
+    NetQueueDeliverBatchFunc *deliver_batch;
 
     QTAILQ_HEAD(, NetPacket) packets;
 
@@ -78,6 +79,12 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     return queue;
 }
 
+void qemu_net_queue_set_deliver_batch(NetQueue *queue,
+                                      NetQueueDeliverBatchFunc *deliver_batch)
+{
+    queue->deliver_batch = deliver_batch;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
@@ -243,6 +250,41 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Deliver @count packets with a single call to the batch delivery handler.
+ * Whatever the handler does not consume is queued, so on return all of
+ * @pkts can be reused by the caller.  Returns the number of packets that
+ * were not queued; if it is less than @count the caller must not send any
+ * more packets until @sent_cb has been invoked.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              const NetPacketVec *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int done = 0;
+    int i;
+
+    assert(queue->deliver_batch);
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        queue->delivering = 1;
+        done = queue->deliver_batch(sender, pkts, count, queue->opaque);
+        queue->delivering = 0;
+    }
+
+    for (i = done; i < count; i++) {
+        qemu_net_queue_append_iov(queue, sender, QEMU_NET_PACKET_FLAG_NONE,
+                                  pkts[i].iov, pkts[i].iovcnt, sent_cb);
+    }
+
+    if (done == count) {
+        qemu_net_queue_flush(queue);
+    }
+
+    return done;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -38,11 +38,15 @@
 #include "monitor/monitor.h"
 #include "system/system.h"
 #include "qapi/error.h"
+#include "qemu/aio-wait.h"
 #include "qemu/cutils.h"
+#include "qemu/defer-call.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "hw/virtio/vhost.h"
+#include "trace.h"
 
 #include "net/tap.h"
 
@@ -67,12 +71,45 @@ static const int kernel_feature_bits[] = {
     VHOST_INVALID_FEATURE_BIT
 };
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Reads kept in flight on the tap fd */
+#define TAP_URING_RX_DEPTH 16
+/* Writes in flight before the peer has to queue packets */
+#define TAP_URING_TX_DEPTH 64
+
+typedef struct TapUringReq {
+    CqeHandler cqe_handler;
+    CqeHandler cancel_handler;
+    struct TAPState *s;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t len;
+    bool inflight;
+} TapUringReq;
+
+typedef struct TapUring {
+    TapUringReq rx[TAP_URING_RX_DEPTH];
+    TapUringReq tx[TAP_URING_TX_DEPTH];
+    /* Indices of completed reads waiting for tap_uring_rx_flush() */
+    uint8_t rx_ready[TAP_URING_RX_DEPTH];
+    int rx_nready;
+    uint8_t tx_free[TAP_URING_TX_DEPTH];
+    int tx_nfree;
+    unsigned int inflight;  /* reads, writes and cancels */
+    bool stopped;           /* don't submit reads while draining */
+    bool tx_full;           /* the peer was told to queue packets */
+    bool rx_fallback;       /* waiting for the fd to become readable */
+    QEMUBH *start_bh;
+} TapUring;
+#endif
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    /* Room for a batch of small packets, or at least one full-sized one */
+    uint8_t buf[2 * NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -83,6 +120,10 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx; /* NULL when handled by the main loop */
+#ifdef CONFIG_LINUX_IO_URING
+    TapUring *uring; /* NULL unless uring=on */
+#endif
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -90,9 +131,30 @@ static void launch_script(const char *setup_script, const char *ifname,
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+#ifdef CONFIG_LINUX_IO_URING
+static void tap_uring_rx_start(TAPState *s);
+#endif
 
 static void tap_update_fd_handler(TAPState *s)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        /* Reads are only resubmitted when the peer can take packets */
+        if (s->read_poll && s->enabled) {
+            tap_uring_rx_start(s);
+        }
+        return;
+    }
+#endif
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd,
+                           s->read_poll && s->enabled ? tap_send : NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           NULL, NULL, s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -120,10 +182,383 @@ static void tap_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * io_uring mode: a fixed set of reads stays in flight on the tap fd and
+ * every write is submitted as an sqe, all through the AioContext that runs
+ * the tap.  The event loop then submits and reaps them in batches instead
+ * of doing one read() or writev() syscall per packet.  Reads that complete
+ * in the same event loop iteration reach the peer as one batch.
+ *
+ * The fd is switched to blocking mode, so that io_uring waits for packets
+ * by polling internally instead of failing idle reads with -EAGAIN.
+ */
+
+static void tap_send_completed(NetClientState *nc, ssize_t len);
+
+static AioContext *tap_uring_ctx(TAPState *s)
+{
+    return s->ctx ? s->ctx : qemu_get_aio_context();
+}
+
+static void tap_uring_prep_read(struct io_uring_sqe *sqe, void *opaque)
+{
+    TapUringReq *req = opaque;
+
+    /* tap fds have no file position */
+    io_uring_prep_read(sqe, req->s->fd, req->buf, NET_BUFSIZE, -1);
+}
+
+static void tap_uring_prep_write(struct io_uring_sqe *sqe, void *opaque)
+{
+    TapUringReq *req = opaque;
+
+    io_uring_prep_write(sqe, req->s->fd, req->buf, req->len, -1);
+}
+
+static void tap_uring_prep_cancel(struct io_uring_sqe *sqe, void *opaque)
+{
+    TapUringReq *req = opaque;
+
+#ifdef LIBURING_HAVE_DATA64
+    io_uring_prep_cancel(sqe, (uintptr_t)&req->cqe_handler, 0);
+#else
+    io_uring_prep_cancel(sqe, &req->cqe_handler, 0);
+#endif
+}
+
+/* Hand all completed reads to the peer at once, then read again */
+static void tap_uring_rx_flush(void *opaque)
+{
+    TAPState *s = opaque;
+    TapUring *u = s->uring;
+    uint8_t min_pkt[TAP_URING_RX_DEPTH][ETH_ZLEN];
+    struct iovec iov[TAP_URING_RX_DEPTH];
+    NetPacketVec pkts[TAP_URING_RX_DEPTH];
+    int n = u->rx_nready;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        TapUringReq *req = &u->rx[u->rx_ready[i]];
+        size_t min_pktsz = sizeof(min_pkt[i]);
+        uint8_t *buf = req->buf;
+        size_t size = req->len;
+
+        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+            buf  += s->host_vnet_hdr_len;
+            size -= s->host_vnet_hdr_len;
+        }
+
+        if (net_peer_needs_padding(&s->nc)) {
+            if (eth_pad_short_frame(min_pkt[i], &min_pktsz, buf, size)) {
+                buf = min_pkt[i];
+                size = min_pktsz;
+            }
+        }
+
+        iov[i].iov_base = buf;
+        iov[i].iov_len = size;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+    }
+
+    /* The packets are consumed or copied into the queue on return */
+    if (n && qemu_sendv_packet_batch_async(&s->nc, pkts, n,
+                                           tap_send_completed) < n) {
+        tap_read_poll(s, false);
+    }
+
+    for (i = 0; i < n; i++) {
+        u->rx[u->rx_ready[i]].len = 0;
+    }
+    u->rx_nready = 0;
+
+    if (s->read_poll && s->enabled) {
+        tap_uring_rx_start(s);
+    }
+}
+
+static void tap_uring_rx_readable(void *opaque)
+{
+    TAPState *s = opaque;
+
+    aio_set_fd_handler(tap_uring_ctx(s), s->fd, NULL, NULL, NULL, NULL, NULL);
+    s->uring->rx_fallback = false;
+    tap_update_fd_handler(s);
+}
+
+/*
+ * All reads failed: instead of resubmitting them right away, which would
+ * spin as long as the error persists, wait until the fd becomes readable.
+ */
+static void tap_uring_rx_fallback(TAPState *s)
+{
+    TapUring *u = s->uring;
+    int i;
+
+    if (u->stopped || u->rx_fallback || u->rx_nready ||
+        !s->read_poll || !s->enabled) {
+        return;
+    }
+    for (i = 0; i < TAP_URING_RX_DEPTH; i++) {
+        if (u->rx[i].inflight) {
+            return;
+        }
+    }
+
+    u->rx_fallback = true;
+    aio_set_fd_handler(tap_uring_ctx(s), s->fd, tap_uring_rx_readable, NULL,
+                       NULL, NULL, s);
+}
+
+static void tap_uring_rx_cb(CqeHandler *cqe_handler)
+{
+    TapUringReq *req = container_of(cqe_handler, TapUringReq, cqe_handler);
+    TAPState *s = req->s;
+    TapUring *u = s->uring;
+    int ret = cqe_handler->cqe.res;
+
+    req->inflight = false;
+    u->inflight--;
+
+    if (ret == -ECANCELED) {
+        return;
+    }
+
+    if (ret < 0 && ret != -EAGAIN && ret != -EINTR) {
+        trace_tap_uring_rx_error(s->fd, ret);
+        tap_uring_rx_fallback(s);
+        return;
+    }
+
+    if (ret < 0 ||
+        (s->host_vnet_hdr_len && ret <= s->host_vnet_hdr_len)) {
+        /* Nothing to deliver, resubmit the slot with the next batch */
+        defer_call(tap_uring_rx_flush, s);
+        return;
+    }
+
+    req->len = ret;
+    u->rx_ready[u->rx_nready++] = req - u->rx;
+
+    /* Coalesce with the other reads completed in this event loop pass */
+    defer_call(tap_uring_rx_flush, s);
+}
+
+static void tap_uring_tx_cb(CqeHandler *cqe_handler)
+{
+    TapUringReq *req = container_of(cqe_handler, TapUringReq, cqe_handler);
+    TAPState *s = req->s;
+    TapUring *u = s->uring;
+    int ret = cqe_handler->cqe.res;
+
+    /* tap writes are all or nothing, a short write means a dropped packet */
+    if (ret < 0 || (size_t)ret != req->len) {
+        trace_tap_uring_tx_error(s->fd, ret, req->len);
+        warn_report_once("tap: failed to write packet to fd %d: %s", s->fd,
+                         ret < 0 ? strerror(-ret) : "short write");
+    }
+
+    req->inflight = false;
+    u->tx_free[u->tx_nfree++] = req - u->tx;
+    u->inflight--;
+
+    if (u->tx_full) {
+        u->tx_full = false;
+        qemu_flush_queued_packets(&s->nc);
+    }
+}
+
+static void tap_uring_cancel_cb(CqeHandler *cqe_handler)
+{
+    TapUringReq *req = container_of(cqe_handler, TapUringReq, cancel_handler);
+
+    req->s->uring->inflight--;
+}
+
+static void tap_uring_rx_start(TAPState *s)
+{
+    TapUring *u = s->uring;
+    int i;
+
+    if (u->stopped) {
+        return;
+    }
+
+    assert(qemu_get_current_aio_context() == tap_uring_ctx(s));
+
+    for (i = 0; i < TAP_URING_RX_DEPTH; i++) {
+        TapUringReq *req = &u->rx[i];
+
+        if (!req->inflight && !req->len) {
+            req->inflight = true;
+            u->inflight++;
+            aio_add_sqe(tap_uring_prep_read, req, &req->cqe_handler);
+        }
+    }
+}
+
+/* Returns the packet size, or 0 if all write slots are busy */
+static ssize_t tap_uring_write_packet(TAPState *s, const struct iovec *iov,
+                                      int iovcnt)
+{
+    TapUring *u = s->uring;
+    TapUringReq *req;
+
+    if (!u->tx_nfree) {
+        u->tx_full = true;
+        return 0;
+    }
+
+    req = &u->tx[u->tx_free[--u->tx_nfree]];
+    req->len = iov_size(iov, iovcnt);
+    /*
+     * The iovec belongs to the sender and must not be used after returning,
+     * so copy the packet into the slot's buffer.  Buffers are kept across
+     * writes and only grow, usually just once, to the largest packet size.
+     */
+    if (req->buf_size < req->len) {
+        req->buf_size = MAX(req->len, NET_BUFSIZE);
+        g_free(req->buf);
+        req->buf = g_malloc(req->buf_size);
+    }
+    iov_to_buf(iov, iovcnt, 0, req->buf, req->len);
+    req->inflight = true;
+    u->inflight++;
+    aio_add_sqe(tap_uring_prep_write, req, &req->cqe_handler);
+
+    return req->len;
+}
+
+/*
+ * Cancel the reads and wait for every request to complete.  Must be called
+ * from the AioContext that submitted them.
+ */
+static void tap_uring_drain(TAPState *s)
+{
+    TapUring *u = s->uring;
+    int i;
+
+    u->stopped = true;
+
+    if (u->rx_fallback) {
+        aio_set_fd_handler(tap_uring_ctx(s), s->fd, NULL, NULL, NULL, NULL,
+                           NULL);
+        u->rx_fallback = false;
+    }
+
+    for (i = 0; i < TAP_URING_RX_DEPTH; i++) {
+        TapUringReq *req = &u->rx[i];
+
+        if (req->inflight) {
+            u->inflight++;
+            aio_add_sqe(tap_uring_prep_cancel, req, &req->cancel_handler);
+        }
+    }
+
+    AIO_WAIT_WHILE(tap_uring_ctx(s), u->inflight > 0);
+}
+
+static void tap_uring_start_bh(void *opaque)
+{
+    TAPState *s = opaque;
+    TapUring *u = s->uring;
+
+    qemu_bh_delete(u->start_bh);
+    u->start_bh = NULL;
+    tap_update_fd_handler(s);
+}
+
+/* Requests complete in the AioContext that submitted them */
+static void tap_uring_set_aio_context(TAPState *s, AioContext *ctx)
+{
+    TapUring *u = s->uring;
+
+    tap_uring_drain(s);
+    u->stopped = false;
+    s->ctx = ctx;
+
+    /* Resubmit the reads from the new AioContext */
+    if (u->start_bh) {
+        qemu_bh_delete(u->start_bh);
+    }
+    u->start_bh = aio_bh_new(tap_uring_ctx(s), tap_uring_start_bh, s);
+    qemu_bh_schedule(u->start_bh);
+}
+
+static void tap_uring_cleanup(TAPState *s)
+{
+    TapUring *u = s->uring;
+    int i;
+
+    tap_uring_drain(s);
+
+    if (u->start_bh) {
+        qemu_bh_delete(u->start_bh);
+    }
+    for (i = 0; i < TAP_URING_RX_DEPTH; i++) {
+        g_free(u->rx[i].buf);
+    }
+    for (i = 0; i < TAP_URING_TX_DEPTH; i++) {
+        g_free(u->tx[i].buf);
+    }
+    g_free(u);
+    s->uring = NULL;
+}
+
+static bool tap_uring_init(TAPState *s, Error **errp)
+{
+    TapUring *u;
+    int i;
+
+    if (!aio_has_io_uring()) {
+        error_setg(errp, "uring=on requires io_uring support in the "
+                   "event loop");
+        return false;
+    }
+
+    /* See the comment at the top of the io_uring code */
+    if (!qemu_set_blocking(s->fd, true, errp)) {
+        return false;
+    }
+
+    u = g_new0(TapUring, 1);
+    for (i = 0; i < TAP_URING_RX_DEPTH; i++) {
+        u->rx[i].s = s;
+        u->rx[i].buf = g_malloc(NET_BUFSIZE);
+        u->rx[i].cqe_handler.cb = tap_uring_rx_cb;
+        u->rx[i].cancel_handler.cb = tap_uring_cancel_cb;
+    }
+    for (i = 0; i < TAP_URING_TX_DEPTH; i++) {
+        u->tx[i].s = s;
+        u->tx[i].cqe_handler.cb = tap_uring_tx_cb;
+        u->tx_free[u->tx_nfree++] = i;
+    }
+
+    /* Stop watching the fd, the reads below replace tap_send() */
+    qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    s->uring = u;
+    tap_update_fd_handler(s);
+    return true;
+}
+#else
+static bool tap_uring_init(TAPState *s, Error **errp)
+{
+    error_setg(errp, "uring=on is not supported in this build");
+    return false;
+}
+#endif /* CONFIG_LINUX_IO_URING */
+
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
 {
     ssize_t len;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        return tap_uring_write_packet(s, iov, iovcnt);
+    }
+#endif
+
     len = RETRY_ON_EINTR(writev(s->fd, iov, iovcnt));
 
     if (len == -1 && errno == EAGAIN) {
@@ -177,44 +612,75 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/* Maximum number of packets handed to the peer in one call */
+#define TAP_SEND_BATCH 32
+
+/* Maximum number of packets that one tap_send() call reads */
+#define TAP_SEND_MAX_PACKETS 50
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
     int packets = 0;
+    bool more = true;
 
-    while (true) {
-        uint8_t *buf = s->buf;
-        uint8_t min_pkt[ETH_ZLEN];
-        size_t min_pktsz = sizeof(min_pkt);
+    while (more) {
+        uint8_t min_pkt[TAP_SEND_BATCH][ETH_ZLEN];
+        struct iovec iov[TAP_SEND_BATCH];
+        NetPacketVec pkts[TAP_SEND_BATCH];
+        size_t offset = 0;
+        int n = 0;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+        /*
+         * Read packets back to back into s->buf so that the peer can take
+         * all of them at once.  Each read needs room for a full packet.
+         */
+        while (n < TAP_SEND_BATCH && packets + n < TAP_SEND_MAX_PACKETS &&
+               offset + NET_BUFSIZE <= sizeof(s->buf)) {
+            uint8_t *buf = s->buf + offset;
+            size_t min_pktsz = sizeof(min_pkt[n]);
+            int size;
+
+            size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
+            if (size <= 0) {
+                more = false;
+                break;
+            }
 
-        if (s->host_vnet_hdr_len && size <= s->host_vnet_hdr_len) {
-            /* Invalid packet */
-            break;
-        }
+            if (s->host_vnet_hdr_len && size <= s->host_vnet_hdr_len) {
+                /* Invalid packet */
+                more = false;
+                break;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
-        }
+            offset += ROUND_UP(size, sizeof(uint64_t));
 
-        if (net_peer_needs_padding(&s->nc)) {
-            if (eth_pad_short_frame(min_pkt, &min_pktsz, buf, size)) {
-                buf = min_pkt;
-                size = min_pktsz;
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+
+            if (net_peer_needs_padding(&s->nc)) {
+                if (eth_pad_short_frame(min_pkt[n], &min_pktsz, buf, size)) {
+                    buf = min_pkt[n];
+                    size = min_pktsz;
+                }
             }
+
+            iov[n].iov_base = buf;
+            iov[n].iov_len = size;
+            pkts[n].iov = &iov[n];
+            pkts[n].iovcnt = 1;
+            n++;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
+        if (!n) {
             break;
-        } else if (size < 0) {
+        }
+
+        if (qemu_sendv_packet_batch_async(&s->nc, pkts, n,
+                                          tap_send_completed) < n) {
+            tap_read_poll(s, false);
             break;
         }
 
@@ -224,8 +690,8 @@ static void tap_send(void *opaque)
          * packets that are processed per tap_send() callback to prevent
          * stalling the guest.
          */
-        packets++;
-        if (packets >= 50) {
+        packets += n;
+        if (packets >= TAP_SEND_MAX_PACKETS) {
             break;
         }
     }
@@ -336,6 +802,11 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_uring_cleanup(s);
+    }
+#endif
     close(s->fd);
     s->fd = -1;
 }
@@ -374,6 +845,32 @@ static VHostNetState *tap_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_DRIVER_TAP);
+
+    if (s->ctx == ctx || s->fd < 0) {
+        return;
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring) {
+        tap_uring_set_aio_context(s, ctx);
+        return;
+    }
+#endif
+
+    /* Unregister from the old context before registering in the new one */
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, NULL, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    tap_update_fd_handler(s);
+}
+
 /* fd support */
 
 static NetClientInfo net_tap_info = {
@@ -394,6 +891,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
     .get_vhost_net = tap_get_vhost_net,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -773,6 +1271,16 @@ static void net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
         goto failed;
     }
 
+    if (tap->has_uring && tap->uring) {
+        if (s->vhost_net) {
+            error_setg(errp, "uring=on is not valid with vhost");
+            goto failed;
+        }
+        if (!tap_uring_init(s, errp)) {
+            goto failed;
+        }
+    }
+
     return;
 
 failed:
@@ -70,6 +70,7 @@ typedef struct NetVhostUserState {
     VHostNetState *vhost_net;
     guint watch;
     uint64_t acked_features;
+    uint32_t poll_us;
     bool started;
 } NetVhostUserState;
 
@@ -135,7 +136,7 @@ static int vhost_user_start(int queues, NetClientState *ncs[],
 
         options.net_backend = ncs[i];
         options.opaque      = be;
-        options.busyloop_timeout = 0;
+        options.busyloop_timeout = s->poll_us;
         options.nvqs = 2;
         options.feature_bits = user_feature_bits;
         options.max_tx_queue_size = VIRTQUEUE_MAX_SIZE;
@@ -374,7 +375,7 @@ static void net_vhost_user_event(void *opaque, QEMUChrEvent event)
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
                                const char *name, Chardev *chr,
-                               int queues)
+                               int queues, uint32_t poll_us)
 {
     Error *err = NULL;
     NetClientState *nc, *nc0 = NULL;
@@ -401,6 +402,7 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
         }
         s = DO_UPCAST(NetVhostUserState, nc, nc);
         s->vhost_user = user;
+        s->poll_us = poll_us;
     }
 
     s = DO_UPCAST(NetVhostUserState, nc, nc0);
@@ -480,5 +482,7 @@ int net_init_vhost_user(const Netdev *netdev, const char *name,
         return -1;
     }
 
-    return net_vhost_user_init(peer, "vhost_user", name, chr, queues);
+    return net_vhost_user_init(peer, "vhost_user", name, chr, queues,
+                               vhost_user_opts->has_poll_us ?
+                               vhost_user_opts->poll_us : 0);
 }
@@ -27,6 +27,7 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "monitor/monitor.h"
 #include "migration/misc.h"
+#include "system/iothread.h"
 #include "hw/virtio/vhost.h"
 #include "trace.h"
 
@@ -47,6 +48,9 @@ typedef struct VhostVDPAState {
     /* The device can isolate CVQ in its own ASID */
     bool cvq_isolated;
 
+    /* Thread forwarding the data shadow virtqueues, if any */
+    IOThread *svq_iothread;
+
     bool started;
 } VhostVDPAState;
 
@@ -236,6 +240,7 @@ static void vhost_vdpa_cleanup(NetClientState *nc)
         g_free(s->vhost_net);
         s->vhost_net = NULL;
     }
+    g_clear_pointer(&s->svq_iothread, iothread_destroy);
     if (s->vhost_vdpa.index != 0) {
         return;
     }
@@ -1684,6 +1689,7 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
                                        int nvqs,
                                        bool is_datapath,
                                        bool svq,
+                                       bool svq_iothread,
                                        struct vhost_vdpa_iova_range iova_range,
                                        uint64_t features,
                                        VhostVDPAShared *shared,
@@ -1740,6 +1746,17 @@ static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
     if (queue_pair_index != 0) {
         s->vhost_vdpa.shared = shared;
     }
+    if (is_datapath && svq_iothread) {
+        g_autofree char *id = g_strdup_printf("vhost-vdpa-svq-%s-%d", name,
+                                              queue_pair_index);
+
+        s->svq_iothread = iothread_create(id, errp);
+        if (!s->svq_iothread) {
+            qemu_del_net_client(nc);
+            return NULL;
+        }
+        s->vhost_vdpa.svq_ctx = iothread_get_aio_context(s->svq_iothread);
+    }
 
     ret = vhost_vdpa_add(nc, (void *)&s->vhost_vdpa, queue_pair_index, nvqs);
     if (ret) {
@@ -1865,7 +1882,8 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
         }
         ncs[i] = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                      vdpa_device_fd, i, 2, true, opts->x_svq,
-                                     iova_range, features, shared, errp);
+                                     opts->x_svq_iothread, iova_range,
+                                     features, shared, errp);
         if (!ncs[i])
             goto err;
     }
@@ -1876,8 +1894,8 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
 
         nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
                                  vdpa_device_fd, i, 1, false,
-                                 opts->x_svq, iova_range, features, shared,
-                                 errp);
+                                 opts->x_svq, false, iova_range, features,
+                                 shared, errp);
         if (!nc)
             goto err;
     }
@@ -236,6 +236,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                dirty-ring-reapers=n (threads collecting the KVM dirty rings, default 1)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n"
@@ -296,6 +297,13 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+    ``dirty-ring-reapers=n``
+        When the KVM dirty ring is enabled, collect the rings of all vCPUs
+        with n threads, each handling a share of the vCPUs.  This helps
+        guests with many vCPUs and high dirty rates, whose rings would
+        otherwise fill up while a single thread goes through them.  The
+        default is 1.
+
     ``eager-split-size=n``
         KVM implements dirty page logging at the PAGE_SIZE granularity and
         enabling dirty-logging on a huge-page requires breaking it into
@@ -2885,7 +2893,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "-netdev tap,id=str[,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile]\n"
     "         [,br=bridge][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off]\n"
     "         [,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
-    "         [,poll-us=n]\n"
+    "         [,poll-us=n][,uring=on|off]\n"
     "                configure a host TAP network backend with ID 'str'\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
@@ -2908,6 +2916,7 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "                use 'poll-us=n' to specify the maximum number of microseconds that could be\n"
     "                spent on busy polling for vhost net\n"
+    "                use 'uring=on' to read and write packets through io_uring\n"
     "-netdev bridge,id=str[,br=bridge][,helper=helper]\n"
     "                configure a host TAP network backend with ID 'str' that is\n"
     "                connected to a bridge (default=" DEFAULT_BRIDGE_INTERFACE ")\n"
@@ -2993,8 +3002,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                use 'start-queue=m' to specify the first queue that should be used\n"
 #endif
 #ifdef CONFIG_POSIX
-    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
+    "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off][,poll-us=n]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
+    "                use 'poll-us=n' to let the back-end busy poll for n us\n"
 #endif
 #ifdef __linux__
     "-netdev vhost-vdpa,id=str[,vhostdev=/path/to/dev][,vhostfd=h]\n"
@@ -3431,6 +3441,12 @@ SRST
     ``fd``\ =h can be used to specify the handle of an already opened
     host TAP interface.
 
+    ``uring=on`` keeps several reads in flight on the TAP file descriptor
+    and submits writes through the io_uring of the event loop, so packets
+    are moved in batches rather than with one system call each.  This
+    helps small-packet throughput when vhost-net is not available.  It
+    requires io_uring support and cannot be combined with ``vhost=on``.
+
     Examples:
 
     .. parsed-literal::
@@ -3836,6 +3852,20 @@ SRST
         |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
             -netdev af-xdp,id=n1,ifname=eth0,queues=4
 
+    Each queue can be serviced by its own IOThread by mapping the
+    virtio-net queue pairs to IOThreads.  In an IOThread the receive ring
+    is busy-polled, which avoids a syscall per batch of packets at high
+    packet rates.
+
+    .. parsed-literal::
+
+        |qemu_system| linux.img \\
+            -object iothread,id=io0 -object iothread,id=io1 \\
+            -device '{"driver":"virtio-net-pci","netdev":"n1","mq":true,
+                      "iothread-vq-mapping":[{"iothread":"io0"},
+                                             {"iothread":"io1"}]}' \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=2
+
     'start-queue' option can be specified if a particular range of queues
     [m, m + n] should be in use.  For example, this is may be necessary in
     order to use certain NICs in native mode.  Kernel allows the driver to
@@ -3884,14 +3914,17 @@ SRST
     for insertion into the socket map.  The combination of 'map-path' and
     'sock-fds' together is not supported.
 
-``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
+``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n][,poll-us=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
     specifically defined protocol to pass vhost ioctl replacement
     messages to an application on the other end of the socket. On
     non-MSIX guests, the feature can be forced with vhostforce. Use
     'queues=n' to specify the number of queues to be created for
-    multiqueue vhost-user.
+    multiqueue vhost-user. Use 'poll-us=n' to let the back-end busy poll
+    each virtqueue for up to n microseconds before it waits for a kick;
+    this requires a back-end that offers
+    ``VHOST_USER_PROTOCOL_F_BUSY_POLL``.
 
     Example:
 
@@ -5972,7 +6005,7 @@ SRST
         stored. The file format is libpcap, so it can be analyzed with
         tools such as tcpdump or Wireshark.
 
-    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}]``
+    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}][,compare_threads=@var{n}]``
         Colo-compare gets packet from primary\_in chardevid and
         secondary\_in, then compare whether the payload of primary packet
         and secondary packet are the same. If same, it will output
@@ -5986,6 +6019,10 @@ SRST
         is to set the period of scanning expired primary node network packets.
         The max\_queue\_size=@var{size} is to set the max compare queue
         size depend on user environment.
+        The compare\_threads=@var{n} is to spread the comparison of
+        connections over @var{n} threads: the iothread and n-1 internal
+        ones.  Packets of one connection are always compared by the same
+        thread.
         If user want to use Xen COLO, need to add the notify\_dev to
         notify Xen colo-frame to do checkpoint.
 
@@ -97,6 +97,45 @@ static void dma_blk_unmap(DMAAIOCB *dbs)
     qemu_iovec_reset(&dbs->iov);
 }
 
+/*
+ * Drop the last @bytes of the mapped vector: mappings that fall entirely
+ * within them are unmapped, a partially covered one is shortened, and the
+ * scatter-gather cursor is moved back so the bytes are mapped again for
+ * the next chunk.
+ */
+static void dma_blk_unmap_tail(DMAAIOCB *dbs, size_t bytes)
+{
+    size_t unmapped = bytes;
+
+    while (bytes) {
+        struct iovec *last = &dbs->iov.iov[dbs->iov.niov - 1];
+
+        if (last->iov_len <= bytes) {
+            dma_memory_unmap(dbs->sg->as, last->iov_base, last->iov_len,
+                             dbs->dir, 0);
+            bytes -= last->iov_len;
+            dbs->iov.size -= last->iov_len;
+            dbs->iov.niov--;
+        } else {
+            last->iov_len -= bytes;
+            dbs->iov.size -= bytes;
+            bytes = 0;
+        }
+    }
+
+    while (unmapped) {
+        dma_addr_t n;
+
+        if (dbs->sg_cur_byte == 0) {
+            dbs->sg_cur_index--;
+            dbs->sg_cur_byte = dbs->sg->sg[dbs->sg_cur_index].len;
+        }
+        n = MIN(unmapped, dbs->sg_cur_byte);
+        dbs->sg_cur_byte -= n;
+        unmapped -= n;
+    }
+}
+
 static void dma_complete(DMAAIOCB *dbs, int ret)
 {
     trace_dma_complete(dbs, ret, dbs->common.cb);
@@ -166,6 +205,19 @@ static void dma_blk_cb(void *opaque, int ret)
         }
     }
 
+    /*
+     * Whatever could be mapped is submitted right away, and the rest of the
+     * list is mapped again when it completes.  If mapping stopped early, the
+     * unaligned tail is given back so that the next chunk starts aligned.
+     * The end of the list is submitted as it is, and so is a chunk smaller
+     * than the alignment: trimming it would leave nothing to submit, and
+     * possibly nobody who frees up a mapping for it.
+     */
+    if (dbs->sg_cur_index < dbs->sg->nsg && dbs->iov.size > dbs->align &&
+        !QEMU_IS_ALIGNED(dbs->iov.size, dbs->align)) {
+        dma_blk_unmap_tail(dbs, dbs->iov.size % dbs->align);
+    }
+
     if (dbs->iov.size == 0) {
         trace_dma_map_wait(dbs);
         dbs->bh = aio_bh_new(ctx, reschedule_dma, dbs);
@@ -173,11 +225,6 @@ static void dma_blk_cb(void *opaque, int ret)
         return;
     }
 
-    if (!QEMU_IS_ALIGNED(dbs->iov.size, dbs->align)) {
-        qemu_iovec_discard_back(&dbs->iov,
-                                QEMU_ALIGN_DOWN(dbs->iov.size, dbs->align));
-    }
-
     dbs->acb = dbs->io_func(dbs->offset, &dbs->iov,
                             dma_blk_cb, dbs, dbs->io_func_opaque);
     assert(dbs->acb);
@@ -34,9 +34,11 @@ void flatview_add_to_dispatch(FlatView *fv, MemoryRegionSection *section);
 AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv);
 void address_space_dispatch_compact(AddressSpaceDispatch *d);
 void address_space_dispatch_free(AddressSpaceDispatch *d);
+void address_space_free_bounce_buffers(AddressSpace *as);
 
 void mtree_print_dispatch(struct AddressSpaceDispatch *d,
                           MemoryRegion *root);
+void mtree_print_dispatch_cache_stats(void);
 
 /* returns true if end is big endian. */
 static inline bool devend_big_endian(enum device_endian end)
@@ -743,8 +743,31 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
-/* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView *generate_memory_topology(MemoryRegion *mr)
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i]) ||
+            a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Render a memory topology into a list of disjoint absolute ranges.
+ *
+ * If the result is identical to @old_view, @old_view is reused instead:
+ * its dispatch tree is kept, and address spaces using it see no change,
+ * so their listeners are not walked through the whole map again.
+ */
+static FlatView *generate_memory_topology(MemoryRegion *mr,
+                                          FlatView *old_view)
 {
     int i;
     FlatView *view;
@@ -758,6 +781,14 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     }
     flatview_simplify(view);
 
+    if (old_view && flatview_equal(old_view, view)) {
+        trace_flatview_reuse(old_view, mr);
+        flatview_unref(view);
+        flatview_ref(old_view);
+        g_hash_table_replace(flat_views, mr, old_view);
+        return old_view;
+    }
+
     view->dispatch = address_space_dispatch_new(view);
     for (i = 0; i < view->nr; i++) {
         MemoryRegionSection mrs =
@@ -1047,7 +1078,7 @@ static void flatviews_init(void)
     flat_views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
                                        (GDestroyNotify) flatview_unref);
     if (!empty_view) {
-        empty_view = generate_memory_topology(NULL);
+        empty_view = generate_memory_topology(NULL, NULL);
         /* We keep it alive forever in the global variable.  */
         flatview_ref(empty_view);
     } else {
@@ -1058,15 +1089,13 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /* Render unique FVs, keeping those that did not change */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
 
@@ -1074,7 +1103,37 @@ static void flatviews_reset(void)
             continue;
         }
 
-        generate_memory_topology(physmr);
+        generate_memory_topology(physmr, old_views ?
+                                 g_hash_table_lookup(old_views, physmr) :
+                                 NULL);
+    }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+    }
+}
+
+/*
+ * Listeners with a region_nop hook rebuild their state from scratch on
+ * every transaction, so they must see all ranges even when the view of
+ * @as did not change.
+ */
+static void address_space_replay_nop(AddressSpace *as, FlatView *view)
+{
+    MemoryListener *listener;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(listener, &as->listeners, link_as) {
+        if (listener->region_nop) {
+            break;
+        }
+    }
+    if (!listener) {
+        return;
+    }
+
+    FOR_EACH_FLAT_RANGE(fr, view) {
+        MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, region_nop);
     }
 }
 
@@ -1087,6 +1146,7 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
+        address_space_replay_nop(as, new_view);
         return;
     }
 
@@ -1129,7 +1189,7 @@ static void address_space_update_topology(AddressSpace *as)
 
     flatviews_init();
     if (!g_hash_table_lookup(flat_views, physmr)) {
-        generate_memory_topology(physmr);
+        generate_memory_topology(physmr, NULL);
     }
     address_space_set_flatview(as);
 }
@@ -3254,6 +3314,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
     as->bounce_buffer_size = 0;
+    as->bounce_buffer_pool_depth = DEFAULT_BOUNCE_BUFFER_POOL_DEPTH;
+    qemu_mutex_init(&as->bounce_buffer_pool_lock);
+    QSLIST_INIT(&as->bounce_buffer_pool);
+    as->bounce_buffer_pool_len = 0;
     qemu_mutex_init(&as->map_client_list_lock);
     QLIST_INIT(&as->map_client_list);
     as->name = g_strdup(name ? name : "anonymous");
@@ -3264,6 +3328,8 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 static void do_address_space_destroy(AddressSpace *as)
 {
     assert(qatomic_read(&as->bounce_buffer_size) == 0);
+    address_space_free_bounce_buffers(as);
+    qemu_mutex_destroy(&as->bounce_buffer_pool_lock);
     assert(QLIST_EMPTY(&as->map_client_list));
     qemu_mutex_destroy(&as->map_client_list_lock);
 
@@ -3625,6 +3691,11 @@ static void mtree_info_flatview(bool dispatch_tree, bool owner)
 
     /* Print */
     g_hash_table_foreach(views, mtree_print_flatview, &fvi);
+#if !defined(CONFIG_USER_ONLY)
+    if (dispatch_tree) {
+        mtree_print_dispatch_cache_stats();
+    }
+#endif
 
     /* Free */
     g_hash_table_foreach_remove(views, mtree_info_flatview_free, 0);
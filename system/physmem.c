@@ -26,6 +26,7 @@
 #include "qemu/hbitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/lockable.h"
+#include "qemu/stats64.h"
 
 #ifdef CONFIG_TCG
 #include "accel/tcg/cpu-ops.h"
@@ -139,6 +140,8 @@ typedef struct PhysPageMap {
 
 struct AddressSpaceDispatch {
     MemoryRegionSection *mru_section;
+    /* Unique, never reused; tags this dispatch in the translation caches */
+    uint64_t gen;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -146,6 +149,39 @@ struct AddressSpaceDispatch {
     PhysPageMap map;
 };
 
+/*
+ * Per-thread, direct-mapped cache of phys_page_find() results.  A dispatch
+ * is never modified once it is published, so an entry stays valid for as
+ * long as its dispatch is; entries of older dispatches simply stop
+ * matching because their generation differs.  The counters are per-thread
+ * and are folded into the global statistics every PHYS_XLAT_CACHE_FLUSH
+ * lookups, so that the fast path never writes shared cache lines.
+ */
+#define PHYS_XLAT_CACHE_BITS 5
+#define PHYS_XLAT_CACHE_SIZE (1 << PHYS_XLAT_CACHE_BITS)
+#define PHYS_XLAT_CACHE_FLUSH 1024
+
+typedef struct PhysXlatCacheEntry {
+    uint64_t gen;
+    hwaddr index;
+    MemoryRegionSection *section;
+} PhysXlatCacheEntry;
+
+typedef struct PhysXlatCache {
+    PhysXlatCacheEntry entries[PHYS_XLAT_CACHE_SIZE];
+    unsigned int hits;
+    unsigned int misses;
+} PhysXlatCache;
+
+static __thread PhysXlatCache phys_xlat_cache;
+/*
+ * Last generation handed out, protected by the BQL.  0 is never used so
+ * that empty entries never hit.
+ */
+static uint64_t phys_dispatch_gen;
+static Stat64 phys_xlat_cache_hits;
+static Stat64 phys_xlat_cache_misses;
+
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
@@ -341,6 +377,35 @@ static MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr addr)
     }
 }
 
+/* Called from RCU critical section */
+static MemoryRegionSection *phys_page_find_cached(AddressSpaceDispatch *d,
+                                                  hwaddr addr)
+{
+    PhysXlatCache *cache = &phys_xlat_cache;
+    hwaddr index = addr >> TARGET_PAGE_BITS;
+    PhysXlatCacheEntry *e = &cache->entries[index & (PHYS_XLAT_CACHE_SIZE - 1)];
+    MemoryRegionSection *section;
+
+    if (e->gen == d->gen && e->index == index) {
+        section = e->section;
+        cache->hits++;
+    } else {
+        section = phys_page_find(d, addr);
+        e->gen = d->gen;
+        e->index = index;
+        e->section = section;
+        cache->misses++;
+    }
+
+    if (cache->hits + cache->misses >= PHYS_XLAT_CACHE_FLUSH) {
+        stat64_add(&phys_xlat_cache_hits, cache->hits);
+        stat64_add(&phys_xlat_cache_misses, cache->misses);
+        cache->hits = 0;
+        cache->misses = 0;
+    }
+    return section;
+}
+
 /* Called from RCU critical section */
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
@@ -351,7 +416,7 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
 
     if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
         !section_covers_addr(section, addr)) {
-        section = phys_page_find(d, addr);
+        section = phys_page_find_cached(d, addr);
         qatomic_set(&d->mru_section, section);
     }
     if (resolve_subpage && section->mr->subpage) {
@@ -3028,6 +3093,7 @@ AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv)
     assert(n == PHYS_SECTION_UNASSIGNED);
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
+    d->gen = ++phys_dispatch_gen;
 
     return d;
 }
@@ -3559,14 +3625,65 @@ void address_space_flush_icache_range(AddressSpace *as, hwaddr addr, hwaddr len)
  */
 #define BOUNCE_BUFFER_MAGIC 0xb4017ceb4ffe12ed
 
-typedef struct {
+typedef struct BounceBuffer {
     uint64_t magic;
     MemoryRegion *mr;
     hwaddr addr;
     size_t len;
+    /* Allocated size of @buffer, at least @len */
+    size_t capacity;
+    QSLIST_ENTRY(BounceBuffer) next;
     uint8_t buffer[];
 } BounceBuffer;
 
+/* Take an idle bounce buffer of at least @len bytes, or allocate one */
+static BounceBuffer *address_space_get_bounce_buffer(AddressSpace *as,
+                                                     size_t len)
+{
+    BounceBuffer *bounce;
+
+    WITH_QEMU_LOCK_GUARD(&as->bounce_buffer_pool_lock) {
+        QSLIST_FOREACH(bounce, &as->bounce_buffer_pool, next) {
+            if (bounce->capacity >= len) {
+                QSLIST_REMOVE(&as->bounce_buffer_pool, bounce, BounceBuffer,
+                              next);
+                as->bounce_buffer_pool_len--;
+                return bounce;
+            }
+        }
+    }
+
+    bounce = g_malloc(len + sizeof(BounceBuffer));
+    bounce->capacity = len;
+    return bounce;
+}
+
+/* Return @bounce to the pool, or free it if the pool is full */
+static void address_space_put_bounce_buffer(AddressSpace *as,
+                                            BounceBuffer *bounce)
+{
+    WITH_QEMU_LOCK_GUARD(&as->bounce_buffer_pool_lock) {
+        if (as->bounce_buffer_pool_len < as->bounce_buffer_pool_depth) {
+            QSLIST_INSERT_HEAD(&as->bounce_buffer_pool, bounce, next);
+            as->bounce_buffer_pool_len++;
+            return;
+        }
+    }
+    g_free(bounce);
+}
+
+void address_space_free_bounce_buffers(AddressSpace *as)
+{
+    BounceBuffer *bounce;
+
+    QEMU_LOCK_GUARD(&as->bounce_buffer_pool_lock);
+    while ((bounce = QSLIST_FIRST(&as->bounce_buffer_pool))) {
+        QSLIST_REMOVE_HEAD(&as->bounce_buffer_pool, next);
+        g_free(bounce);
+    }
+    as->bounce_buffer_pool_len = 0;
+}
+
 static void
 address_space_unregister_map_client_do(AddressSpaceMapClient *client)
 {
@@ -3752,7 +3869,8 @@ void *address_space_map(AddressSpace *as,
             return NULL;
         }
 
-        BounceBuffer *bounce = g_malloc0(l + sizeof(BounceBuffer));
+        BounceBuffer *bounce = address_space_get_bounce_buffer(as, l);
+        memset(bounce->buffer, 0, l);
         bounce->magic = BOUNCE_BUFFER_MAGIC;
         memory_region_ref(mr);
         bounce->mr = mr;
@@ -3809,7 +3927,7 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
     qatomic_sub(&as->bounce_buffer_size, bounce->len);
     bounce->magic = ~BOUNCE_BUFFER_MAGIC;
     memory_region_unref(bounce->mr);
-    g_free(bounce);
+    address_space_put_bounce_buffer(as, bounce);
     /* Write bounce_buffer_size before reading map_client_list. */
     smp_mb();
     address_space_notify_map_clients(as);
@@ -4260,6 +4378,17 @@ static void mtree_print_phys_entries(int start, int end, int skip, int ptr)
 #define MR_SIZE(size) (int128_nz(size) ? (hwaddr)int128_get64( \
                            int128_sub((size), int128_one())) : 0)
 
+void mtree_print_dispatch_cache_stats(void)
+{
+    uint64_t hits = stat64_get(&phys_xlat_cache_hits);
+    uint64_t misses = stat64_get(&phys_xlat_cache_misses);
+
+    qemu_printf("Dispatch translation cache: hits=%" PRIu64
+                " misses=%" PRIu64 " hit-rate=%" PRIu64 "%%\n",
+                hits, misses,
+                hits + misses ? hits * 100 / (hits + misses) : 0);
+}
+
 void mtree_print_dispatch(AddressSpaceDispatch *d, MemoryRegion *root)
 {
     int i;
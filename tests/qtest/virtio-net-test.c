@@ -12,6 +12,7 @@
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qobject/qdict.h"
+#include "qobject/qjson.h"
 #include "hw/virtio/virtio-net.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-net.h"
@@ -318,6 +319,90 @@ static void *virtio_net_test_setup_nosocket(GString *cmd_line, void *arg)
     return arg;
 }
 
+/* Takes ownership of @props */
+static void iothread_device_add(QTestState *qts, QDict *props)
+{
+    QDict *args = qdict_clone_shallow(props);
+    QDict *rsp;
+
+    /* A hubport cannot be moved to an IOThread */
+    qtest_qmp_assert_success(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                             " 'type': 'hubport', 'id': 'hp1', 'hubid': 1 } }");
+    qdict_put_str(args, "driver", "virtio-net-pci");
+    qdict_put_str(args, "netdev", "hp1");
+    rsp = qtest_qmp(qts, "{ 'execute': 'device_add', 'arguments': %p }", args);
+    qmp_expect_error_and_unref(rsp, "GenericError");
+
+    /* Without a datapath peer there is nothing to move */
+    qtest_qmp_device_add_qdict(qts, "virtio-net-pci", props);
+    qobject_unref(props);
+
+    /* Announcements are sent while the NIC uses the IOThread */
+    qtest_qmp_assert_success(qts, "{ 'execute': 'announce-self',"
+                             " 'arguments': { 'initial': 20, 'max': 100,"
+                             " 'rounds': 3, 'step': 10 } }");
+}
+
+static void iothread(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev = obj;
+    QTestState *qts = dev->pdev->bus->qts;
+    const char *arch = qtest_get_arch();
+    QDict *rsp;
+
+    if (dev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'device_add', 'arguments': {"
+                    " 'driver': 'virtio-net-pci', 'id': 'net1',"
+                    " 'iothread': 'thread0', 'iothread-vq-mapping':"
+                    " [ { 'iothread': 'thread1' } ] } }");
+    qmp_expect_error_and_unref(rsp, "GenericError");
+
+    iothread_device_add(qts, qdict_from_jsonf_nofail(
+                            "{ 'id': 'net1', 'addr': %s,"
+                            " 'iothread': 'thread0' }",
+                            stringify(PCI_SLOT_HP)));
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qpci_unplug_acpi_device_test(qts, "net1", PCI_SLOT_HP);
+    }
+}
+
+static void iothread_vq_mapping(void *obj, void *data,
+                                QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev = obj;
+    QTestState *qts = dev->pdev->bus->qts;
+    const char *arch = qtest_get_arch();
+
+    if (dev->pdev->bus->not_hotpluggable) {
+        g_test_skip("pci bus does not support hotplug");
+        return;
+    }
+
+    iothread_device_add(qts, qdict_from_jsonf_nofail(
+                            "{ 'id': 'net1', 'addr': %s,"
+                            " 'iothread-vq-mapping': ["
+                            " { 'iothread': 'thread0' },"
+                            " { 'iothread': 'thread1' } ] }",
+                            stringify(PCI_SLOT_HP)));
+
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        qpci_unplug_acpi_device_test(qts, "net1", PCI_SLOT_HP);
+    }
+}
+
+static void *virtio_net_test_setup_iothread(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=thread0"
+                    " -object iothread,id=thread1");
+    return virtio_net_test_setup_nosocket(cmd_line, arg);
+}
+
 static void register_virtio_net_test(void)
 {
     QOSGraphTestOptions opts = { 0 };
@@ -336,6 +421,12 @@ static void register_virtio_net_test(void)
     qos_add_test("large_tx/uint_max", "virtio-net", large_tx, &opts);
     opts.arg = (gpointer)NET_BUFSIZE;
     qos_add_test("large_tx/net_bufsize", "virtio-net", large_tx, &opts);
+
+    opts.before = virtio_net_test_setup_iothread;
+    opts.arg = NULL;
+    qos_add_test("iothread", "virtio-net-pci", iothread, &opts);
+    qos_add_test("iothread-vq-mapping", "virtio-net-pci", iothread_vq_mapping,
+                 &opts);
 }
 
 libqos_init(register_virtio_net_test);
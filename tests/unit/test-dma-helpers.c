@@ -0,0 +1,254 @@
+/*
+ * Scatter-gather DMA helper tests
+ *
+ * Copyright (c) 2026 The QEMU Project Developers
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "system/dma.h"
+
+#define GUEST_SIZE  (64 * 1024)
+#define ALIGN       512
+
+/* Give up instead of hanging when a request never completes */
+#define MAX_POLLS   10000
+
+static AddressSpace test_as;
+static uint8_t guest_mem[GUEST_SIZE];
+static uint8_t disk[GUEST_SIZE];
+
+/*
+ * Like bounce buffers, only map_budget bytes can be mapped at the same
+ * time.  A map client is notified when mappings are released.  As for
+ * bounce buffers, unmapping releases the whole mapping even if the caller
+ * passes a shorter length.
+ */
+static hwaddr map_budget;
+static QEMUBH *map_client;
+static GHashTable *mappings;
+
+static int nr_requests;
+static int64_t request_offset[GUEST_SIZE / ALIGN];
+static size_t request_size[GUEST_SIZE / ALIGN];
+
+void *address_space_map(AddressSpace *as, hwaddr addr,
+                        hwaddr *plen, bool is_write, MemTxAttrs attrs)
+{
+    g_assert(as == &test_as);
+    g_assert_cmpuint(addr + *plen, <=, GUEST_SIZE);
+
+    *plen = MIN(*plen, map_budget);
+    if (!*plen) {
+        return NULL;
+    }
+    map_budget -= *plen;
+    g_assert(!g_hash_table_contains(mappings, guest_mem + addr));
+    g_hash_table_insert(mappings, guest_mem + addr, GSIZE_TO_POINTER(*plen));
+    return guest_mem + addr;
+}
+
+void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
+                         bool is_write, hwaddr access_len)
+{
+    hwaddr mapped = GPOINTER_TO_SIZE(g_hash_table_lookup(mappings, buffer));
+
+    g_assert_cmpuint(len, >, 0);
+    g_assert_cmpuint(len, <=, mapped);
+    g_hash_table_remove(mappings, buffer);
+    map_budget += mapped;
+    if (map_client) {
+        qemu_bh_schedule(map_client);
+        map_client = NULL;
+    }
+}
+
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
+{
+    g_assert(!map_client);
+
+    /* As in physmem, retry right away if anything can be mapped */
+    if (map_budget) {
+        qemu_bh_schedule(bh);
+    } else {
+        map_client = bh;
+    }
+}
+
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
+{
+    g_assert(map_client == bh);
+    map_client = NULL;
+}
+
+MemTxResult address_space_rw(AddressSpace *as, hwaddr addr, MemTxAttrs attrs,
+                             void *buf, hwaddr len, bool is_write)
+{
+    g_assert_not_reached();
+}
+
+MemTxResult address_space_set(AddressSpace *as, hwaddr addr,
+                              uint8_t c, hwaddr len, MemTxAttrs attrs)
+{
+    g_assert_not_reached();
+}
+
+typedef struct TestAIOCB {
+    BlockAIOCB common;
+} TestAIOCB;
+
+static const AIOCBInfo test_aiocb_info = {
+    .aiocb_size = sizeof(TestAIOCB),
+};
+
+static void test_io_complete(void *opaque)
+{
+    TestAIOCB *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_aio_unref(acb);
+}
+
+/* Reads from the disk image and completes in a BH, like the block layer */
+static BlockAIOCB *test_io_func(int64_t offset, QEMUIOVector *iov,
+                                BlockCompletionFunc *cb, void *cb_opaque,
+                                void *opaque)
+{
+    TestAIOCB *acb = qemu_aio_get(&test_aiocb_info, NULL, cb, cb_opaque);
+
+    g_assert_cmpuint(nr_requests, <, ARRAY_SIZE(request_offset));
+    g_assert_cmpuint(iov->size, >, 0);
+    request_offset[nr_requests] = offset;
+    request_size[nr_requests] = iov->size;
+    nr_requests++;
+
+    qemu_iovec_from_buf(iov, 0, disk + offset, iov->size);
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), test_io_complete, acb);
+    return &acb->common;
+}
+
+static void test_dma_cb(void *opaque, int ret)
+{
+    int *result = opaque;
+
+    *result = ret;
+}
+
+/*
+ * Read the disk into the guest memory described by @sg, with at most
+ * @budget bytes mapped at the same time, and check that it completes
+ * with the right data.
+ */
+static void do_read(const ScatterGatherEntry *sg, int nsg, hwaddr budget)
+{
+    QEMUSGList qsg;
+    hwaddr offset = 0;
+    int result = -EINPROGRESS;
+    int i, polls;
+
+    for (i = 0; i < GUEST_SIZE; i++) {
+        disk[i] = g_test_rand_int();
+    }
+    memset(guest_mem, 0, sizeof(guest_mem));
+    map_budget = budget;
+    nr_requests = 0;
+
+    qemu_sglist_init(&qsg, NULL, nsg, &test_as);
+    for (i = 0; i < nsg; i++) {
+        qemu_sglist_add(&qsg, sg[i].base, sg[i].len);
+    }
+
+    dma_blk_io(&qsg, 0, ALIGN, test_io_func, NULL, test_dma_cb, &result,
+               DMA_DIRECTION_FROM_DEVICE);
+    for (polls = 0; result == -EINPROGRESS && polls < MAX_POLLS; polls++) {
+        aio_poll(qemu_get_aio_context(), false);
+    }
+    g_assert_cmpint(result, ==, 0);
+
+    /* Requests are contiguous, and only the last one may be unaligned */
+    for (i = 0; i < nr_requests; i++) {
+        g_assert_cmpint(request_offset[i], ==, offset);
+        offset += request_size[i];
+        if (request_size[i] >= ALIGN && i < nr_requests - 1) {
+            g_assert_cmpuint(request_size[i] % ALIGN, ==, 0);
+        }
+    }
+    g_assert_cmpuint(offset, ==, qsg.size);
+
+    offset = 0;
+    for (i = 0; i < nsg; i++) {
+        g_assert(!memcmp(guest_mem + sg[i].base, disk + offset, sg[i].len));
+        offset += sg[i].len;
+    }
+
+    /* Every mapping was released */
+    g_assert_cmpuint(map_budget, ==, budget);
+    g_assert(!map_client);
+    g_assert_cmpuint(g_hash_table_size(mappings), ==, 0);
+    qemu_sglist_destroy(&qsg);
+}
+
+static void test_aligned(void)
+{
+    const ScatterGatherEntry sg[] = {
+        { .base = 0, .len = 1024 },
+        { .base = 8192, .len = 3072 },
+    };
+
+    do_read(sg, ARRAY_SIZE(sg), GUEST_SIZE);
+    g_assert_cmpint(nr_requests, ==, 1);
+
+    do_read(sg, ARRAY_SIZE(sg), 1536);
+    g_assert_cmpint(nr_requests, ==, 3);
+}
+
+static void test_unaligned_total(void)
+{
+    const ScatterGatherEntry sg[] = {
+        { .base = 0, .len = 700 },
+        { .base = 4096, .len = 700 },
+        { .base = 8192, .len = 300 },
+    };
+
+    /* The whole list is mapped, nothing may be held back */
+    do_read(sg, ARRAY_SIZE(sg), GUEST_SIZE);
+    g_assert_cmpint(nr_requests, ==, 1);
+
+    /* The unaligned rest is submitted once it is the end of the list */
+    do_read(sg, ARRAY_SIZE(sg), 1024);
+    g_assert_cmpint(nr_requests, ==, 2);
+    g_assert_cmpuint(request_size[0], ==, 1024);
+    g_assert_cmpuint(request_size[1], ==, 676);
+
+    /* The tail is trimmed while the list is mapped in parts */
+    do_read(sg, ARRAY_SIZE(sg), 600);
+    g_assert_cmpuint(request_size[0], ==, 512);
+}
+
+static void test_unaligned_small_budget(void)
+{
+    const ScatterGatherEntry sg[] = {
+        { .base = 0, .len = 1000 },
+    };
+
+    /* Less than the alignment can be mapped at a time */
+    do_read(sg, ARRAY_SIZE(sg), 300);
+    g_assert_cmpint(nr_requests, ==, 4);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+    mappings = g_hash_table_new(NULL, NULL);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/dma/blk-io/aligned", test_aligned);
+    g_test_add_func("/dma/blk-io/unaligned-total", test_unaligned_total);
+    g_test_add_func("/dma/blk-io/unaligned-small-budget",
+                    test_unaligned_small_budget);
+
+    return g_test_run();
+}
@@ -62,18 +62,31 @@
 #include "qemu/mmap-alloc.h"
 
 #define MAX_MEM_PREALLOC_THREAD_COUNT 16
+/* Granularity at which background preallocation reports progress */
+#define MEM_PREALLOC_BACKGROUND_CHUNK (256 * MiB)
 
 struct MemsetThread;
 
 static QLIST_HEAD(, MemsetContext) memset_contexts =
     QLIST_HEAD_INITIALIZER(memset_contexts);
 
+/* Background preallocation that has not been completed yet, BQL protected */
+static QLIST_HEAD(, MemsetContext) memset_background_contexts =
+    QLIST_HEAD_INITIALIZER(memset_background_contexts);
+
 typedef struct MemsetContext {
     bool all_threads_created;
     bool any_thread_failed;
     struct MemsetThread *threads;
     int num_threads;
     QLIST_ENTRY(MemsetContext) next;
+
+    /* Only used for background preallocation */
+    int threads_running;
+    bool cancelled;
+    size_t *done;
+    QemuPreallocDoneFn *done_cb;
+    void *done_opaque;
 } MemsetContext;
 
 struct MemsetThread {
@@ -440,6 +453,85 @@ static void *do_madv_populate_write_pages(void *arg)
     return (void *)(uintptr_t)ret;
 }
 
+static int wait_and_free_mem_prealloc_context(MemsetContext *context);
+
+static void prealloc_background_complete(MemsetContext *context)
+{
+    QemuPreallocDoneFn *cb = context->done_cb;
+    void *cb_opaque = context->done_opaque;
+
+    QLIST_REMOVE(context, next);
+    cb(cb_opaque, wait_and_free_mem_prealloc_context(context));
+}
+
+static void prealloc_background_done_bh(void *opaque)
+{
+    MemsetContext *context, *next_context;
+
+    /* The context may already be gone if it was cancelled */
+    QLIST_FOREACH_SAFE(context, &memset_background_contexts, next,
+                       next_context) {
+        if (!qatomic_read(&context->threads_running)) {
+            prealloc_background_complete(context);
+        }
+    }
+}
+
+static void *do_background_populate_pages(void *arg)
+{
+    MemsetThread *memset_args = (MemsetThread *)arg;
+    MemsetContext *context = memset_args->context;
+    const size_t size = memset_args->numpages * memset_args->hpagesize;
+    const size_t chunk = QEMU_ALIGN_UP(MEM_PREALLOC_BACKGROUND_CHUNK,
+                                       memset_args->hpagesize);
+    char * const addr = memset_args->addr;
+    size_t offset;
+    int ret = 0;
+
+    /* See do_touch_pages(). */
+    qemu_mutex_lock(&page_mutex);
+    while (!context->all_threads_created) {
+        qemu_cond_wait(&page_cond, &page_mutex);
+    }
+    qemu_mutex_unlock(&page_mutex);
+
+    for (offset = 0; offset < size; offset += chunk) {
+        size_t len = MIN(chunk, size - offset);
+
+        if (qatomic_read(&context->cancelled)) {
+            ret = -ECANCELED;
+            break;
+        }
+        if (qemu_madvise(addr + offset, len, QEMU_MADV_POPULATE_WRITE)) {
+            ret = -errno;
+            break;
+        }
+        qatomic_add(context->done, len);
+    }
+
+    /*
+     * The last thread hands the context back to the main loop.  It must not
+     * be touched afterwards, qemu_cancel_background_prealloc_mem() may free
+     * it at any time.
+     */
+    if (qatomic_fetch_dec(&context->threads_running) == 1) {
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                prealloc_background_done_bh, NULL);
+    }
+    return (void *)(uintptr_t)ret;
+}
+
+static void memset_init_once(void)
+{
+    static gsize initialized;
+
+    if (g_once_init_enter(&initialized)) {
+        qemu_mutex_init(&page_mutex);
+        qemu_cond_init(&page_cond);
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
 static inline int get_memset_num_threads(size_t hpagesize, size_t numpages,
                                          int max_threads)
 {
@@ -479,7 +571,6 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
                            int max_threads, ThreadContext *tc, bool async,
                            bool use_madv_populate_write)
 {
-    static gsize initialized = 0;
     MemsetContext *context = g_malloc0(sizeof(MemsetContext));
     size_t numpages_per_thread, leftover;
     void *(*touch_fn)(void *);
@@ -497,11 +588,7 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     context->num_threads =
         get_memset_num_threads(hpagesize, numpages, max_threads);
 
-    if (g_once_init_enter(&initialized)) {
-        qemu_mutex_init(&page_mutex);
-        qemu_cond_init(&page_cond);
-        g_once_init_leave(&initialized, 1);
-    }
+    memset_init_once();
 
     if (use_madv_populate_write) {
         /*
@@ -610,6 +697,85 @@ static bool madv_populate_write_possible(char *area, size_t pagesize)
            errno != EINVAL;
 }
 
+bool qemu_prealloc_mem_background(int fd, char *area, size_t sz,
+                                  int max_threads, ThreadContext *tc,
+                                  size_t *done, QemuPreallocDoneFn *cb,
+                                  void *opaque, Error **errp)
+{
+#ifndef EMSCRIPTEN
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+#else
+    size_t hpagesize = qemu_real_host_page_size();
+#endif
+    size_t numpages = DIV_ROUND_UP(sz, hpagesize);
+    size_t numpages_per_thread, leftover;
+    MemsetContext *context;
+    char *addr = area;
+    int i;
+
+    /*
+     * Touching pages relies on a temporary SIGBUS handler, which cannot
+     * stay installed while the guest runs.
+     */
+    if (!madv_populate_write_possible(area, hpagesize)) {
+        error_setg(errp, "background preallocation requires "
+                   "MADV_POPULATE_WRITE support");
+        return false;
+    }
+
+    memset_init_once();
+
+    context = g_new0(MemsetContext, 1);
+    QLIST_INSERT_HEAD(&memset_background_contexts, context, next);
+    context->num_threads =
+        get_memset_num_threads(hpagesize, numpages, max_threads);
+    context->threads_running = context->num_threads;
+    context->done = done;
+    context->done_cb = cb;
+    context->done_opaque = opaque;
+    context->threads = g_new0(MemsetThread, context->num_threads);
+
+    numpages_per_thread = numpages / context->num_threads;
+    leftover = numpages % context->num_threads;
+    for (i = 0; i < context->num_threads; i++) {
+        context->threads[i].addr = addr;
+        context->threads[i].numpages = numpages_per_thread + (i < leftover);
+        context->threads[i].hpagesize = hpagesize;
+        context->threads[i].context = context;
+        if (tc) {
+            thread_context_create_thread(tc, &context->threads[i].pgthread,
+                                         "touch_pages",
+                                         do_background_populate_pages,
+                                         &context->threads[i],
+                                         QEMU_THREAD_JOINABLE);
+        } else {
+            qemu_thread_create(&context->threads[i].pgthread, "touch_pages",
+                               do_background_populate_pages,
+                               &context->threads[i], QEMU_THREAD_JOINABLE);
+        }
+        addr += context->threads[i].numpages * hpagesize;
+    }
+
+    qemu_mutex_lock(&page_mutex);
+    context->all_threads_created = true;
+    qemu_cond_broadcast(&page_cond);
+    qemu_mutex_unlock(&page_mutex);
+    return true;
+}
+
+void qemu_cancel_background_prealloc_mem(void)
+{
+    MemsetContext *context;
+
+    assert(bql_locked());
+    QLIST_FOREACH(context, &memset_background_contexts, next) {
+        qatomic_set(&context->cancelled, true);
+    }
+    while ((context = QLIST_FIRST(&memset_background_contexts))) {
+        prealloc_background_complete(context);
+    }
+}
+
 bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
                        ThreadContext *tc, bool async, Error **errp)
 {
@@ -279,6 +279,20 @@ bool qemu_prealloc_mem(int fd, char *area, size_t sz, int max_threads,
     return true;
 }
 
+bool qemu_prealloc_mem_background(int fd, char *area, size_t sz,
+                                  int max_threads, ThreadContext *tc,
+                                  size_t *done, QemuPreallocDoneFn *cb,
+                                  void *opaque, Error **errp)
+{
+    error_setg(errp, "background preallocation is not supported on this host");
+    return false;
+}
+
+void qemu_cancel_background_prealloc_mem(void)
+{
+    /* background prealloc not supported, there is nothing to cancel */
+}
+
 bool qemu_finish_async_prealloc_mem(Error **errp)
 {
     /* async prealloc not supported, there is nothing to finish */